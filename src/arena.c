@@ -0,0 +1,119 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+static size_t arena_align_up(size_t n, size_t align) { return (n + align - 1) & ~(align - 1); }
+
+void arena_init(Arena *a) {
+    if (!a)
+        return;
+    memset(a, 0, sizeof(*a));
+}
+
+static ArenaBlock *arena_block_new(Arena *a, size_t min_size) {
+    size_t cap = ARENA_BLOCK_SIZE - sizeof(ArenaBlock);
+    if (min_size > cap)
+        cap = min_size;
+
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+    if (!b)
+        return NULL;
+
+    b->used = 0;
+    b->cap = cap;
+
+    /* Oversized blocks go behind the head so the current block keeps filling */
+    if (a->head && cap > ARENA_BLOCK_SIZE - sizeof(ArenaBlock)) {
+        b->next = a->head->next;
+        a->head->next = b;
+    } else {
+        b->next = a->head;
+        a->head = b;
+    }
+
+    a->bytes_reserved += cap;
+    return b;
+}
+
+static void *arena_bump(Arena *a, size_t size, size_t align) {
+    ArenaBlock *b = a->head;
+    size_t off = b ? arena_align_up(b->used, align) : 0;
+
+    if (!b || off > b->cap || b->cap - off < size) {
+        b = arena_block_new(a, size);
+        if (!b)
+            return NULL;
+        off = arena_align_up(b->used, align);
+    }
+
+    void *p = (unsigned char *)b->data + off;
+    a->bytes_used += off + size - b->used;
+    b->used = off + size;
+    return p;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    if (!a)
+        return NULL;
+
+    if (size == 0)
+        size = 1;
+
+    void *p = arena_bump(a, size, ARENA_ALIGN);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t len) {
+    if (!a || !s)
+        return NULL;
+
+    /* Strings need no alignment, pack them tightly */
+    char *p = arena_bump(a, len + 1, 1);
+    if (!p)
+        return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena_strdup(Arena *a, const char *s) { return arena_strndup(a, s, strlen(s)); }
+
+void arena_adopt(Arena *dst, Arena *src) {
+    if (!dst || !src || !src->head)
+        return;
+
+    ArenaBlock *tail = src->head;
+    while (tail->next)
+        tail = tail->next;
+
+    /* Keep dst's current block at the head so it keeps filling */
+    if (dst->head) {
+        tail->next = dst->head->next;
+        dst->head->next = src->head;
+    } else {
+        dst->head = src->head;
+    }
+
+    dst->bytes_used += src->bytes_used;
+    dst->bytes_reserved += src->bytes_reserved;
+    arena_init(src);
+}
+
+void arena_destroy(Arena *a) {
+    if (!a)
+        return;
+
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    arena_init(a);
+}
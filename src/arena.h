@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/* Bump allocator block */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    max_align_t data[];
+} ArenaBlock;
+
+/* Bump allocator: everything is released at once by arena_destroy */
+typedef struct {
+    ArenaBlock *head;
+    size_t bytes_used;
+    size_t bytes_reserved;
+} Arena;
+
+void arena_init(Arena *a);
+
+/* Zeroed, max_align_t aligned allocation; NULL on OOM */
+void *arena_alloc(Arena *a, size_t size);
+
+char *arena_strdup(Arena *a, const char *s);
+char *arena_strndup(Arena *a, const char *s, size_t len);
+
+/* Move all blocks of src into dst; src is left empty */
+void arena_adopt(Arena *dst, Arena *src);
+
+/* Release every block and reset the arena to its initial state */
+void arena_destroy(Arena *a);
+
+#endif /* ARENA_H */
@@ -0,0 +1,23 @@
+#!/bin/sh
+# gen_modules.sh DIR [MODULES]: module tree for scan_bench. Each module
+# (default 40) gets system/bench with 8x6x3 nested directories and one file
+# per leaf; the directories are shared, so the modules merge in the tree.
+set -e
+
+dir=${1:?usage: gen_modules.sh DIR [MODULES]}
+modules=${2:-40}
+
+m=0
+while [ "$m" -lt "$modules" ]; do
+    mod=$(printf '%s/bench_%03d' "$dir" "$m")
+    for a in 0 1 2 3 4 5 6 7; do
+        for b in 0 1 2 3 4 5; do
+            for c in 0 1 2; do
+                leaf="$mod/system/bench/d$a/e$b/f$c"
+                mkdir -p "$leaf"
+                : > "$leaf/file_$m"
+            done
+        done
+    done
+    m=$((m + 1))
+done
@@ -0,0 +1,43 @@
+#!/bin/sh
+# gen_walk_modules.sh DIR [MODULES]: module tree for walk_bench, shaped like
+# a real module set. Each module (default 300) gets system/etc/permissions
+# with 5 files, system/app with 20 apps (apk, odex, 3 libs) and
+# system/lib64 with 100 libraries; 91.5k nodes once merged.
+set -e
+
+dir=${1:?usage: gen_walk_modules.sh DIR [MODULES]}
+modules=${2:-300}
+
+m=0
+while [ "$m" -lt "$modules" ]; do
+    sys=$(printf '%s/mod%03d/system' "$dir" "$m")
+    dirs="$sys/etc/permissions $sys/lib64"
+    a=0
+    while [ "$a" -lt 20 ]; do
+        dirs="$dirs $sys/app/App${m}_$a/oat/arm64 $sys/app/App${m}_$a/lib/arm64"
+        a=$((a + 1))
+    done
+    mkdir -p $dirs
+
+    i=0
+    while [ "$i" -lt 5 ]; do
+        : > "$sys/etc/permissions/p${m}_$i.xml"
+        i=$((i + 1))
+    done
+    a=0
+    while [ "$a" -lt 20 ]; do
+        app="$sys/app/App${m}_$a"
+        : > "$app/App$a.apk"
+        : > "$app/oat/arm64/App$a.odex"
+        for l in 0 1 2; do
+            : > "$app/lib/arm64/libapp$l.so"
+        done
+        a=$((a + 1))
+    done
+    i=0
+    while [ "$i" -lt 100 ]; do
+        : > "$sys/lib64/libm${m}_$i.so"
+        i=$((i + 1))
+    done
+    m=$((m + 1))
+done
@@ -0,0 +1,99 @@
+/* node_bench: cost of node_child_append and node_child_find by directory
+ * width, for tuning NODE_INDEX_THRESHOLD. `make bench` builds it twice, with
+ * the threshold under test and with indexing off (a plain linear scan), and
+ * runs both. Lookups are half hits, half misses on one warm directory.
+ */
+#include "arena.h"
+#include "module_tree.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_LOOKUPS (1u << 22) /* per width */
+#define BENCH_APPENDS (1u << 18) /* per width, over as many directories as it takes */
+#define BENCH_NAME_MAX 40
+
+static const unsigned widths[] = {4, 8, 16, 32, 64, 128, 512, 2048};
+
+/* Names shaped like a lib directory's: long shared prefix, short tail */
+static char (*bench_names(unsigned n))[BENCH_NAME_MAX] {
+    char (*names)[BENCH_NAME_MAX] = malloc(2 * (size_t)n * BENCH_NAME_MAX);
+    if (!names)
+        return NULL;
+
+    for (unsigned i = 0; i < n; ++i) {
+        snprintf(names[i], BENCH_NAME_MAX, "libvendor.component_%u.so", i);
+        snprintf(names[n + i], BENCH_NAME_MAX, "libvendor.missing_%u.so", i);
+    }
+    return names;
+}
+
+/* ns per append and per lookup into a directory of width children */
+static int bench_width(unsigned width, double *append_ns, double *find_ns) {
+    char (*names)[BENCH_NAME_MAX] = bench_names(width);
+    unsigned dirs = BENCH_APPENDS / width ? BENCH_APPENDS / width : 1;
+    Node **parents = calloc(dirs, sizeof(*parents));
+    Arena a;
+    int ret = -1;
+
+    arena_init(&a);
+    if (!names || !parents)
+        goto out;
+
+    /* Nodes first, so only the appends are timed */
+    Node **kids = arena_alloc(&a, (size_t)dirs * width * sizeof(*kids));
+    if (!kids)
+        goto out;
+    for (unsigned d = 0; d < dirs; ++d) {
+        parents[d] = node_new(&a, "lib64", NFT_DIRECTORY);
+        for (unsigned i = 0; i < width; ++i)
+            kids[(size_t)d * width + i] = node_new(&a, names[i], NFT_REGULAR);
+        if (!parents[d] || !kids[(size_t)d * width + width - 1])
+            goto out;
+    }
+
+    uint64_t t = monotonic_ns();
+    for (unsigned d = 0; d < dirs; ++d) {
+        for (unsigned i = 0; i < width; ++i) {
+            if (node_child_append(&a, parents[d], kids[(size_t)d * width + i]) != 0)
+                goto out;
+        }
+    }
+    *append_ns = (double)(monotonic_ns() - t) / ((double)dirs * width);
+
+    /* Stride through hits and misses alike; the stride is odd and the name
+     * count a power of two, so every name comes up
+     */
+    unsigned mask = 2 * width - 1, hits = 0;
+    t = monotonic_ns();
+    for (unsigned i = 0; i < BENCH_LOOKUPS; ++i)
+        hits += node_child_find(parents[0], names[(i * 7919u) & mask]) != NULL;
+    *find_ns = (double)(monotonic_ns() - t) / BENCH_LOOKUPS;
+
+    if (hits != BENCH_LOOKUPS / 2) {
+        fprintf(stderr, "node_bench: %u hits of %u lookups at width %u\n", hits, BENCH_LOOKUPS,
+                width);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    arena_destroy(&a);
+    free(parents);
+    free(names);
+    return ret;
+}
+
+int main(void) {
+    printf("NODE_INDEX_THRESHOLD %u\n", (unsigned)NODE_INDEX_THRESHOLD);
+    printf("%10s %12s %12s\n", "children", "append (ns)", "find (ns)");
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+        double append_ns, find_ns;
+
+        if (bench_width(widths[i], &append_ns, &find_ns) != 0)
+            return 1;
+        printf("%10u %12.1f %12.1f\n", widths[i], append_ns, find_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* scan_bench MODULE_DIR [sync|uring] [JOBS] [REPS] [cold]: time
+ * build_mount_tree over MODULE_DIR (see gen_modules.sh) with the given scan
+ * I/O and threads, tree cache off. cold drops the page cache before every
+ * run, which takes root.
+ */
+#include "magic_mount.h"
+#include "module_tree.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+long syscall(long number, ...);
+
+static int drop_caches(void) {
+    FILE *fp = fopen("/proc/sys/vm/drop_caches", "we");
+    if (!fp)
+        return -1;
+
+    syscall(SYS_sync);
+    int ret = fputs("3\n", fp) < 0 ? -1 : 0;
+    if (fclose(fp) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODULE_DIR [sync|uring] [JOBS] [REPS] [cold]\n", argv[0]);
+        return 2;
+    }
+
+    const char *io = argc > 2 ? argv[2] : "sync";
+    int jobs = argc > 3 ? atoi(argv[3]) : 1;
+    int reps = argc > 4 ? atoi(argv[4]) : 6;
+    bool cold = argc > 5 && !strcmp(argv[5], "cold");
+
+    if (strcmp(io, "sync") != 0 && strcmp(io, "uring") != 0) {
+        fprintf(stderr, "scan_bench: unknown scan I/O '%s'\n", io);
+        return 2;
+    }
+    if (jobs < 1)
+        jobs = 1;
+    if (reps < 1)
+        reps = 1;
+
+    uint64_t *ns = calloc((size_t)reps, sizeof(*ns));
+    if (!ns)
+        return 1;
+    log_set_level(LOG_ERROR);
+
+    int nodes = 0;
+    for (int i = 0; i < reps; ++i) {
+        MagicMount ctx;
+
+        if (cold && drop_caches() != 0) {
+            perror("scan_bench: drop_caches");
+            free(ns);
+            return 1;
+        }
+
+        magic_mount_init(&ctx);
+        ctx.module_dir = argv[1];
+        ctx.tree_cache = NULL;
+        ctx.scan_jobs = jobs;
+        ctx.scan_io = !strcmp(io, "uring") ? SCAN_IO_URING : SCAN_IO_SYNC;
+
+        uint64_t t = monotonic_ns();
+        Node *root = build_mount_tree(&ctx);
+        ns[i] = monotonic_ns() - t;
+        nodes = ctx.stats.nodes_total;
+        magic_mount_cleanup(&ctx);
+
+        if (!root) {
+            fprintf(stderr, "scan_bench: no tree from %s\n", argv[1]);
+            free(ns);
+            return 1;
+        }
+    }
+
+    printf("%-5s -j %d %s: %d nodes, build_mount_tree ms:", io, jobs, cold ? "cold" : "hot",
+           nodes);
+    for (int i = 0; i < reps; ++i)
+        printf(" %.1f", (double)ns[i] / 1e6);
+    qsort(ns, (size_t)reps, sizeof(*ns), cmp_u64);
+    printf(" (median %.1f)\n", (double)ns[reps / 2] / 1e6);
+
+    free(ns);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* walk_bench MODULE_DIR [REPS]: cost of walking the mount tree, for node
+ * layout changes. Builds the tree of MODULE_DIR (see gen_walk_modules.sh)
+ * REPS times, tree cache off, and reports the means of the build, the arena
+ * size, a plain walk and a walk that also looks every child up by name,
+ * which is the per-directory work of the mount pass.
+ */
+#include "magic_mount.h"
+#include "module_tree.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define WALK_ITERS 50 /* walks timed per build */
+
+/* Trees from before inline children kept them in a plain array, so the
+ * bench also builds against older sources for a before/after comparison
+ */
+#ifdef NODE_INLINE_CHILDREN
+#define WALK_KIDS(n) node_children(n)
+#else
+#define WALK_KIDS(n) ((n)->children)
+#endif
+
+/* Not monotonic_ns, which older sources lack */
+static uint64_t walk_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Read every node's flags and first name byte */
+static size_t walk_plain(const Node *n) {
+    size_t acc = (size_t)n->type + n->replace + n->skip + (unsigned char)n->name[0];
+    Node *const *kids = WALK_KIDS(n);
+
+    for (size_t i = 0; i < n->child_count; ++i)
+        acc += walk_plain(kids[i]);
+    return acc;
+}
+
+/* As mm_check_need_tmpfs then the apply: look at each child's type, find
+ * each child by name, then descend
+ */
+static size_t walk_lookup(Node *n) {
+    size_t acc = (size_t)n->type + n->replace + n->skip + (unsigned char)n->name[0];
+    Node *const *kids = WALK_KIDS(n);
+
+    if (n->type != NFT_DIRECTORY)
+        return acc;
+
+    for (size_t i = 0; i < n->child_count; ++i) {
+        acc += kids[i]->type == NFT_SYMLINK;
+        acc += node_child_find(n, kids[i]->name) == kids[i];
+    }
+    for (size_t i = 0; i < n->child_count; ++i)
+        acc += walk_lookup(kids[i]);
+    return acc;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MODULE_DIR [REPS]\n", argv[0]);
+        return 2;
+    }
+
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (reps < 1)
+        reps = 1;
+    log_set_level(LOG_ERROR);
+
+    uint64_t build_ns = 0, plain_ns = 0, lookup_ns = 0;
+    size_t arena_bytes = 0, acc = 0;
+    int nodes = 0;
+
+    for (int r = 0; r < reps; ++r) {
+        MagicMount ctx;
+
+        magic_mount_init(&ctx);
+        ctx.module_dir = argv[1];
+        ctx.tree_cache = NULL;
+
+        uint64_t t = walk_now_ns();
+        Node *root = build_mount_tree(&ctx);
+        build_ns += walk_now_ns() - t;
+        if (!root || ctx.stats.nodes_total <= 0) {
+            fprintf(stderr, "walk_bench: no tree from %s\n", argv[1]);
+            magic_mount_cleanup(&ctx);
+            return 1;
+        }
+        nodes = ctx.stats.nodes_total;
+        arena_bytes = ctx.arena.bytes_used;
+
+        /* One untimed pass of each warms the cache */
+        acc += walk_plain(root) + walk_lookup(root);
+
+        t = walk_now_ns();
+        for (int i = 0; i < WALK_ITERS; ++i)
+            acc += walk_plain(root);
+        plain_ns += walk_now_ns() - t;
+
+        t = walk_now_ns();
+        for (int i = 0; i < WALK_ITERS; ++i)
+            acc += walk_lookup(root);
+        lookup_ns += walk_now_ns() - t;
+
+        magic_mount_cleanup(&ctx);
+    }
+
+    double walks = (double)reps * WALK_ITERS * nodes;
+    printf("%d nodes, mean of %d builds (checksum %zu)\n", nodes, reps, acc);
+    printf("  arena bytes           %10zu\n", arena_bytes);
+    printf("  tree build            %10.1f ms\n", (double)build_ns / reps / 1e6);
+    printf("  plain walk            %10.1f ns/node\n", (double)plain_ns / walks);
+    printf("  walk + child lookups  %10.1f ns/node\n", (double)lookup_ns / walks);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include "fs_ops.h"
+#include "ksu.h"
+#include "mount_api.h"
+
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+static int real_create(const char *path, mode_t mode) {
+    int fd = open(path, O_CREAT | O_WRONLY, mode);
+    if (fd < 0)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+static void real_tree_close(int fd) { close(fd); }
+
+const FsOps fs_ops_real = {
+    .name = "real",
+    .mount = mount,
+    .umount2 = umount2,
+    .mkdir = mkdir,
+    .rmdir = rmdir,
+    .create = real_create,
+    .symlink = symlink,
+    .chmod = chmod,
+    .chown = chown,
+    .lsetxattr = lsetxattr,
+    .stat = stat,
+    .tree_supported = mount_api_supported,
+    .tree_tmpfs = mount_api_tmpfs,
+    .tree_bind = mount_api_bind,
+    .tree_seal = mount_api_seal,
+    .tree_attach = mount_api_attach,
+    .tree_close = real_tree_close,
+    .try_umount = ksu_send_unmountable,
+};
+
+const FsOps *g_fs_ops = &fs_ops_real;
+
+void fs_ops_use(const FsOps *ops) {
+    if (ops == &fs_ops_sim)
+        fs_sim_reset();
+    g_fs_ops = ops;
+}
@@ -0,0 +1,64 @@
+#ifndef FS_OPS_H
+#define FS_OPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Every call that changes the filesystem or the mount table goes through
+ * g_fs_ops. The real backend is libc, mount_api.c and the KSU driver; the
+ * simulated one applies the calls to an in-memory model and records them,
+ * so the scan, plan and apply passes run without root (--dry-run). Reads of
+ * the real tree (listing, module files, labels) are not routed: they see
+ * the host either way. Same return convention as the calls they stand for.
+ */
+typedef struct {
+    const char *name;
+
+    int (*mount)(const char *src, const char *dst, const char *type, unsigned long flags,
+                 const void *data);
+    int (*umount2)(const char *path, int flags);
+    int (*mkdir)(const char *path, mode_t mode);
+    int (*rmdir)(const char *path);
+    /* Empty regular file (open with O_CREAT, then closed) */
+    int (*create)(const char *path, mode_t mode);
+    int (*symlink)(const char *target, const char *path);
+    int (*chmod)(const char *path, mode_t mode);
+    int (*chown)(const char *path, uid_t uid, gid_t gid);
+    int (*lsetxattr)(const char *path, const char *name, const void *value, size_t size,
+                     int flags);
+    /* stat(2) that also sees what this backend created */
+    int (*stat)(const char *path, struct stat *st);
+
+    /* New mount API, see mount_api.h */
+    bool (*tree_supported)(void);
+    int (*tree_tmpfs)(const char *source);
+    int (*tree_bind)(const char *src, const char *dst, unsigned int flags);
+    int (*tree_seal)(int fd);
+    int (*tree_attach)(int fd, const char *path);
+    void (*tree_close)(int fd);
+
+    /* KSU try-umount registration */
+    int (*try_umount)(const char *path);
+} FsOps;
+
+extern const FsOps fs_ops_real;
+extern const FsOps fs_ops_sim;
+
+/* The backend in use, fs_ops_real unless fs_ops_use picked another */
+extern const FsOps *g_fs_ops;
+
+/* Switch backends; call before any other thread runs */
+void fs_ops_use(const FsOps *ops);
+
+/* Print every operation the simulated backend recorded, with the time it
+ * was issued, then the count of each kind
+ */
+void fs_sim_report(FILE *out);
+
+/* Drop the simulated model and the recorded operations */
+void fs_sim_reset(void);
+
+#endif /* FS_OPS_H */
@@ -0,0 +1,492 @@
+#include "fs_ops.h"
+#include "mount_api.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum {
+    SIM_MOUNT,
+    SIM_UMOUNT,
+    SIM_MKDIR,
+    SIM_RMDIR,
+    SIM_CREATE,
+    SIM_SYMLINK,
+    SIM_CHMOD,
+    SIM_CHOWN,
+    SIM_SETXATTR,
+    SIM_TREE_TMPFS,
+    SIM_TREE_BIND,
+    SIM_TREE_SEAL,
+    SIM_TREE_ATTACH,
+    SIM_TREE_CLOSE,
+    SIM_TRY_UMOUNT,
+    SIM_KINDS,
+} SimKind;
+
+static const char *const sim_kind_names[SIM_KINDS] = {
+    [SIM_MOUNT] = "mount",
+    [SIM_UMOUNT] = "umount",
+    [SIM_MKDIR] = "mkdir",
+    [SIM_RMDIR] = "rmdir",
+    [SIM_CREATE] = "create",
+    [SIM_SYMLINK] = "symlink",
+    [SIM_CHMOD] = "chmod",
+    [SIM_CHOWN] = "chown",
+    [SIM_SETXATTR] = "setxattr",
+    [SIM_TREE_TMPFS] = "tree_tmpfs",
+    [SIM_TREE_BIND] = "tree_bind",
+    [SIM_TREE_SEAL] = "tree_seal",
+    [SIM_TREE_ATTACH] = "tree_attach",
+    [SIM_TREE_CLOSE] = "tree_close",
+    [SIM_TRY_UMOUNT] = "try_umount",
+};
+
+/* One recorded call: a and b are its paths (or source and target) */
+typedef struct {
+    uint64_t t_ns; /* since the backend was selected */
+    SimKind kind;
+    int err;      /* errno it failed with, 0 on success */
+    uint64_t arg; /* flags, mode, owner or fd */
+    char *a;
+    char *b;
+} SimOp;
+
+/* A path the simulation created */
+typedef struct SimEntry {
+    struct SimEntry *next;
+    mode_t mode;
+    char path[];
+} SimEntry;
+
+#define SIM_BUCKETS 4096
+
+static struct {
+    pthread_mutex_t lock;
+    struct timespec start;
+    SimOp *ops;
+    size_t count;
+    size_t cap;
+    SimEntry *buckets[SIM_BUCKETS];
+} g_sim = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t sim_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - g_sim.start.tv_sec) * 1000000000u +
+           (uint64_t)(ts.tv_nsec - g_sim.start.tv_nsec);
+}
+
+/* Caller holds the lock. A record that cannot be stored is dropped. */
+static void sim_record(SimKind kind, int err, uint64_t arg, const char *a, const char *b) {
+    if (g_sim.count == g_sim.cap) {
+        size_t cap = g_sim.cap ? g_sim.cap * 2 : 256;
+        SimOp *arr = realloc(g_sim.ops, cap * sizeof(*arr));
+        if (!arr)
+            return;
+        g_sim.ops = arr;
+        g_sim.cap = cap;
+    }
+
+    g_sim.ops[g_sim.count++] = (SimOp){
+        .t_ns = sim_now(),
+        .kind = kind,
+        .err = err,
+        .arg = arg,
+        .a = a ? strdup(a) : NULL,
+        .b = b ? strdup(b) : NULL,
+    };
+}
+
+static size_t sim_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; ++p)
+        h = (h ^ *p) * 16777619u;
+    return h % SIM_BUCKETS;
+}
+
+/* Paths are kept without a trailing '/' (detached tree roots have one) */
+static size_t sim_path_len(const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+static SimEntry **sim_find(const char *path) {
+    size_t len = sim_path_len(path);
+    char key[PATH_MAX];
+
+    if (len >= sizeof(key))
+        return NULL;
+    memcpy(key, path, len);
+    key[len] = '\0';
+
+    SimEntry **e = &g_sim.buckets[sim_hash(key)];
+    while (*e && strcmp((*e)->path, key) != 0)
+        e = &(*e)->next;
+    return e;
+}
+
+static int sim_add(const char *path, mode_t mode) {
+    SimEntry **slot = sim_find(path);
+    size_t len = sim_path_len(path);
+
+    if (!slot) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (*slot) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    SimEntry *e = malloc(sizeof(*e) + len + 1);
+    if (!e) {
+        errno = ENOMEM;
+        return -1;
+    }
+    e->next = NULL;
+    e->mode = mode;
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    *slot = e;
+    return 0;
+}
+
+static bool sim_below(const char *path, const char *prefix, size_t plen) {
+    return !strncmp(path, prefix, plen) && path[plen] == '/';
+}
+
+/* Drop every entry below prefix, or move it below to (to != NULL) */
+static void sim_move_below(const char *prefix, const char *to) {
+    size_t plen = sim_path_len(prefix);
+    SimEntry *moved = NULL;
+
+    for (size_t i = 0; i < SIM_BUCKETS; ++i) {
+        SimEntry **e = &g_sim.buckets[i];
+        while (*e) {
+            SimEntry *cur = *e;
+            if (!sim_below(cur->path, prefix, plen)) {
+                e = &cur->next;
+                continue;
+            }
+            *e = cur->next;
+            cur->next = moved;
+            moved = cur;
+        }
+    }
+
+    while (moved) {
+        SimEntry *cur = moved;
+        char path[PATH_MAX];
+
+        moved = cur->next;
+        if (to && snprintf(path, sizeof(path), "%.*s%s", (int)sim_path_len(to), to,
+                           cur->path + plen) < (int)sizeof(path))
+            (void)sim_add(path, cur->mode);
+        free(cur);
+    }
+}
+
+static int sim_done(SimKind kind, int err, uint64_t arg, const char *a, const char *b) {
+    sim_record(kind, err, arg, a, b);
+    pthread_mutex_unlock(&g_sim.lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int sim_mount(const char *src, const char *dst, const char *type, unsigned long flags,
+                     const void *data) {
+    char label[PATH_MAX + 32];
+    const char *target = dst;
+
+    (void)data;
+    if (type && snprintf(label, sizeof(label), "%s (%s)", dst, type) < (int)sizeof(label))
+        target = label;
+
+    pthread_mutex_lock(&g_sim.lock);
+    /* What was built at src now shows at dst */
+    if ((flags & MS_MOVE) && src)
+        sim_move_below(src, dst);
+    return sim_done(SIM_MOUNT, 0, flags, src, target);
+}
+
+/* The contents of the unmounted tmpfs go away, its mountpoint stays */
+static int sim_umount2(const char *path, int flags) {
+    pthread_mutex_lock(&g_sim.lock);
+    sim_move_below(path, NULL);
+    return sim_done(SIM_UMOUNT, 0, (uint64_t)flags, path, NULL);
+}
+
+static int sim_stat(const char *path, struct stat *st) {
+    pthread_mutex_lock(&g_sim.lock);
+    SimEntry **e = sim_find(path);
+    if (e && *e) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = (*e)->mode;
+        pthread_mutex_unlock(&g_sim.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return stat(path, st);
+}
+
+static int sim_create_node(SimKind kind, const char *path, mode_t mode, const char *target) {
+    struct stat st;
+    int err = 0;
+
+    /* An existing real entry counts as well */
+    if (kind != SIM_CREATE && stat(path, &st) == 0)
+        err = EEXIST;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (!err && sim_add(path, mode) != 0 && (kind != SIM_CREATE || errno != EEXIST))
+        err = errno;
+    return sim_done(kind, err, mode & 07777, path, target);
+}
+
+static int sim_mkdir(const char *path, mode_t mode) {
+    return sim_create_node(SIM_MKDIR, path, S_IFDIR | (mode & 07777), NULL);
+}
+
+static int sim_create(const char *path, mode_t mode) {
+    return sim_create_node(SIM_CREATE, path, S_IFREG | (mode & 07777), NULL);
+}
+
+static int sim_symlink(const char *target, const char *path) {
+    return sim_create_node(SIM_SYMLINK, path, S_IFLNK | 0777, target);
+}
+
+static int sim_rmdir(const char *path) {
+    int err = 0;
+
+    pthread_mutex_lock(&g_sim.lock);
+    SimEntry **e = sim_find(path);
+    if (e && *e) {
+        SimEntry *cur = *e;
+        *e = cur->next;
+        free(cur);
+    } else {
+        err = ENOENT;
+    }
+    return sim_done(SIM_RMDIR, err, 0, path, NULL);
+}
+
+static int sim_chmod(const char *path, mode_t mode) {
+    pthread_mutex_lock(&g_sim.lock);
+    SimEntry **e = sim_find(path);
+    if (e && *e)
+        (*e)->mode = ((*e)->mode & S_IFMT) | (mode & 07777);
+    return sim_done(SIM_CHMOD, 0, mode & 07777, path, NULL);
+}
+
+static int sim_chown(const char *path, uid_t uid, gid_t gid) {
+    pthread_mutex_lock(&g_sim.lock);
+    return sim_done(SIM_CHOWN, 0, (uint64_t)uid << 32 | gid, path, NULL);
+}
+
+static int sim_lsetxattr(const char *path, const char *name, const void *value, size_t size,
+                         int flags) {
+    char attr[256];
+
+    (void)flags;
+    snprintf(attr, sizeof(attr), "%s=%.*s", name, (int)size, (const char *)value);
+    pthread_mutex_lock(&g_sim.lock);
+    return sim_done(SIM_SETXATTR, 0, 0, path, attr);
+}
+
+static bool sim_tree_supported(void) { return true; }
+
+/* A real fd (the root dir) so that its /proc/self/fd path names this tree */
+static int sim_tree_tmpfs(const char *source) {
+    int fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int err = fd < 0 ? errno : 0;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (sim_done(SIM_TREE_TMPFS, err, (uint64_t)fd, source, NULL) != 0)
+        return -1;
+    return fd;
+}
+
+static int sim_tree_bind(const char *src, const char *dst, unsigned int flags) {
+    pthread_mutex_lock(&g_sim.lock);
+    return sim_done(SIM_TREE_BIND, 0, flags, src, dst);
+}
+
+static int sim_tree_seal(int fd) {
+    pthread_mutex_lock(&g_sim.lock);
+    return sim_done(SIM_TREE_SEAL, 0, (uint64_t)fd, NULL, NULL);
+}
+
+static int sim_tree_attach(int fd, const char *path) {
+    char dir[64];
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (mount_api_fd_path(fd, dir, sizeof(dir)) == 0)
+        sim_move_below(dir, path);
+    return sim_done(SIM_TREE_ATTACH, 0, (uint64_t)fd, path, NULL);
+}
+
+/* Whatever was not attached is gone with the tree */
+static void sim_tree_close(int fd) {
+    char dir[64];
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (mount_api_fd_path(fd, dir, sizeof(dir)) == 0)
+        sim_move_below(dir, NULL);
+    (void)sim_done(SIM_TREE_CLOSE, 0, (uint64_t)fd, NULL, NULL);
+    close(fd);
+}
+
+static int sim_try_umount(const char *path) {
+    pthread_mutex_lock(&g_sim.lock);
+    return sim_done(SIM_TRY_UMOUNT, 0, 0, path, NULL);
+}
+
+const FsOps fs_ops_sim = {
+    .name = "simulated",
+    .mount = sim_mount,
+    .umount2 = sim_umount2,
+    .mkdir = sim_mkdir,
+    .rmdir = sim_rmdir,
+    .create = sim_create,
+    .symlink = sim_symlink,
+    .chmod = sim_chmod,
+    .chown = sim_chown,
+    .lsetxattr = sim_lsetxattr,
+    .stat = sim_stat,
+    .tree_supported = sim_tree_supported,
+    .tree_tmpfs = sim_tree_tmpfs,
+    .tree_bind = sim_tree_bind,
+    .tree_seal = sim_tree_seal,
+    .tree_attach = sim_tree_attach,
+    .tree_close = sim_tree_close,
+    .try_umount = sim_try_umount,
+};
+
+static void sim_mount_flags(unsigned long flags, char *buf, size_t len) {
+    static const struct {
+        unsigned long flag;
+        const char *name;
+    } names[] = {
+        {MS_RDONLY, "rdonly"}, {MS_REMOUNT, "remount"}, {MS_BIND, "bind"},
+        {MS_MOVE, "move"},     {MS_REC, "rec"},         {MS_PRIVATE, "private"},
+    };
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && used < len; ++i) {
+        if (flags & names[i].flag)
+            used += (size_t)snprintf(buf + used, len - used, "%s%s", used ? "," : "",
+                                     names[i].name);
+    }
+}
+
+/* What follows the paths of op: flags, mode, owner or fd */
+static void sim_op_detail(const SimOp *op, char *buf, size_t len) {
+    switch (op->kind) {
+    case SIM_MOUNT:
+        sim_mount_flags((unsigned long)op->arg, buf, len);
+        break;
+    case SIM_TREE_BIND:
+        snprintf(buf, len, "%s%s%s", op->arg & MOUNT_API_BIND_RDONLY ? "rdonly" : "",
+                 (op->arg & MOUNT_API_BIND_RDONLY) && (op->arg & MOUNT_API_BIND_REC) ? "," : "",
+                 op->arg & MOUNT_API_BIND_REC ? "rec" : "");
+        break;
+    case SIM_MKDIR:
+    case SIM_CREATE:
+    case SIM_CHMOD:
+        snprintf(buf, len, "%04o", (unsigned)op->arg);
+        break;
+    case SIM_CHOWN:
+        snprintf(buf, len, "%u:%u", (unsigned)(op->arg >> 32), (unsigned)(op->arg & 0xffffffffu));
+        break;
+    case SIM_TREE_TMPFS:
+    case SIM_TREE_SEAL:
+    case SIM_TREE_ATTACH:
+    case SIM_TREE_CLOSE:
+        snprintf(buf, len, "fd %d", (int)op->arg);
+        break;
+    default:
+        buf[0] = '\0';
+        break;
+    }
+}
+
+void fs_sim_report(FILE *out) {
+    size_t counts[SIM_KINDS] = {0};
+    size_t failed = 0;
+
+    pthread_mutex_lock(&g_sim.lock);
+
+    fprintf(out, "# dry run: %zu operations\n", g_sim.count);
+    fprintf(out, "#       ms  operation\n");
+
+    for (size_t i = 0; i < g_sim.count; ++i) {
+        const SimOp *op = &g_sim.ops[i];
+        char detail[128];
+
+        /* A remount has no source */
+        const char *first = op->a ? op->a : op->b;
+        const char *second = op->a ? op->b : NULL;
+
+        sim_op_detail(op, detail, sizeof(detail));
+        fprintf(out, "%10.3f  %-11s %s%s%s%s%s%s%s\n", (double)op->t_ns / 1e6,
+                sim_kind_names[op->kind], first ? first : "",
+                second ? (op->kind == SIM_SETXATTR ? " " : " -> ") : "", second ? second : "",
+                detail[0] ? " [" : "", detail, detail[0] ? "]" : "", op->err ? " = -1" : "");
+        if (op->err) {
+            fprintf(out, "%10s  %-11s (%s)\n", "", "", strerror(op->err));
+            failed++;
+        }
+        counts[op->kind]++;
+    }
+
+    fprintf(out, "# operations by kind\n");
+    for (int k = 0; k < SIM_KINDS; ++k) {
+        if (counts[k])
+            fprintf(out, "  %-11s %8zu\n", sim_kind_names[k], counts[k]);
+    }
+    fprintf(out, "  %-11s %8zu\n", "total", g_sim.count);
+    if (failed)
+        fprintf(out, "  %-11s %8zu\n", "failed", failed);
+    fprintf(out, "# %.3f ms from start to the last operation, %.3f ms now\n",
+            g_sim.count ? (double)g_sim.ops[g_sim.count - 1].t_ns / 1e6 : 0.0,
+            (double)sim_now() / 1e6);
+
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+void fs_sim_reset(void) {
+    pthread_mutex_lock(&g_sim.lock);
+
+    for (size_t i = 0; i < g_sim.count; ++i) {
+        free(g_sim.ops[i].a);
+        free(g_sim.ops[i].b);
+    }
+    free(g_sim.ops);
+    g_sim.ops = NULL;
+    g_sim.count = g_sim.cap = 0;
+
+    for (size_t i = 0; i < SIM_BUCKETS; ++i) {
+        while (g_sim.buckets[i]) {
+            SimEntry *e = g_sim.buckets[i];
+            g_sim.buckets[i] = e->next;
+            free(e);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &g_sim.start);
+    pthread_mutex_unlock(&g_sim.lock);
+}
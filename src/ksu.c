@@ -2,7 +2,10 @@
 #include "utils.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -10,10 +13,24 @@ long syscall(long number, ...);
 
 static atomic_int g_driver_fd = -1;
 static atomic_flag g_driver_fd_initialized = ATOMIC_FLAG_INIT;
+static atomic_bool g_standin;
 
 static void ksu_grab_fd_once(void) {
+    const char *standin = getenv(KSU_STANDIN_ENV);
     int fd = -1;
 
+    if (standin && *standin) {
+        fd = open(standin, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOGW("KSU stand-in %s: %s", standin, strerror(errno));
+        } else {
+            LOGI("KSU stand-in: recording requests in %s", standin);
+            atomic_store(&g_standin, true);
+        }
+        atomic_store(&g_driver_fd, fd);
+        return;
+    }
+
     syscall(SYS_reboot, KSU_INSTALL_MAGIC1, KSU_INSTALL_MAGIC2, 0, (void *)&fd);
 
     if (fd < 0) {
@@ -43,6 +60,17 @@ int ksu_send_unmountable(const char *mntpoint) {
     cmd.flags = 0x2;
     cmd.mode = 1;
 
+    if (atomic_load(&g_standin)) {
+        char line[PATH_MAX + 64];
+        int len = snprintf(line, sizeof(line), "add_try_umount flags=0x%x mode=%u %s\n",
+                           cmd.flags, cmd.mode, mntpoint);
+        if (len < 0 || (size_t)len >= sizeof(line) || write(fd, line, (size_t)len) != len) {
+            LOGE("KSU stand-in: failed to record %s", mntpoint);
+            return -1;
+        }
+        return 0;
+    }
+
     if (ioctl(fd, KSU_IOCTL_ADD_TRY_UMOUNT, &cmd) < 0) {
         LOGE("ioctl KSU_IOCTL_ADD_TRY_UMOUNT failed: %s", strerror(errno));
         return -1;
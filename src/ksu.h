@@ -16,6 +16,12 @@ struct ksu_add_try_umount_cmd {
 
 #define KSU_IOCTL_ADD_TRY_UMOUNT _IOC(_IOC_WRITE, 'K', 18, 0)
 
+/* Set to a file: requests are appended there, one line each, instead of
+ * reaching the driver, so their count and order can be checked on a kernel
+ * without KernelSU
+ */
+#define KSU_STANDIN_ENV "MM_KSU_STANDIN"
+
 int ksu_send_unmountable(const char *mntpoint);
 
 #endif /* KSU_H */
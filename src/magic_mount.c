@@ -1,12 +1,21 @@
 #include "magic_mount.h"
-#include "ksu.h"
+#include "fs_ops.h"
 #include "module_tree.h"
+#include "mount_api.h"
+#include "mount_index.h"
+#include "mount_plan.h"
+#include "opstat.h"
+#include "overlay.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include "warmup.h"
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
@@ -21,6 +30,13 @@ void magic_mount_init(MagicMount *ctx) {
     ctx->module_dir = DEFAULT_MODULE_DIR;
     ctx->mount_source = DEFAULT_MOUNT_SOURCE;
     ctx->enable_unmountable = true;
+    ctx->scan_jobs = DEFAULT_SCAN_JOBS;
+    ctx->apply_jobs = DEFAULT_APPLY_JOBS;
+    ctx->tree_cache = DEFAULT_TREE_CACHE;
+    ctx->mount_index = DEFAULT_MOUNT_INDEX;
+    ctx->warmup.exts = DEFAULT_WARMUP_EXTS;
+    ctx->warmup.max_size = DEFAULT_WARMUP_MAX_SIZE;
+    ctx->warmup.budget_ms = DEFAULT_WARMUP_BUDGET_MS;
 }
 
 void magic_mount_cleanup(MagicMount *ctx) {
@@ -29,10 +45,34 @@ void magic_mount_cleanup(MagicMount *ctx) {
     module_tree_cleanup(ctx);
 }
 
-static int mm_clone_symlink(const char *src, const char *dst) {
+void magic_mount_queue_umount(MagicMount *ctx, const char *path) {
+    if (ctx->enable_unmountable &&
+        !str_array_append(&ctx->try_umounts, &ctx->try_umounts_count, path))
+        LOGW("failed to queue try-umount for %s (OOM)", path);
+}
+
+uint64_t magic_mount_phase(MagicMount *ctx, MountPhase phase, uint64_t start) {
+    uint64_t now = monotonic_ns();
+    ctx->stats.phase_ns[phase] += now - start;
+    if (g_trace_on)
+        trace_record(mount_phase_name(phase), start, now, NULL, NULL);
+    return now;
+}
+
+ModuleCost *magic_mount_cost(MagicMount *ctx, uint16_t id) {
+    if (id == 0 || id > ctx->module_costs_count)
+        return NULL;
+    return &ctx->module_costs[id - 1];
+}
+
+/* st: src's lstat if at hand, for the label cache; parent: see mm_wdir_label */
+static int mm_clone_symlink(const char *src, const struct stat *st, const char *dst,
+                            const char *parent) {
     char target[PATH_MAX];
 
+    uint64_t t = opstat_begin();
     ssize_t len = readlink(src, target, sizeof(target) - 1);
+    opstat_end(OP_READLINK, t);
     if (len < 0) {
         LOGE("readlink %s: %s", src, strerror(errno));
         return -1;
@@ -40,370 +80,1016 @@ static int mm_clone_symlink(const char *src, const char *dst) {
 
     target[len] = '\0';
 
-    if (symlink(target, dst) < 0) {
+    if (g_fs_ops->symlink(target, dst) < 0) {
         LOGE("symlink %s->%s: %s", dst, target, strerror(errno));
         return -1;
     }
 
-    (void)copy_selcon(src, dst);
+    (void)copy_selcon_st(src, st, dst, parent, NULL);
 
     LOGD("clone symlink %s -> %s (%s)", src, dst, target);
     return 0;
 }
 
-static int mm_mirror_entry(MagicMount *ctx, const char *path, const char *work, const char *name);
+/* Where the entries of a directory are mounted, as planned by mount_plan */
+typedef enum {
+    APPLY_REAL,  /* onto the real tree at path */
+    APPLY_TMPFS, /* rebuilt at wpath inside a tmpfs */
+    APPLY_BOUND, /* onto a real dir bound whole at wpath inside a tmpfs */
+} ApplyAt;
+
+/* The apply pass walks the tree with an explicit stack: one frame per
+ * directory node. path and wpath always hold the top frame's locations.
+ */
+typedef struct {
+    Node *node;
+    DirSnap real;  /* real dir, its entries are dispatched while listing */
+    bool listing;
+    size_t saved;  /* path length to restore on pop */
+    size_t wsaved; /* wpath length to restore on pop */
+    size_t next;   /* next child left for the second pass */
+    int tree_fd;   /* detached tmpfs of a create_tmp frame (new mount API) */
+    ApplyAt at;    /* where the children go */
+    bool create_tmp;
+    const char *label; /* cached label given to wpath, NULL if not known */
+    uint16_t owner;    /* module charged for the tmpfs the frame is on */
+} ApplyFrame;
+
+/* A child of a directory that stays on the real tree, applied on its own by
+ * the worker pool: nothing else mounts at or below it
+ */
+typedef struct {
+    Node *node;
+    Node *parent;
+    const char *path; /* of parent, shared by its tasks */
+    const char *wpath;
+    int ret;
+    char **failed; /* modules that failed below node */
+    int failed_count;
+    char **umounts; /* try-umount paths below node */
+    int umount_count;
+} ApplyTask;
+
+typedef struct {
+    ApplyTask *items;
+    size_t count;
+    size_t cap;
+} ApplyTasks;
+
+/* With the new mount API, wpath points into the detached tree of the one
+ * create_tmp frame being built (they never nest: everything below it already
+ * has a tmpfs) and outer keeps the wpath it replaced.
+ *
+ * stats, costs, failed and umounts stay private to the walk so that several
+ * can run at once; mm_walk_finish hands them to ctx.
+ */
+typedef struct {
+    MagicMount *ctx;
+    bool new_api;
+    PathBuf path;
+    PathBuf wpath;
+    PathBuf outer;
+    ApplyFrame *frames;
+    size_t depth;
+    size_t cap;
+    MountStats stats;
+    ModuleCost *costs; /* like ctx->module_costs, allocated on first use */
+    char **failed;
+    int failed_count;
+    char **umounts;
+    int umount_count;
+    ApplyTasks *tasks; /* set: children of real dirs are queued, not applied */
+    PlanListings *listings; /* real dirs the planner listed, taken by mm_dir_real */
+} ApplyWalk;
+
+static void mm_walk_failed(ApplyWalk *w, const char *module_name) {
+    if (module_name && !str_array_append(&w->failed, &w->failed_count, module_name))
+        LOGW("failed to record module failure for %s (OOM)", module_name);
+}
 
-static int mm_apply_node_recursive(MagicMount *ctx, const char *base, const char *wbase, Node *node,
-                                   bool has_tmpfs);
+static void mm_walk_umount(ApplyWalk *w, const char *path) {
+    if (w->ctx->enable_unmountable && !str_array_append(&w->umounts, &w->umount_count, path))
+        LOGW("failed to queue try-umount for %s (OOM)", path);
+}
 
-static int mm_mirror_entry(MagicMount *ctx, const char *path, const char *work, const char *name) {
-    char src[PATH_MAX];
-    char dst[PATH_MAX];
+/* The walk's cost entry of module id, NULL if not kept */
+static ModuleCost *mm_walk_cost(ApplyWalk *w, uint16_t id) {
+    size_t n = w->ctx->module_costs_count;
 
-    if (path_join(path, name, src, sizeof(src)) != 0 ||
-        path_join(work, name, dst, sizeof(dst)) != 0)
-        return -1;
+    if (id == 0 || id > n)
+        return NULL;
+    if (!w->costs && !(w->costs = calloc(n, sizeof(*w->costs))))
+        return NULL;
+    return &w->costs[id - 1];
+}
 
-    struct stat st;
-    if (lstat(src, &st) < 0) {
-        LOGW("lstat %s: %s", src, strerror(errno));
-        return 0;
-    }
+/* Name of module id in trace spans */
+static const char *mm_module_name(const MagicMount *ctx, uint16_t id) {
+    const ModuleInfo *mod = module_catalog_get(&ctx->catalog, id);
+    return mod ? mod->name : NULL;
+}
 
-    if (S_ISREG(st.st_mode)) {
-        int fd = open(dst, O_CREAT | O_WRONLY, st.st_mode & 07777);
-        if (fd < 0) {
-            LOGE("create %s: %s", dst, strerror(errno));
-            return -1;
-        }
-        close(fd);
+/* Charge the time since start to module id, returns the entry */
+static ModuleCost *mm_walk_charge(ApplyWalk *w, uint16_t id, uint64_t start) {
+    ModuleCost *mc = mm_walk_cost(w, id);
+    if (mc)
+        mc->apply_ns += monotonic_ns() - start;
+    return mc;
+}
 
-        if (mount(src, dst, NULL, MS_BIND, NULL) < 0) {
-            LOGE("bind %s->%s: %s", src, dst, strerror(errno));
-            return -1;
-        }
-    } else if (S_ISDIR(st.st_mode)) {
-        if (mkdir(dst, st.st_mode & 07777) < 0 && errno != EEXIST) {
-            LOGE("mkdir %s: %s", dst, strerror(errno));
+static int mm_walk_push(ApplyWalk *w, const ApplyFrame *f) {
+    if (w->depth == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 16;
+        ApplyFrame *arr = realloc(w->frames, cap * sizeof(*arr));
+        if (!arr) {
+            LOGE("apply: failed to grow stack for %s", w->path.buf);
             return -1;
         }
+        w->frames = arr;
+        w->cap = cap;
+    }
+    w->frames[w->depth++] = *f;
+    return 0;
+}
 
-        chmod(dst, st.st_mode & 07777);
-        chown(dst, st.st_uid, st.st_gid);
+static int mm_walk_push_names(ApplyWalk *w, const char *name, size_t *saved, size_t *wsaved) {
+    if (path_buf_push(&w->path, name, saved) != 0)
+        return -1;
+    if (path_buf_push(&w->wpath, name, wsaved) != 0) {
+        path_buf_pop(&w->path, *saved);
+        return -1;
+    }
+    return 0;
+}
 
-        (void)copy_selcon(src, dst);
+static void mm_walk_pop_names(ApplyWalk *w, size_t saved, size_t wsaved) {
+    path_buf_pop(&w->path, saved);
+    path_buf_pop(&w->wpath, wsaved);
+}
 
-        DIR *d = opendir(src);
-        if (!d) {
-            LOGE("opendir %s: %s", src, strerror(errno));
-            return -1;
-        }
+/* Label of the tmpfs dir the top frame rebuilds, which new entries inherit */
+static const char *mm_wdir_label(const ApplyWalk *w) {
+    const ApplyFrame *f = w->depth ? &w->frames[w->depth - 1] : NULL;
+    return f && f->at == APPLY_TMPFS ? f->label : NULL;
+}
 
-        struct dirent *de;
-        while ((de = readdir(d))) {
-            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
-                continue;
-            }
-            if (mm_mirror_entry(ctx, src, dst, de->d_name) != 0) {
-                closedir(d);
-                return -1;
+static int mm_bind(ApplyWalk *w, const char *src, const char *dst, bool rec) {
+    if (w->new_api)
+        return g_fs_ops->tree_bind(src, dst, rec ? MOUNT_API_BIND_REC : 0);
+    return g_fs_ops->mount(src, dst, NULL, MS_BIND | (rec ? MS_REC : 0), NULL);
+}
+
+/* Start the detached tmpfs of f and point wpath at it */
+static int mm_tree_open(ApplyWalk *w, ApplyFrame *f) {
+    char dir[64];
+
+    f->tree_fd = g_fs_ops->tree_tmpfs(w->ctx->mount_source);
+    if (f->tree_fd < 0) {
+        LOGE("fsmount tmpfs for %s: %s", w->path.buf, strerror(errno));
+        return -1;
+    }
+
+    (void)path_buf_set(&w->outer, w->wpath.buf);
+    if (mount_api_fd_path(f->tree_fd, dir, sizeof(dir)) != 0 || path_buf_set(&w->wpath, dir) != 0) {
+        g_fs_ops->tree_close(f->tree_fd);
+        f->tree_fd = -1;
+        return -1;
+    }
+
+    LOGD("detached tmpfs for %s at %s", w->path.buf, dir);
+    return 0;
+}
+
+/* Drop the detached tmpfs of f (unless attached, this discards it) */
+static void mm_tree_close(ApplyWalk *w, ApplyFrame *f) {
+    if (f->tree_fd < 0)
+        return;
+
+    g_fs_ops->tree_close(f->tree_fd);
+    f->tree_fd = -1;
+    (void)path_buf_set(&w->wpath, w->outer.buf);
+}
+
+/* Bind the real directory at path whole (with its submounts) onto a new
+ * mountpoint at wpath; the bind hides the mountpoint's owner, mode and label
+ */
+static int mm_bind_real_dir(ApplyWalk *w, mode_t mode) {
+    const char *src = w->path.buf;
+    const char *dst = w->wpath.buf;
+    uint64_t t = trace_begin();
+    int ret = 0;
+
+    if (g_fs_ops->mkdir(dst, mode) < 0 && errno != EEXIST) {
+        LOGE("mkdir %s: %s", dst, strerror(errno));
+        ret = -1;
+    } else if (mm_bind(w, src, dst, true) != 0) {
+        LOGE("bind %s->%s: %s", src, dst, strerror(errno));
+        ret = -1;
+    }
+    TRACE_SPAN("mirror dir", t, NULL, src);
+    return ret;
+}
+
+/* Copy the real entry <path>/name (in the listed dir dirfd) into
+ * <wpath>/name. A directory here has no module nodes below it, so the
+ * real one is bound whole instead of rebuilt.
+ */
+static int mm_mirror_entry(ApplyWalk *w, int dirfd, const char *name) {
+    size_t saved, wsaved;
+
+    if (mm_walk_push_names(w, name, &saved, &wsaved) != 0)
+        return -1;
+
+    const char *src = w->path.buf;
+    const char *dst = w->wpath.buf;
+    int ret = 0;
+
+    struct stat st;
+    uint64_t t = opstat_begin();
+    int r = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    opstat_end(OP_STAT, t);
+    if (r < 0) {
+        LOGW("lstat %s: %s", src, strerror(errno));
+    } else if (S_ISREG(st.st_mode)) {
+        if (g_fs_ops->create(dst, st.st_mode & 07777) != 0) {
+            LOGE("create %s: %s", dst, strerror(errno));
+            ret = -1;
+        } else {
+            if (mm_bind(w, src, dst, false) != 0) {
+                LOGE("bind %s->%s: %s", src, dst, strerror(errno));
+                ret = -1;
             }
         }
-        closedir(d);
+    } else if (S_ISDIR(st.st_mode)) {
+        ret = mm_bind_real_dir(w, st.st_mode & 07777);
     } else if (S_ISLNK(st.st_mode)) {
-        if (mm_clone_symlink(src, dst) != 0)
-            return -1;
+        if (mm_clone_symlink(src, &st, dst, mm_wdir_label(w)) != 0)
+            ret = -1;
     }
 
-    return 0;
+    mm_walk_pop_names(w, saved, wsaved);
+    return ret;
 }
 
-static int mm_apply_regular_file(MagicMount *ctx, const char *path, const char *wpath, Node *node,
-                                 bool has_tmpfs) {
-    const char *target = has_tmpfs ? wpath : path;
+static int mm_apply_regular_file(ApplyWalk *w, Node *node, ApplyAt at) {
+    MagicMount *ctx = w->ctx;
+    const char *path = w->path.buf;
+    char *wpath = w->wpath.buf;
+    const char *target = at == APPLY_REAL ? path : wpath;
 
-    if (has_tmpfs) {
-        char parent_dir[PATH_MAX];
-        snprintf(parent_dir, sizeof(parent_dir), "%s", wpath);
-        char *last_slash = strrchr(parent_dir, '/');
-        if (last_slash && last_slash != parent_dir) {
+    /* A bound real dir already has the file to mount onto */
+    if (at == APPLY_TMPFS) {
+        char *last_slash = strrchr(wpath, '/');
+        if (last_slash && last_slash != wpath) {
             *last_slash = '\0';
-            if (mkdir_p(parent_dir) != 0)
+            int r = mkdir_p(wpath);
+            *last_slash = '/';
+            if (r != 0)
                 return -1;
         }
 
-        int fd = open(wpath, O_CREAT | O_WRONLY, 0644);
-        if (fd < 0) {
+        if (g_fs_ops->create(wpath, 0644) != 0) {
             LOGE("create %s: %s", wpath, strerror(errno));
             return -1;
         }
-        close(fd);
     }
 
-    if (!node->module_path) {
+    char src[PATH_MAX];
+    if (node_module_path(ctx, node, src, sizeof(src)) != 0) {
         LOGE("no module file for %s", path);
         errno = EINVAL;
         return -1;
     }
 
-    LOGD("bind %s -> %s", node->module_path, target);
+    LOGD("bind %s -> %s", src, target);
 
-    if (mount(node->module_path, target, NULL, MS_BIND, NULL) < 0) {
-        LOGE("bind %s->%s: %s", node->module_path, target, strerror(errno));
+    /* New API: read-only from the start here, or sealed with its tmpfs */
+    int r = w->new_api
+                ? g_fs_ops->tree_bind(src, target, at == APPLY_REAL ? MOUNT_API_BIND_RDONLY : 0)
+                : g_fs_ops->mount(src, target, NULL, MS_BIND, NULL);
+    if (r < 0) {
+        LOGE("bind %s->%s: %s", src, target, strerror(errno));
         return -1;
-    } else if (!strstr(target, ".magic_mount/workdir/")) {
-        if (ctx->enable_unmountable)
-            ksu_send_unmountable(path);
+    } else if (at == APPLY_REAL) {
+        mm_walk_umount(w, path);
     }
 
-    (void)mount(NULL, target, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
+    if (!w->new_api)
+        (void)g_fs_ops->mount(NULL, target, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
 
-    ctx->stats.nodes_mounted++;
+    w->stats.nodes_mounted++;
     return 0;
 }
 
-static int mm_apply_symlink(MagicMount *ctx, const char *path, const char *wpath, Node *node) {
-    if (!node->module_path) {
+static int mm_apply_symlink(ApplyWalk *w, Node *node) {
+    const char *path = w->path.buf;
+    const char *wpath = w->wpath.buf;
+    char src[PATH_MAX];
+
+    if (node_module_path(w->ctx, node, src, sizeof(src)) != 0) {
         LOGE("no module symlink for %s", path);
         errno = EINVAL;
         return -1;
     }
 
-    if (mm_clone_symlink(node->module_path, wpath) != 0)
+    if (mm_clone_symlink(src, NULL, wpath, mm_wdir_label(w)) != 0)
         return -1;
 
-    ctx->stats.nodes_mounted++;
+    w->stats.nodes_mounted++;
     return 0;
 }
 
-static bool mm_check_need_tmpfs(Node *node, const char *path) {
-    for (size_t i = 0; i < node->child_count; ++i) {
-        Node *c = node->children[i];
-        char rp[PATH_MAX];
-
-        if (path_join(path, c->name, rp, sizeof(rp)) != 0)
-            continue;
-
-        LOGD("checking child: parent=%s, child=%s, joined_path=%s", path, c->name, rp);
-
-        bool need = false;
-
-        if (c->type == NFT_SYMLINK) {
-            need = true;
-            LOGD("child %s is SYMLINK", c->name);
-        } else if (c->type == NFT_WHITEOUT) {
-            need = path_exists(rp);
-            LOGD("child %s is WHITEOUT, path_exists=%d, need=%d", c->name, need, need);
-        } else {
-            struct stat st;
-            if (lstat(rp, &st) == 0) {
-                NodeFileType rt = node_type_from_stat(&st);
-                LOGD("type mismatch check: %s - expected=%d, actual=%d, is_symlink=%d", rp, c->type,
-                     rt, rt == NFT_SYMLINK ? 1 : 0);
-                if (rt != c->type || rt == NFT_SYMLINK)
-                    need = true;
-            } else {
-                LOGD("lstat failed for %s: %s (errno=%d), path_exists=%d", rp, strerror(errno),
-                     errno, path_exists(rp) ? 1 : 0);
-                need = true;
-            }
-        }
-
-        LOGD("child check: parent=%s, child=%s, type=%d, need=%d, has_module_path=%d", path,
-             c->name, c->type, need, node->module_path ? 1 : 0);
-
-        if (need) {
-            if (!node->module_path) {
-                LOGE("cannot create tmpfs on %s (%s) - child type: %d, target exists: %d", path,
-                     c->name, c->type, path_exists(rp) ? 1 : 0);
-                c->skip = true;
-                continue;
-            }
-            return true;
-        }
-    }
-    return false;
-}
-
-static int mm_setup_dir_tmpfs(const char *path, const char *wpath, Node *node) {
+/* real_fd: the real directory if it could be listed, saves a path lookup.
+ * parent is the label of wpath's directory, *label gets wpath's.
+ */
+static int mm_setup_dir_tmpfs(MagicMount *ctx, const char *path, const char *wpath, Node *node,
+                              int real_fd, const char *parent, const char **label) {
     if (mkdir_p(wpath) != 0)
         return -1;
 
     struct stat st;
+    char src[PATH_MAX];
     const char *meta_path = NULL;
 
-    if (stat(path, &st) == 0) {
+    uint64_t t = opstat_begin();
+    int r = real_fd >= 0 ? fstat(real_fd, &st) : stat(path, &st);
+    opstat_end(OP_STAT, t);
+    if (r == 0) {
         meta_path = path;
-    } else if (node->module_path && stat(node->module_path, &st) == 0) {
-        meta_path = node->module_path;
+    } else if (node_module_path(ctx, node, src, sizeof(src)) == 0 && stat(src, &st) == 0) {
+        meta_path = src;
     } else {
         LOGE("no dir meta for %s", path);
         errno = ENOENT;
         return -1;
     }
 
-    chmod(wpath, st.st_mode & 07777);
-    chown(wpath, st.st_uid, st.st_gid);
-    (void)copy_selcon(meta_path, wpath);
+    g_fs_ops->chmod(wpath, st.st_mode & 07777);
+    g_fs_ops->chown(wpath, st.st_uid, st.st_gid);
+    (void)copy_selcon_st(meta_path, &st, wpath, parent, label);
 
     return 0;
 }
 
-static int mm_process_dir_children(MagicMount *ctx, const char *path, const char *wpath, Node *node,
-                                   bool now_tmp) {
-    if (!path_exists(path) || node->replace)
-        return 0;
+/* Module whose entry puts dir on a tmpfs: the first child the real dir
+ * cannot take as planned (new, a symlink, a type change, a whiteout over a
+ * real entry), else the dir's own for a replace dir or a cheaper plan
+ */
+static uint16_t mm_tmpfs_owner(const Node *dir) {
+    Node *const *kids = node_children(dir);
 
-    DIR *d = opendir(path);
-    if (!d) {
-        LOGE("opendir %s: %s", path, strerror(errno));
-        return now_tmp ? -1 : 0;
-    }
+    for (uint32_t i = 0; i < dir->child_count; ++i) {
+        const Node *c = kids[i];
+        int rt = (int)c->real - 1; /* -1: no real entry */
+        bool forced;
 
-    struct dirent *de;
-    while ((de = readdir(d))) {
-        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        if (c->skip || !c->module_id)
             continue;
+        if (c->type == NFT_WHITEOUT)
+            forced = rt >= 0;
+        else
+            forced = c->type == NFT_SYMLINK || rt != (int)c->type;
+        if (forced)
+            return c->module_id;
+    }
+    return dir->module_id;
+}
 
-        Node *c = node_child_find(node, de->d_name);
-        int r = 0;
+/* The real dir of node at path into s: the planner's listing if it kept
+ * one, otherwise read now
+ */
+static int mm_dir_real(ApplyWalk *w, const Node *node, const char *path, DirSnap *s) {
+    PlanListing *l = mount_plan_listing(w->listings, node);
 
-        if (c) {
-            if (c->skip) {
-                c->done = true;
-                continue;
-            }
-            c->done = true;
-            r = mm_apply_node_recursive(ctx, path, wpath, c, now_tmp);
-        } else if (now_tmp) {
-            r = mm_mirror_entry(ctx, path, wpath, de->d_name);
-        }
+    if (!l || (!l->buf && !l->absent))
+        return dir_snap_read(s, path);
+    if (l->absent) {
+        errno = ENOENT;
+        return -1;
+    }
 
-        if (r != 0) {
-            const char *mn = NULL;
-            if (c && c->module_name)
-                mn = c->module_name;
-            else if (node->module_name)
-                mn = node->module_name;
+    char *buf = l->buf;
+    l->buf = NULL;
+    return dir_snap_open(s, path, buf, l->len);
+}
 
-            if (mn) {
-                LOGE("child %s/%s failed (module: %s)", path, c ? c->name : de->d_name, mn);
-                module_mark_failed(ctx, mn);
-            } else {
-                LOGE("child %s/%s failed (no module_name)", path, c ? c->name : de->d_name);
-            }
+/* Set up the tmpfs directory of frame f and list the real entries to mirror */
+static int mm_dir_tmpfs(ApplyWalk *w, ApplyFrame *f) {
+    MagicMount *ctx = w->ctx;
+    Node *node = f->node;
+    const char *path = w->path.buf;
+    const char *wpath = w->wpath.buf;
+    int real_err = 0;
 
-            ctx->stats.nodes_fail++;
+    /* A replace dir hides the real entries */
+    if (!node->replace && mm_dir_real(w, node, path, &f->real) != 0)
+        real_err = errno;
 
-            if (now_tmp) {
-                closedir(d);
-                return -1;
-            }
+    if (f->create_tmp && w->new_api && mm_tree_open(w, f) != 0)
+        return -1;
+
+    if (mm_setup_dir_tmpfs(ctx, path, wpath, node, f->real.fd, mm_wdir_label(w), &f->label) != 0)
+        return -1;
+
+    if (f->create_tmp && !w->new_api) {
+        if (g_fs_ops->mount(wpath, wpath, NULL, MS_BIND, NULL) < 0) {
+            LOGE("bind self %s: %s", wpath, strerror(errno));
+            return -1;
         }
     }
-    closedir(d);
+
+    /* Real entries first (mirrored), then module-only ones */
+    if (f->real.fd >= 0) {
+        f->listing = true;
+    } else if (real_err && real_err != ENOENT) {
+        LOGE("opendir %s: %s", path, strerror(real_err));
+        return -1;
+    }
     return 0;
 }
 
-static int mm_process_remaining_children(MagicMount *ctx, const char *path, const char *wpath,
-                                         Node *node, bool now_tmp) {
-    for (size_t i = 0; i < node->child_count; ++i) {
-        Node *c = node->children[i];
-        if (c->skip || c->done)
-            continue;
+/* Prepare the directory frame f at path/wpath, reached at at, the way the
+ * plan says: onto the real dir, on a tmpfs (its own or the parent's) with the
+ * real entries listed for mirroring, or as a real dir bound whole
+ */
+static int mm_dir_open(ApplyWalk *w, ApplyFrame *f, ApplyAt at) {
+    Node *node = f->node;
+    const ApplyFrame *pf = w->depth ? &w->frames[w->depth - 1] : NULL;
 
-        int r = mm_apply_node_recursive(ctx, path, wpath, c, now_tmp);
-        if (r != 0) {
-            const char *mn = c->module_name ? c->module_name : node->module_name;
+    f->owner = pf && at != APPLY_REAL ? pf->owner : node->module_id;
 
-            if (mn) {
-                LOGE("child %s/%s failed (module: %s)", path, c->name, mn);
-                module_mark_failed(ctx, mn);
-            } else {
-                LOGE("child %s/%s failed (no module_name)", path, c->name);
-            }
+    /* Already there inside the bound dir */
+    if (at == APPLY_BOUND) {
+        f->at = APPLY_BOUND;
+        return 0;
+    }
 
-            ctx->stats.nodes_fail++;
-            if (now_tmp)
-                return -1;
-        }
+    if (at == APPLY_TMPFS && node->bind_real) {
+        LOGD("bind real dir %s -> %s", w->path.buf, w->wpath.buf);
+        f->at = APPLY_BOUND;
+
+        uint64_t t = monotonic_ns();
+        int ret = mm_bind_real_dir(w, 0755);
+        ModuleCost *mc = mm_walk_charge(w, f->owner, t);
+        if (mc)
+            mc->mirrors++;
+        return ret;
     }
-    return 0;
+
+    f->create_tmp = at == APPLY_REAL && node->own_tmpfs;
+    f->at = at == APPLY_TMPFS || f->create_tmp ? APPLY_TMPFS : APPLY_REAL;
+    if (f->at == APPLY_REAL)
+        return 0;
+
+    if (f->create_tmp) {
+        f->owner = mm_tmpfs_owner(node);
+        ModuleCost *mc = mm_walk_cost(w, f->owner);
+        if (mc)
+            mc->tmpfs++;
+    }
+
+    uint64_t t = monotonic_ns();
+    int ret = mm_dir_tmpfs(w, f);
+    uint64_t ns = monotonic_ns() - t;
+    ModuleCost *mc = mm_walk_cost(w, f->owner);
+
+    w->stats.tmpfs_ns += ns;
+    if (mc)
+        mc->apply_ns += ns;
+    TRACE_SPAN("dir tmpfs", t, mm_module_name(w->ctx, f->owner), w->path.buf);
+    return ret;
 }
 
-static int mm_apply_node_recursive(MagicMount *ctx, const char *base, const char *wbase, Node *node,
-                                   bool has_tmpfs) {
-    char path[PATH_MAX];
-    char wpath[PATH_MAX];
+/* Apply node below the top frame's paths. Files, symlinks and whiteouts are
+ * done inline; a directory is prepared and pushed as a frame (returns 1).
+ */
+static int mm_apply_node(ApplyWalk *w, Node *node, ApplyAt at) {
+    size_t saved, wsaved;
+    int ret = 0;
 
-    if (path_join(base, node->name, path, sizeof(path)) != 0 ||
-        path_join(wbase, node->name, wpath, sizeof(wpath)) != 0)
+    if (mm_walk_push_names(w, node->name, &saved, &wsaved) != 0)
         return -1;
 
+    uint64_t t = monotonic_ns();
     switch (node->type) {
     case NFT_REGULAR:
-        return mm_apply_regular_file(ctx, path, wpath, node, has_tmpfs);
+        ret = mm_apply_regular_file(w, node, at);
+        break;
 
     case NFT_SYMLINK:
-        return mm_apply_symlink(ctx, path, wpath, node);
+        ret = mm_apply_symlink(w, node);
+        break;
 
     case NFT_WHITEOUT:
-        LOGD("whiteout %s", path);
-        ctx->stats.nodes_whiteout++;
-        return 0;
+        LOGD("whiteout %s", w->path.buf);
+        w->stats.nodes_whiteout++;
+        break;
 
     case NFT_DIRECTORY: {
-        bool create_tmp = (!has_tmpfs && node->replace && node->module_path);
+        ApplyFrame f = {
+            .node = node, .real.fd = -1, .saved = saved, .wsaved = wsaved, .tree_fd = -1};
+
+        if (mm_dir_open(w, &f, at) == 0 && mm_walk_push(w, &f) == 0)
+            return 1;
 
-        if (!has_tmpfs && !create_tmp) {
-            create_tmp = mm_check_need_tmpfs(node, path);
+        dir_snap_release(&f.real);
+        mm_tree_close(w, &f);
+        ret = -1;
+        break;
+    }
+    }
+
+    /* A directory's time goes to the owner of its tmpfs, in mm_dir_open */
+    if (node->type != NFT_DIRECTORY) {
+        ModuleCost *mc = mm_walk_charge(w, node->module_id, t);
+        if (mc && ret == 0 && node->type == NFT_REGULAR)
+            mc->binds++;
+    }
+
+    mm_walk_pop_names(w, saved, wsaved);
+    return ret;
+}
+
+/* Record a failed child of the top frame. Returns -1 if that fails the frame. */
+static int mm_child_failed(ApplyWalk *w, Node *c, const char *name) {
+    MagicMount *ctx = w->ctx;
+    ApplyFrame *f = &w->frames[w->depth - 1];
+    const char *mn = c ? node_module_name(ctx, c) : NULL;
+    if (!mn)
+        mn = node_module_name(ctx, f->node);
+
+    if (mn) {
+        LOGE("child %s/%s failed (module: %s)", w->path.buf, name, mn);
+        mm_walk_failed(w, mn);
+    } else {
+        LOGE("child %s/%s failed (no module_name)", w->path.buf, name);
+    }
+
+    w->stats.nodes_fail++;
+    return f->at == APPLY_REAL ? 0 : -1;
+}
+
+/* Queue child c of the real dir f for the worker pool. Tasks of one parent
+ * share its path strings, kept in the tree's arena.
+ */
+static int mm_task_add(ApplyWalk *w, ApplyFrame *f, Node *c) {
+    ApplyTasks *q = w->tasks;
+
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        ApplyTask *arr = realloc(q->items, cap * sizeof(*arr));
+        if (!arr) {
+            LOGE("apply: failed to queue %s/%s", w->path.buf, c->name);
+            return -1;
         }
+        q->items = arr;
+        q->cap = cap;
+    }
 
-        bool now_tmp = has_tmpfs || create_tmp;
+    ApplyTask *t = &q->items[q->count];
+    *t = (ApplyTask){.node = c, .parent = f->node};
 
-        if (now_tmp) {
-            if (mm_setup_dir_tmpfs(path, wpath, node) != 0)
-                return -1;
+    if (q->count > 0 && q->items[q->count - 1].parent == f->node) {
+        t->path = q->items[q->count - 1].path;
+        t->wpath = q->items[q->count - 1].wpath;
+    } else {
+        t->path = arena_strdup(&w->ctx->arena, w->path.buf);
+        t->wpath = arena_strdup(&w->ctx->arena, w->wpath.buf);
+        if (!t->path || !t->wpath) {
+            LOGE("apply: failed to queue %s/%s", w->path.buf, c->name);
+            return -1;
         }
+    }
 
-        if (create_tmp) {
-            if (mount(wpath, wpath, NULL, MS_BIND, NULL) < 0) {
-                LOGE("bind self %s: %s", wpath, strerror(errno));
-                return -1;
-            }
+    q->count++;
+    return 0;
+}
+
+/* Do one child of the top frame: 0 to go on, 1 once the frame has no
+ * children left, -1 if the frame failed
+ */
+static int mm_walk_step(ApplyWalk *w) {
+    ApplyFrame *f = &w->frames[w->depth - 1];
+    Node *node = f->node;
+    int r;
+
+    if (f->listing) {
+        const struct linux_dirent64 *de = dir_snap_next(&f->real);
+        if (!de) {
+            f->listing = false;
+            dir_snap_release(&f->real);
+            return 0;
         }
 
-        if (mm_process_dir_children(ctx, path, wpath, node, now_tmp) != 0)
-            return -1;
+        /* Points into the snapshot, which stays put while f is on the stack */
+        const char *name = de->d_name;
+        Node *c = node_child_find(node, name);
+        if (c) {
+            c->done = true;
+            if (c->skip)
+                return 0;
+            r = mm_apply_node(w, c, f->at);
+        } else {
+            uint64_t t = monotonic_ns();
+            r = mm_mirror_entry(w, f->real.fd, name);
+            ModuleCost *mc = mm_walk_charge(w, f->owner, t);
+            if (mc)
+                mc->mirrors++;
+        }
 
-        if (mm_process_remaining_children(ctx, path, wpath, node, now_tmp) != 0)
-            return -1;
+        /* f may be stale once a frame was pushed */
+        if (r < 0)
+            return mm_child_failed(w, c, c ? c->name : name);
+        return 0;
+    }
 
-        if (create_tmp) {
-            (void)mount(NULL, wpath, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
+    Node *const *kids = node_children(node);
+    while (f->next < node->child_count) {
+        Node *c = kids[f->next++];
+        if (c->skip || c->done)
+            continue;
 
-            if (mount(wpath, path, NULL, MS_MOVE, NULL) < 0) {
+        /* Only the dirs that stay on the real tree are walked here */
+        if (w->tasks && f->at == APPLY_REAL && (c->type != NFT_DIRECTORY || c->own_tmpfs))
+            r = mm_task_add(w, f, c);
+        else
+            r = mm_apply_node(w, c, f->at);
+        if (r < 0)
+            return mm_child_failed(w, c, c->name);
+        return 0;
+    }
+    return 1;
+}
+
+/* Finish the top frame with result r (mounting it if it got its own tmpfs),
+ * pop it and hand the result to the new top. Returns -1 if that one fails too.
+ */
+static int mm_walk_leave(ApplyWalk *w, int r) {
+    MagicMount *ctx = w->ctx;
+    ApplyFrame f = w->frames[--w->depth];
+    const char *path = w->path.buf;
+    const char *wpath = w->wpath.buf;
+
+    dir_snap_release(&f.real);
+
+    if (r == 0) {
+        uint64_t t = monotonic_ns();
+        if (f.create_tmp && w->new_api) {
+            if (g_fs_ops->tree_seal(f.tree_fd) != 0 ||
+                g_fs_ops->tree_attach(f.tree_fd, path) != 0) {
+                LOGE("attach tree %s->%s failed: %s", wpath, path, strerror(errno));
+                mm_walk_failed(w, node_module_name(ctx, f.node));
+                r = -1;
+            } else {
+                LOGI("attach tree success: %s -> %s", wpath, path);
+                mm_walk_umount(w, path);
+            }
+        } else if (f.create_tmp) {
+            (void)g_fs_ops->mount(NULL, wpath, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL);
+
+            if (g_fs_ops->mount(wpath, path, NULL, MS_MOVE, NULL) < 0) {
                 LOGE("move %s->%s failed: %s", wpath, path, strerror(errno));
-                if (node->module_name)
-                    module_mark_failed(ctx, node->module_name);
-                return -1;
+                mm_walk_failed(w, node_module_name(ctx, f.node));
+                r = -1;
+            } else {
+                LOGI("move mountpoint success: %s -> %s", wpath, path);
+                (void)g_fs_ops->mount(NULL, path, NULL, MS_REC | MS_PRIVATE, NULL);
+                mm_walk_umount(w, path);
             }
+        }
+        if (f.create_tmp) {
+            mm_walk_charge(w, f.owner, t);
+            TRACE_SPAN(w->new_api ? "attach tree" : "move", t, mm_module_name(ctx, f.owner), path);
+        }
+
+        if (r == 0)
+            w->stats.nodes_mounted++;
+    }
+
+    mm_tree_close(w, &f);
+
+    if (w->depth == 0)
+        return r;
+
+    mm_walk_pop_names(w, f.saved, f.wsaved);
+
+    return r == 0 ? 0 : mm_child_failed(w, f.node, f.node->name);
+}
+
+/* Apply node below the walk's current paths; the stack is empty again after */
+static int mm_walk_run(ApplyWalk *w, Node *node) {
+    int rc = mm_apply_node(w, node, APPLY_REAL);
+    if (rc != 1)
+        return rc;
+
+    while (w->depth > 0) {
+        rc = mm_walk_step(w);
+        if (rc == 0)
+            continue;
+
+        /* Unwind while failures propagate */
+        rc = rc > 0 ? 0 : -1;
+        size_t depth;
+        do {
+            depth = w->depth;
+            rc = mm_walk_leave(w, rc);
+        } while (rc != 0 && depth > 1);
+    }
+    return rc;
+}
+
+static void mm_umounts_adopt(MagicMount *ctx, char ***arr, int *count) {
+    for (int i = 0; i < *count; ++i)
+        magic_mount_queue_umount(ctx, (*arr)[i]);
+    str_array_free(arr, count);
+}
+
+/* Hand the walk's counts, failed modules and try-umount paths to ctx */
+static void mm_walk_finish(ApplyWalk *w) {
+    MagicMount *ctx = w->ctx;
+
+    ctx->stats.nodes_mounted += w->stats.nodes_mounted;
+    ctx->stats.nodes_whiteout += w->stats.nodes_whiteout;
+    ctx->stats.nodes_fail += w->stats.nodes_fail;
+    ctx->stats.tmpfs_ns += w->stats.tmpfs_ns;
+    memset(&w->stats, 0, sizeof(w->stats));
+
+    for (size_t i = 0; w->costs && i < ctx->module_costs_count; ++i) {
+        ModuleCost *mc = &ctx->module_costs[i];
+        mc->binds += w->costs[i].binds;
+        mc->tmpfs += w->costs[i].tmpfs;
+        mc->mirrors += w->costs[i].mirrors;
+        mc->apply_ns += w->costs[i].apply_ns;
+    }
+    free(w->costs);
+    w->costs = NULL;
 
-            LOGI("move mountpoint success: %s -> %s", wpath, path);
-            (void)mount(NULL, path, NULL, MS_REC | MS_PRIVATE, NULL);
+    for (int i = 0; i < w->failed_count; ++i)
+        module_mark_failed(ctx, w->failed[i]);
+    str_array_free(&w->failed, &w->failed_count);
+    mm_umounts_adopt(ctx, &w->umounts, &w->umount_count);
+
+    free(w->frames);
+    w->frames = NULL;
+    w->depth = w->cap = 0;
+}
 
-            if (ctx->enable_unmountable)
-                ksu_send_unmountable(path);
+typedef struct {
+    ApplyWalk w;
+    ApplyTasks *tasks;
+    atomic_size_t *next;
+    pthread_t tid;
+} ApplyWorker;
+
+static void *mm_apply_worker(void *arg) {
+    ApplyWorker *aw = arg;
+    ApplyWalk *w = &aw->w;
+
+    trace_thread_name("apply");
+    for (;;) {
+        size_t i = atomic_fetch_add(aw->next, 1);
+        if (i >= aw->tasks->count)
+            break;
+
+        ApplyTask *t = &aw->tasks->items[i];
+        if (path_buf_set(&w->path, t->path) != 0 || path_buf_set(&w->wpath, t->wpath) != 0) {
+            t->ret = -1;
+            continue;
         }
 
-        ctx->stats.nodes_mounted++;
-        return 0;
+        t->ret = mm_walk_run(w, t->node);
+
+        /* Kept per task so they reach ctx in tree order */
+        t->failed = w->failed;
+        t->failed_count = w->failed_count;
+        w->failed = NULL;
+        w->failed_count = 0;
+        t->umounts = w->umounts;
+        t->umount_count = w->umount_count;
+        w->umounts = NULL;
+        w->umount_count = 0;
+    }
+    return NULL;
+}
+
+/* Run the queued subtrees on up to jobs threads. They share the mount
+ * namespace but never a mount point: each task is a file or a directory with
+ * a tmpfs of its own below a real dir, so the MS_MOVE or attach that finishes
+ * one only ever lands on its own path.
+ */
+static void mm_apply_tasks(MagicMount *ctx, ApplyTasks *q, bool new_api, int jobs,
+                           PlanListings *listings) {
+    ApplyWorker one = {0};
+    atomic_size_t next = 0;
+
+    if (q->count == 0)
+        return;
+    if ((size_t)jobs > q->count)
+        jobs = (int)q->count;
+
+    ApplyWorker *workers = jobs > 1 ? calloc((size_t)jobs, sizeof(ApplyWorker)) : &one;
+    if (!workers) {
+        LOGW("apply: failed to allocate %d workers, applying sequentially", jobs);
+        jobs = 1;
+        workers = &one;
+    }
+
+    for (int i = 0; i < jobs; ++i) {
+        workers[i].w = (ApplyWalk){.ctx = ctx, .new_api = new_api, .listings = listings};
+        workers[i].tasks = q;
+        workers[i].next = &next;
+    }
+
+    /* A failed spawn only means fewer workers */
+    int spawned = 1;
+    for (; spawned < jobs; ++spawned) {
+        int err =
+            pthread_create(&workers[spawned].tid, NULL, mm_apply_worker, &workers[spawned]);
+        if (err != 0) {
+            LOGW("apply: pthread_create failed: %s", strerror(err));
+            break;
+        }
+    }
+
+    LOGI("applying %zu subtrees with %d workers", q->count, spawned);
+
+    mm_apply_worker(&workers[0]);
+    for (int i = 1; i < spawned; ++i)
+        pthread_join(workers[i].tid, NULL);
+
+    for (int i = 0; i < jobs; ++i)
+        mm_walk_finish(&workers[i].w);
+    if (workers != &one)
+        free(workers);
+}
+
+/* Walk the dirs that stay on the real tree from root, queueing everything
+ * else, then apply the queue on ctx->apply_jobs threads. A failed task is
+ * recorded as the sequential walk would have, as a failed child of its
+ * (real) parent.
+ */
+static int mm_apply_parallel(MagicMount *ctx, const char *wbase, Node *root, bool new_api,
+                             PlanListings *listings) {
+    ApplyTasks q = {0};
+    ApplyWalk w = {.ctx = ctx, .new_api = new_api, .tasks = &q, .listings = listings};
+    int rc = -1;
+
+    if (path_buf_set(&w.path, "/") == 0 && path_buf_set(&w.wpath, wbase) == 0)
+        rc = mm_walk_run(&w, root);
+    mm_walk_finish(&w);
+
+    mm_apply_tasks(ctx, &q, new_api, ctx->apply_jobs, listings);
+
+    for (size_t i = 0; i < q.count; ++i) {
+        ApplyTask *t = &q.items[i];
+
+        for (int j = 0; j < t->failed_count; ++j)
+            module_mark_failed(ctx, t->failed[j]);
+        str_array_free(&t->failed, &t->failed_count);
+        mm_umounts_adopt(ctx, &t->umounts, &t->umount_count);
+
+        if (t->ret == 0)
+            continue;
+
+        const char *mn = node_module_name(ctx, t->node);
+        if (!mn)
+            mn = node_module_name(ctx, t->parent);
+        if (mn) {
+            LOGE("child %s/%s failed (module: %s)", t->path, t->node->name, mn);
+            module_mark_failed(ctx, mn);
+        } else {
+            LOGE("child %s/%s failed (no module_name)", t->path, t->node->name);
+        }
+        ctx->stats.nodes_fail++;
     }
+
+    free(q.items);
+    return rc;
+}
+
+static int mm_apply_tree(MagicMount *ctx, const char *wbase, Node *root, bool new_api,
+                         PlanListings *listings) {
+    if (ctx->apply_jobs > 1)
+        return mm_apply_parallel(ctx, wbase, root, new_api, listings);
+
+    ApplyWalk w = {.ctx = ctx, .new_api = new_api, .listings = listings};
+    int rc = -1;
+
+    if (path_buf_set(&w.path, "/") == 0 && path_buf_set(&w.wpath, wbase) == 0)
+        rc = mm_walk_run(&w, root);
+    mm_walk_finish(&w);
+    return rc;
+}
+
+/* Legacy backend: replacement trees are built inside a tmpfs at <tmp_root>/workdir */
+static int mm_workdir_setup(MagicMount *ctx, const char *tmp_root, char *tmp_dir, size_t len) {
+    if (path_join(tmp_root, "workdir", tmp_dir, len) != 0)
+        return -1;
+
+    if (mkdir_p(tmp_dir) != 0)
+        return -1;
+
+    LOGI("starting magic_mount core logic: tmpfs_source=%s tmp_dir=%s", ctx->mount_source, tmp_dir);
+
+    if (g_fs_ops->mount(ctx->mount_source, tmp_dir, "tmpfs", 0, "") < 0) {
+        LOGE("mount tmpfs %s: %s", tmp_dir, strerror(errno));
+        return -1;
     }
 
+    (void)g_fs_ops->mount(NULL, tmp_dir, NULL, MS_REC | MS_PRIVATE, NULL);
     return 0;
 }
 
+typedef struct {
+    const char *path;
+    int seq; /* position in ctx->try_umounts */
+} UmountEntry;
+
+static int umount_entry_cmp(const void *a, const void *b) {
+    const UmountEntry *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* seq of the first registration of exactly path[0, len) in the sorted e,
+ * -1 if there is none
+ */
+static int umount_entry_find(const UmountEntry *e, int n, const char *path, size_t len) {
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strncmp(e[mid].path, path, len);
+        if (c == 0)
+            c = e[mid].path[len] != '\0';
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < n && !strncmp(e[lo].path, path, len) && e[lo].path[len] == '\0')
+        return e[lo].seq;
+    return -1;
+}
+
+/* Send the queued try-umount paths in mount order, minus the ones KSU would
+ * take down anyway: it detaches (MNT_DETACH) every registered mount with
+ * everything below it, so a path is covered by a parent registered before it
+ * (the parent's mount was there first, so this one sits inside it). Within
+ * one apply that is a file or tmpfs below an overlaid partition, or a
+ * repeated path.
+ */
+static void mm_try_umount_flush(MagicMount *ctx) {
+    int n = ctx->try_umounts_count;
+    char **paths = ctx->try_umounts;
+
+    if (n == 0)
+        return;
+
+    UmountEntry *e = malloc((size_t)n * sizeof(*e));
+    bool *keep = malloc((size_t)n * sizeof(*keep));
+    if (!e || !keep) {
+        LOGW("try-umount: out of memory, sending all %d paths", n);
+        for (int i = 0; i < n; ++i)
+            (void)g_fs_ops->try_umount(paths[i]);
+        ctx->stats.umounts_sent += n;
+        goto out;
+    }
+
+    for (int i = 0; i < n; ++i)
+        e[i] = (UmountEntry){.path = paths[i], .seq = i};
+    qsort(e, (size_t)n, sizeof(*e), umount_entry_cmp);
+
+    for (int i = 0; i < n; ++i) {
+        const char *p = e[i].path;
+        bool covered = i > 0 && !strcmp(p, e[i - 1].path);
+
+        for (const char *s = strchr(p + 1, '/'); s && !covered; s = strchr(s + 1, '/')) {
+            int seq = umount_entry_find(e, n, p, (size_t)(s - p));
+            covered = seq >= 0 && seq < e[i].seq;
+        }
+        keep[e[i].seq] = !covered;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (!keep[i]) {
+            LOGD("try-umount %s: covered by a parent", paths[i]);
+            ctx->stats.umounts_covered++;
+            continue;
+        }
+        (void)g_fs_ops->try_umount(paths[i]);
+        ctx->stats.umounts_sent++;
+    }
+
+    LOGI("try-umount: sent %d paths, %d covered by a parent", ctx->stats.umounts_sent,
+         ctx->stats.umounts_covered);
+
+out:
+    free(e);
+    free(keep);
+    str_array_free(&ctx->try_umounts, &ctx->try_umounts_count);
+}
+
 int magic_mount(MagicMount *ctx, const char *tmp_root) {
     if (!ctx)
         return -1;
@@ -411,39 +1097,83 @@ int magic_mount(MagicMount *ctx, const char *tmp_root) {
     Node *root = build_mount_tree(ctx);
     if (!root) {
         LOGI("no modules, magic_mount skipped");
+        if (ctx->mount_index)
+            (void)unlink(ctx->mount_index);
+        arena_destroy(&ctx->arena);
         return 0;
     }
 
-    char tmp_dir[PATH_MAX];
-    if (path_join(tmp_root, "workdir", tmp_dir, sizeof(tmp_dir)) != 0) {
-        node_free(root);
-        return -1;
-    }
+    LOGD("mount tree arena: %zu bytes used, %zu bytes reserved", ctx->arena.bytes_used,
+         ctx->arena.bytes_reserved);
 
-    if (mkdir_p(tmp_dir) != 0) {
-        node_free(root);
-        return -1;
+    uint64_t t = monotonic_ns();
+
+    bool new_api = ctx->mount_api == MOUNT_API_NEW;
+    if (new_api && !g_fs_ops->tree_supported()) {
+        LOGW("new mount API not supported by this kernel, using legacy mounts");
+        new_api = false;
     }
 
-    LOGI("starting magic_mount core logic: tmpfs_source=%s tmp_dir=%s", ctx->mount_source, tmp_dir);
+    /* Overlaid partitions are marked done, the plan covers the rest */
+    int overlays = 0;
+    if (ctx->backend == MOUNT_BACKEND_OVERLAY)
+        overlays = overlay_mount_partitions(ctx, root);
 
-    if (mount(ctx->mount_source, tmp_dir, "tmpfs", 0, "") < 0) {
-        LOGE("mount tmpfs %s: %s", tmp_dir, strerror(errno));
-        node_free(root);
+    MountPlanCost *plan = &ctx->stats.plan;
+    PlanListings listings;
+    if (mount_plan_build(root, new_api, plan, &listings) != 0) {
+        mm_try_umount_flush(ctx);
+        arena_destroy(&ctx->arena);
         return -1;
     }
+    plan->overlays = overlays;
+    plan->mounts += overlays;
+    t = magic_mount_phase(ctx, PHASE_PLAN, t);
+
+    LOGI("mount plan: %ld mounts (%d overlays, %d tmpfs, %d bound dirs), ~%ld syscalls, "
+         "%ld tmpfs inodes",
+         plan->mounts, plan->overlays, plan->tmpfs_roots, plan->bound_dirs, plan->syscalls,
+         plan->inodes);
+
+    /* Detached trees need no workdir */
+    char tmp_dir[PATH_MAX] = "";
+    if (new_api) {
+        LOGI("starting magic_mount core logic: tmpfs_source=%s new mount API",
+             ctx->mount_source);
+    } else if (mm_workdir_setup(ctx, tmp_root, tmp_dir, sizeof(tmp_dir)) != 0) {
+        mount_plan_listings_free(&listings);
+        mm_try_umount_flush(ctx);
+        arena_destroy(&ctx->arena);
+        return -1;
+    }
+    t = magic_mount_phase(ctx, PHASE_WORKDIR, t);
 
-    (void)mount(NULL, tmp_dir, NULL, MS_REC | MS_PRIVATE, NULL);
-
-    int rc = mm_apply_node_recursive(ctx, "/", tmp_dir, root, false);
+    int rc = mm_apply_tree(ctx, tmp_dir, root, new_api, &listings);
+    mount_plan_listings_free(&listings);
     if (rc != 0)
         ctx->stats.nodes_fail++;
+    t = magic_mount_phase(ctx, PHASE_APPLY, t);
+
+    /* Whatever did get mounted is registered, failure or not */
+    mm_try_umount_flush(ctx);
+    t = magic_mount_phase(ctx, PHASE_UMOUNT, t);
 
-    if (umount2(tmp_dir, MNT_DETACH) < 0)
-        LOGE("umount %s: %s", tmp_dir, strerror(errno));
+    if (ctx->warmup.enabled) {
+        warmup_run(ctx, root);
+        t = magic_mount_phase(ctx, PHASE_WARMUP, t);
+    }
+
+    if (!new_api) {
+        if (g_fs_ops->umount2(tmp_dir, MNT_DETACH) < 0)
+            LOGE("umount %s: %s", tmp_dir, strerror(errno));
+
+        (void)g_fs_ops->rmdir(tmp_dir);
+    }
 
-    (void)rmdir(tmp_dir);
+    if (ctx->mount_index && mount_index_write(ctx, root, ctx->mount_index) != 0)
+        LOGW("failed to write mount index %s", ctx->mount_index);
+    magic_mount_phase(ctx, PHASE_FINISH, t);
 
-    node_free(root);
+    arena_destroy(&ctx->arena);
     return rc;
 }
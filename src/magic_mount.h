@@ -1,8 +1,11 @@
 #ifndef MAGIC_MOUNT_H
 #define MAGIC_MOUNT_H
 
+#include "arena.h"
+#include "module_catalog.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define DISABLE_FILE_NAME "disable"
 #define REMOVE_FILE_NAME "remove"
@@ -13,6 +16,66 @@
 
 #define DEFAULT_MOUNT_SOURCE "KSU"
 #define DEFAULT_MODULE_DIR "/data/adb/modules"
+#define DEFAULT_SCAN_JOBS 1
+#define DEFAULT_APPLY_JOBS 1
+#define MAX_SCAN_JOBS 64
+#define DEFAULT_TREE_CACHE "/data/adb/magic_mount/tree.cache"
+#define DEFAULT_MOUNT_INDEX "/data/adb/magic_mount/mount.idx"
+#define DEFAULT_WARMUP_EXTS ".so,.apk,.odex,.vdex,.jar"
+#define DEFAULT_WARMUP_MAX_SIZE (64LL << 20)
+#define DEFAULT_WARMUP_BUDGET_MS 200
+
+/* How replacement directories are built and put in place */
+typedef enum {
+    MOUNT_API_LEGACY, /* mount(2) binds in a workdir tmpfs, MS_MOVE'd into place */
+    MOUNT_API_NEW,    /* detached trees, sealed and attached with move_mount */
+} MountApi;
+
+/* What puts the module files over the partitions */
+typedef enum {
+    MOUNT_BACKEND_BIND,    /* binds and tmpfs per directory, as planned */
+    MOUNT_BACKEND_OVERLAY, /* one overlay per partition where it fits, binds elsewhere */
+} MountBackend;
+
+/* How the module scan issues its per-entry metadata calls */
+typedef enum {
+    SCAN_IO_SYNC,  /* one blocking syscall after another */
+    SCAN_IO_URING, /* batched per directory through io_uring, sync if unavailable */
+} ScanIo;
+
+/* Post-mount readahead of module files, see warmup.h */
+typedef struct {
+    bool enabled;
+    const char *exts;   /* comma separated name suffixes */
+    long long max_size; /* bytes, larger files are left alone */
+    int budget_ms;      /* no new file is started after this */
+} WarmupConfig;
+
+/* Totals predicted by the mount planner */
+typedef struct {
+    long mounts;     /* mounts left in the namespace */
+    long syscalls;   /* estimated calls to apply the plan */
+    long inodes;     /* entries created on tmpfs */
+    int tmpfs_roots; /* directories given their own tmpfs */
+    int bound_dirs;  /* real directories bound whole into a tmpfs */
+    int overlays;    /* partitions mounted as one overlay */
+} MountPlanCost;
+
+/* Stages of a run, timed on the monotonic clock; see stats.h for the names */
+typedef enum {
+    PHASE_CATALOG,    /* module enumeration and tree cache load */
+    PHASE_SCAN,       /* module trees */
+    PHASE_SYMLINKS,   /* symlink compatibility resolution */
+    PHASE_PROMOTE,    /* builtin and extra partitions moved to / */
+    PHASE_CACHE_SAVE, /* tree cache rewrite */
+    PHASE_PLAN,       /* overlay backend and mount plan */
+    PHASE_WORKDIR,    /* tmpfs the legacy backend builds in */
+    PHASE_APPLY,
+    PHASE_UMOUNT, /* try-umount registration */
+    PHASE_WARMUP,
+    PHASE_FINISH, /* workdir teardown and mount index */
+    PHASE_COUNT,
+} MountPhase;
 
 /* Mount statistics */
 typedef struct {
@@ -22,8 +85,29 @@ typedef struct {
     int nodes_skipped;
     int nodes_whiteout;
     int nodes_fail;
+    int umounts_sent;    /* try-umount registrations sent to KSU */
+    int umounts_covered; /* dropped: a parent mount was registered first */
+    int warm_files;      /* advised for readahead */
+    int warm_left;       /* candidates the time budget did not reach */
+    long long warm_bytes;
+    long warm_ms;
+    MountPlanCost plan;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t tmpfs_ns; /* directory tmpfs setup within the apply, summed over workers */
+    uint64_t total_ns;
 } MountStats;
 
+/* What one module cost the run, see MagicMount.module_costs */
+typedef struct {
+    char *name;
+    int nodes;         /* scanned or loaded from the tree cache */
+    int binds;         /* module files bound into place */
+    int tmpfs;         /* directories given a tmpfs of their own for its entries */
+    int mirrors;       /* real entries recreated in those */
+    uint64_t scan_ns;  /* its module_dir subtrees */
+    uint64_t apply_ns; /* its nodes, plus setup, mirroring and move of its tmpfs */
+} ModuleCost;
+
 /* Core ctx */
 typedef struct MagicMount {
     const char *module_dir;
@@ -34,10 +118,47 @@ typedef struct MagicMount {
     char **failed_modules;
     int failed_modules_count;
 
+    /* Indexed by module id - 1, one per catalog entry; outlives the arena */
+    ModuleCost *module_costs;
+    size_t module_costs_count;
+
+    /* try-umount paths in mount order, sent by one flush after the apply */
+    char **try_umounts;
+    int try_umounts_count;
+
     char **extra_parts;
     int extra_parts_count;
 
+    /* Backing store of the mount tree */
+    Arena arena;
+
+    /* Enumerated once per build_mount_tree */
+    ModuleCatalog catalog;
+
     bool enable_unmountable;
+
+    /* Worker threads for the module scan, 1 = sequential */
+    int scan_jobs;
+
+    /* Worker threads applying independent subtrees, 1 = sequential */
+    int apply_jobs;
+
+    /* Module subtrees kept across boots, NULL disables the cache */
+    const char *tree_cache;
+
+    /* Binary index of the final tree for --which/--ls, NULL disables */
+    const char *mount_index;
+
+    /* Falls back to MOUNT_API_LEGACY if the kernel lacks the new API */
+    MountApi mount_api;
+
+    /* Falls back to binds per partition */
+    MountBackend backend;
+
+    /* Falls back to SCAN_IO_SYNC without io_uring */
+    ScanIo scan_io;
+
+    WarmupConfig warmup;
 } MagicMount;
 
 /* Initialization ctx (module_dir/mount_source) */
@@ -46,6 +167,15 @@ void magic_mount_init(MagicMount *ctx);
 /* Main func */
 int magic_mount(MagicMount *ctx, const char *tmp_root);
 
+/* Queue path, just mounted, for KSU try-umount (no-op if that is disabled) */
+void magic_mount_queue_umount(MagicMount *ctx, const char *path);
+
+/* Add the time since start to phase, returns now for the next one */
+uint64_t magic_mount_phase(MagicMount *ctx, MountPhase phase, uint64_t start);
+
+/* Cost entry of module id, NULL for 0 or when costs are not kept */
+ModuleCost *magic_mount_cost(MagicMount *ctx, uint16_t id);
+
 /* (failure module / extra_parts) */
 void magic_mount_cleanup(MagicMount *ctx);
 
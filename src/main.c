@@ -1,5 +1,10 @@
+#include "fs_ops.h"
 #include "magic_mount.h"
 #include "module_tree.h"
+#include "mount_index.h"
+#include "opstat.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <ctype.h>
@@ -17,6 +22,9 @@
 
 #define DEFAULT_CONFIG_PATH "/data/adb/magic_mount/mm.conf"
 
+/* Modules listed by cost in the log summary, the stats file has all */
+#define SUMMARY_MODULE_COSTS 10
+
 /* --- Configuration structure --- */
 typedef struct {
     const char *module_dir;
@@ -24,15 +32,36 @@ typedef struct {
     const char *mount_source;
     const char *log_file;
     const char *partitions;
+    const char *tree_cache;
+    const char *mount_index;
+    const char *stats_file;
+    const char *trace_file;
+    int mount_api;
+    int backend;
+    int scan_io;
+    int jobs;
+    int apply_jobs;
     bool debug;
     bool umount;
+    bool warmup;
+    bool op_stats;
+    const char *warmup_exts;
+    long long warmup_max_size;
+    int warmup_budget_ms;
 } Config;
 
 /* --- Forward declarations --- */
 static void usage(const char *prog);
 static int load_config_file(const char *path, Config *cfg, MagicMount *ctx);
 static int parse_partitions(const char *list, MagicMount *ctx);
+static int parse_jobs(const char *val);
+static int parse_mount_api(const char *val);
+static int parse_backend(const char *val);
+static int parse_scan_io(const char *val);
+static long long parse_size(const char *val);
+static int parse_ms(const char *val);
 static int setup_logging(const char *log_path);
+static const char *stats_default_path(const char *log_path, char buf[PATH_MAX]);
 static void print_summary(const MagicMount *ctx);
 static void cleanup_resources(MagicMount *ctx);
 
@@ -48,13 +77,34 @@ static void usage(const char *prog) {
             "  -t, --temp-dir DIR        Temporary directory (default: auto-detected)\n"
             "  -s, --mount-source SRC    Mount source (default: %s)\n"
             "  -p, --partitions LIST     Extra partitions (eg. mi_ext,my_stock)\n"
+            "  -j, --jobs N              Module scan threads (default: %d)\n"
+            "      --apply-jobs N        Mount threads for independent subtrees (default: %d)\n"
+            "      --tree-cache FILE     Module tree cache, 'none' to disable (default: %s)\n"
+            "      --no-tree-cache       Rescan every module, ignoring the tree cache\n"
+            "      --index FILE          Mount index, 'none' to disable (default: %s)\n"
+            "      --mount-api API       Mount backend: legacy or new (default: legacy)\n"
+            "      --backend MODE        Partition mounts: bind or overlay (default: bind)\n"
+            "      --scan-io MODE        Module scan I/O: sync or uring (default: sync)\n"
+            "      --warmup              Read ahead mounted module files after mounting\n"
+            "      --warmup-ext LIST     Name suffixes to read ahead (default: %s)\n"
+            "      --warmup-max-size N   Skip larger files, K/M/G suffix (default: %lldM)\n"
+            "      --warmup-budget MS    Time allowed for the read-ahead (default: %d)\n"
+            "      --stats FILE          Timings and counters as JSON, 'none' to disable\n"
+            "                            (default: the log file's name with .stats.json)\n"
+            "      --op-stats            Count filesystem calls and their latencies\n"
+            "      --trace FILE          Write the run's spans as Chrome trace-event JSON\n"
+            "      --which PATH          Show which module provides PATH (from the index)\n"
+            "      --ls DIR              List DIR as mounted by modules (from the index)\n"
+            "      --dry-run             Simulate every mount and write, print the operations\n"
             "  -l, --log-file FILE       Log file (default: stderr, '-' for stdout)\n"
             "  -c, --config FILE         Config file (default: %s)\n"
             "  -v, --verbose             Enable debug logging\n"
             "      --no_umount           Disable umount\n"
             "  -h, --help                Show this help message\n"
             "\n",
-            VERSION, prog, DEFAULT_MODULE_DIR, DEFAULT_MOUNT_SOURCE, DEFAULT_CONFIG_PATH);
+            VERSION, prog, DEFAULT_MODULE_DIR, DEFAULT_MOUNT_SOURCE, DEFAULT_SCAN_JOBS,
+            DEFAULT_APPLY_JOBS, DEFAULT_TREE_CACHE, DEFAULT_MOUNT_INDEX, DEFAULT_WARMUP_EXTS,
+            DEFAULT_WARMUP_MAX_SIZE >> 20, DEFAULT_WARMUP_BUDGET_MS, DEFAULT_CONFIG_PATH);
 }
 
 static int load_config_file(const char *path, Config *cfg, MagicMount *ctx) {
@@ -105,6 +155,12 @@ static int load_config_file(const char *path, Config *cfg, MagicMount *ctx) {
         } else if (!strcasecmp(key, "log_file")) {
             cfg->log_file = strdup(val);
 
+        } else if (!strcasecmp(key, "stats_file")) {
+            cfg->stats_file = strdup(val);
+
+        } else if (!strcasecmp(key, "trace_file")) {
+            cfg->trace_file = strdup(val);
+
         } else if (!strcasecmp(key, "debug")) {
             cfg->debug = str_is_true(val);
 
@@ -114,6 +170,55 @@ static int load_config_file(const char *path, Config *cfg, MagicMount *ctx) {
         } else if (!strcasecmp(key, "partitions")) {
             cfg->partitions = strdup(val);
 
+        } else if (!strcasecmp(key, "jobs")) {
+            cfg->jobs = parse_jobs(val);
+            if (cfg->jobs < 0)
+                LOGW("config:%d: invalid jobs '%s'", line_num, val);
+        } else if (!strcasecmp(key, "apply_jobs")) {
+            cfg->apply_jobs = parse_jobs(val);
+            if (cfg->apply_jobs < 0)
+                LOGW("config:%d: invalid apply_jobs '%s'", line_num, val);
+
+        } else if (!strcasecmp(key, "tree_cache")) {
+            cfg->tree_cache = strdup(val);
+
+        } else if (!strcasecmp(key, "mount_index")) {
+            cfg->mount_index = strdup(val);
+
+        } else if (!strcasecmp(key, "mount_api")) {
+            cfg->mount_api = parse_mount_api(val);
+            if (cfg->mount_api < 0)
+                LOGW("config:%d: invalid mount_api '%s'", line_num, val);
+
+        } else if (!strcasecmp(key, "backend")) {
+            cfg->backend = parse_backend(val);
+            if (cfg->backend < 0)
+                LOGW("config:%d: invalid backend '%s'", line_num, val);
+
+        } else if (!strcasecmp(key, "warmup")) {
+            cfg->warmup = str_is_true(val);
+
+        } else if (!strcasecmp(key, "warmup_exts")) {
+            cfg->warmup_exts = strdup(val);
+
+        } else if (!strcasecmp(key, "warmup_max_size")) {
+            cfg->warmup_max_size = parse_size(val);
+            if (cfg->warmup_max_size < 0)
+                LOGW("config:%d: invalid warmup_max_size '%s'", line_num, val);
+
+        } else if (!strcasecmp(key, "warmup_budget_ms")) {
+            cfg->warmup_budget_ms = parse_ms(val);
+            if (cfg->warmup_budget_ms < 0)
+                LOGW("config:%d: invalid warmup_budget_ms '%s'", line_num, val);
+
+        } else if (!strcasecmp(key, "op_stats")) {
+            cfg->op_stats = str_is_true(val);
+
+        } else if (!strcasecmp(key, "scan_io")) {
+            cfg->scan_io = parse_scan_io(val);
+            if (cfg->scan_io < 0)
+                LOGW("config:%d: invalid scan_io '%s'", line_num, val);
+
         } else {
             LOGW("config:%d: unknown key '%s'", line_num, key);
         }
@@ -152,6 +257,90 @@ static int parse_partitions(const char *list, MagicMount *ctx) {
     return 0;
 }
 
+/* Returns the thread count clamped to MAX_SCAN_JOBS, -1 if invalid */
+static int parse_jobs(const char *val) {
+    char *end = NULL;
+
+    errno = 0;
+    long n = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0' || n < 1)
+        return -1;
+
+    return n > MAX_SCAN_JOBS ? MAX_SCAN_JOBS : (int)n;
+}
+
+/* Returns a MountApi, -1 if invalid */
+static int parse_mount_api(const char *val) {
+    if (!strcasecmp(val, "legacy"))
+        return MOUNT_API_LEGACY;
+    if (!strcasecmp(val, "new"))
+        return MOUNT_API_NEW;
+    return -1;
+}
+
+/* Returns a MountBackend, -1 if invalid */
+static int parse_backend(const char *val) {
+    if (!strcasecmp(val, "bind"))
+        return MOUNT_BACKEND_BIND;
+    if (!strcasecmp(val, "overlay"))
+        return MOUNT_BACKEND_OVERLAY;
+    return -1;
+}
+
+/* Returns a byte count with an optional K, M or G suffix, -1 if invalid */
+static long long parse_size(const char *val) {
+    char *end = NULL;
+
+    errno = 0;
+    long long n = strtoll(val, &end, 10);
+    if (errno != 0 || end == val || n < 0)
+        return -1;
+
+    int shift = 0;
+    switch (*end) {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    case '\0':
+        return n;
+    default:
+        return -1;
+    }
+    if (end[1] != '\0' || n > (LLONG_MAX >> shift))
+        return -1;
+    return n << shift;
+}
+
+/* Returns a positive millisecond count, -1 if invalid */
+static int parse_ms(const char *val) {
+    char *end = NULL;
+
+    errno = 0;
+    long n = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0' || n < 1 || n > INT_MAX)
+        return -1;
+
+    return (int)n;
+}
+
+/* Returns a ScanIo, -1 if invalid */
+static int parse_scan_io(const char *val) {
+    if (!strcasecmp(val, "sync"))
+        return SCAN_IO_SYNC;
+    if (!strcasecmp(val, "uring"))
+        return SCAN_IO_URING;
+    return -1;
+}
+
 static int setup_logging(const char *log_path) {
     if (!log_path)
         return 0;
@@ -174,6 +363,19 @@ static int setup_logging(const char *log_path) {
     return 0;
 }
 
+/* The log path with .log replaced by .stats.json, NULL unless logging to a file */
+static const char *stats_default_path(const char *log_path, char buf[PATH_MAX]) {
+    if (!log_path || !strcmp(log_path, "-"))
+        return NULL;
+
+    size_t len = strlen(log_path);
+    if (len > 4 && !strcmp(log_path + len - 4, ".log"))
+        len -= 4;
+    if (snprintf(buf, PATH_MAX, "%.*s.stats.json", (int)len, log_path) >= PATH_MAX)
+        return NULL;
+    return buf;
+}
+
 static void print_summary(const MagicMount *ctx) {
     LOGI("Summary");
     LOGI("Modules processed:     %d", ctx->stats.modules_total);
@@ -182,6 +384,51 @@ static void print_summary(const MagicMount *ctx) {
     LOGI("Nodes skipped:         %d", ctx->stats.nodes_skipped);
     LOGI("Whiteouts:             %d", ctx->stats.nodes_whiteout);
     LOGI("Failures:              %d", ctx->stats.nodes_fail);
+    LOGI("Planned mounts:        %ld", ctx->stats.plan.mounts);
+    if (ctx->enable_unmountable)
+        LOGI("Try-umount paths:      %d (%d covered)", ctx->stats.umounts_sent,
+             ctx->stats.umounts_covered);
+    if (ctx->warmup.enabled)
+        LOGI("Warm-up:               %d files, %lld KiB in %ld ms (%d over budget)",
+             ctx->stats.warm_files, ctx->stats.warm_bytes >> 10, ctx->stats.warm_ms,
+             ctx->stats.warm_left);
+
+    LOGI("Time total:            %.1f ms", ctx->stats.total_ns / 1e6);
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (ctx->stats.phase_ns[i])
+            LOGI("  %-20s %8.1f ms", mount_phase_name((MountPhase)i),
+                 ctx->stats.phase_ns[i] / 1e6);
+    }
+    if (ctx->stats.tmpfs_ns)
+        LOGI("  %-20s %8.1f ms (within apply, all workers)", "dir tmpfs setup",
+             ctx->stats.tmpfs_ns / 1e6);
+
+    size_t ranked = 0;
+    const ModuleCost **rank = stats_module_ranking(ctx, &ranked);
+    if (ranked > 0) {
+        LOGI("Module costs (%zu, most expensive first):", ranked);
+        for (size_t i = 0; i < ranked && i < SUMMARY_MODULE_COSTS; ++i) {
+            const ModuleCost *mc = rank[i];
+            LOGI("  %-20s %8.1f ms (scan %.1f), %d nodes, %d binds, %d tmpfs, %d mirrored",
+                 mc->name, (mc->scan_ns + mc->apply_ns) / 1e6, mc->scan_ns / 1e6, mc->nodes,
+                 mc->binds, mc->tmpfs, mc->mirrors);
+        }
+        if (ranked > SUMMARY_MODULE_COSTS)
+            LOGI("  ... %zu more in the stats file", ranked - SUMMARY_MODULE_COSTS);
+    }
+    free(rank);
+
+    if (g_opstat_on) {
+        LOGI("Filesystem calls:      count, total, p50, p99");
+        for (int i = 0; i < OP_KIND_COUNT; ++i) {
+            OpStat os;
+            opstat_get((OpKind)i, &os);
+            if (os.count)
+                LOGI("  %-20s %8llu %8.1f ms %8.1f us %8.1f us", opstat_name((OpKind)i),
+                     (unsigned long long)os.count, os.ns / 1e6,
+                     opstat_quantile(&os, 0.50) / 1e3, opstat_quantile(&os, 0.99) / 1e3);
+        }
+    }
 
     if (ctx->failed_modules_count > 0) {
         LOGE("Failed modules (%d):", ctx->failed_modules_count);
@@ -199,6 +446,9 @@ static void cleanup_resources(MagicMount *ctx) {
 
     magic_mount_cleanup(ctx);
 
+    fs_sim_reset();
+    trace_free();
+
     if (g_log_file && g_log_file != stdout && g_log_file != stderr) {
         fclose(g_log_file);
         g_log_file = NULL;
@@ -211,11 +461,18 @@ int main(int argc, char **argv) {
     Config cfg = {0};
     cfg.umount = true;
     char auto_tmp[PATH_MAX] = {0};
+    char auto_stats[PATH_MAX] = {0};
 
     const char *config_path = DEFAULT_CONFIG_PATH;
     const char *tmp_dir = NULL;
     const char *cli_log_path = NULL;
+    const char *stats_path = NULL;
+    const char *trace_path = NULL;
+    const char *query_which = NULL;
+    const char *query_ls = NULL;
     bool cli_has_partitions = false;
+    bool dry_run = false;
+    bool op_stats = false;
     int rc;
 
     magic_mount_init(&ctx);
@@ -248,12 +505,38 @@ int main(int argc, char **argv) {
         ctx.mount_source = cfg.mount_source;
     if (cfg.temp_dir)
         tmp_dir = cfg.temp_dir;
+    if (cfg.stats_file)
+        stats_path = cfg.stats_file;
+    if (cfg.trace_file)
+        trace_path = cfg.trace_file;
     if (cfg.debug)
         log_set_level(LOG_DEBUG);
     if (cfg.umount)
         ctx.enable_unmountable = true;
     else
         ctx.enable_unmountable = false;
+    if (cfg.jobs > 0)
+        ctx.scan_jobs = cfg.jobs;
+    if (cfg.apply_jobs > 0)
+        ctx.apply_jobs = cfg.apply_jobs;
+    if (cfg.tree_cache)
+        ctx.tree_cache = cfg.tree_cache;
+    if (cfg.mount_index)
+        ctx.mount_index = cfg.mount_index;
+    if (cfg.mount_api > 0)
+        ctx.mount_api = (MountApi)cfg.mount_api;
+    if (cfg.backend > 0)
+        ctx.backend = (MountBackend)cfg.backend;
+    if (cfg.scan_io > 0)
+        ctx.scan_io = (ScanIo)cfg.scan_io;
+    if (cfg.warmup)
+        ctx.warmup.enabled = true;
+    if (cfg.warmup_exts)
+        ctx.warmup.exts = cfg.warmup_exts;
+    if (cfg.warmup_max_size > 0)
+        ctx.warmup.max_size = cfg.warmup_max_size;
+    if (cfg.warmup_budget_ms > 0)
+        ctx.warmup.budget_ms = cfg.warmup_budget_ms;
 
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
@@ -290,6 +573,109 @@ int main(int argc, char **argv) {
                 return 1;
             }
 
+        } else if ((!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) && i + 1 < argc) {
+            int jobs = parse_jobs(argv[++i]);
+            if (jobs < 0) {
+                fprintf(stderr, "Error: Invalid jobs: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.scan_jobs = jobs;
+
+        } else if (!strcmp(arg, "--apply-jobs") && i + 1 < argc) {
+            int jobs = parse_jobs(argv[++i]);
+            if (jobs < 0) {
+                fprintf(stderr, "Error: Invalid apply jobs: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.apply_jobs = jobs;
+
+        } else if (!strcmp(arg, "--tree-cache") && i + 1 < argc) {
+            ctx.tree_cache = argv[++i];
+
+        } else if (!strcmp(arg, "--no-tree-cache")) {
+            ctx.tree_cache = NULL;
+
+        } else if (!strcmp(arg, "--index") && i + 1 < argc) {
+            ctx.mount_index = argv[++i];
+
+        } else if (!strcmp(arg, "--stats") && i + 1 < argc) {
+            stats_path = argv[++i];
+
+        } else if (!strcmp(arg, "--trace") && i + 1 < argc) {
+            trace_path = argv[++i];
+
+        } else if (!strcmp(arg, "--op-stats")) {
+            op_stats = true;
+
+        } else if (!strcmp(arg, "--mount-api") && i + 1 < argc) {
+            int api = parse_mount_api(argv[++i]);
+            if (api < 0) {
+                fprintf(stderr, "Error: Invalid mount API: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.mount_api = (MountApi)api;
+
+        } else if (!strcmp(arg, "--backend") && i + 1 < argc) {
+            int backend = parse_backend(argv[++i]);
+            if (backend < 0) {
+                fprintf(stderr, "Error: Invalid backend: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.backend = (MountBackend)backend;
+
+        } else if (!strcmp(arg, "--warmup")) {
+            ctx.warmup.enabled = true;
+
+        } else if (!strcmp(arg, "--warmup-ext") && i + 1 < argc) {
+            ctx.warmup.exts = argv[++i];
+
+        } else if (!strcmp(arg, "--warmup-max-size") && i + 1 < argc) {
+            long long size = parse_size(argv[++i]);
+            if (size <= 0) {
+                fprintf(stderr, "Error: Invalid warm-up size: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.warmup.max_size = size;
+
+        } else if (!strcmp(arg, "--warmup-budget") && i + 1 < argc) {
+            int ms = parse_ms(argv[++i]);
+            if (ms < 0) {
+                fprintf(stderr, "Error: Invalid warm-up budget: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.warmup.budget_ms = ms;
+
+        } else if (!strcmp(arg, "--scan-io") && i + 1 < argc) {
+            int io = parse_scan_io(argv[++i]);
+            if (io < 0) {
+                fprintf(stderr, "Error: Invalid scan I/O: %s\n\n", argv[i]);
+                usage(argv[0]);
+                cleanup_resources(&ctx);
+                return 1;
+            }
+            ctx.scan_io = (ScanIo)io;
+
+        } else if (!strcmp(arg, "--which") && i + 1 < argc) {
+            query_which = argv[++i];
+
+        } else if (!strcmp(arg, "--ls") && i + 1 < argc) {
+            query_ls = argv[++i];
+
+        } else if (!strcmp(arg, "--dry-run")) {
+            dry_run = true;
+
         } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
             usage(argv[0]);
             cleanup_resources(&ctx);
@@ -311,6 +697,37 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (ctx.tree_cache && !strcasecmp(ctx.tree_cache, "none"))
+        ctx.tree_cache = NULL;
+    if (ctx.mount_index && !strcasecmp(ctx.mount_index, "none"))
+        ctx.mount_index = NULL;
+    if (stats_path && !strcasecmp(stats_path, "none"))
+        stats_path = NULL;
+    else if (!stats_path && !dry_run)
+        stats_path = stats_default_path(cli_log_path ? cli_log_path : cfg.log_file, auto_stats);
+
+    /* Query mode: answer from the mount index, nothing is scanned or mounted */
+    if (query_which || query_ls) {
+        if (!ctx.mount_index) {
+            fprintf(stderr, "Error: mount index is disabled\n");
+            cleanup_resources(&ctx);
+            return 1;
+        }
+        rc = query_which ? mount_index_which(ctx.mount_index, query_which)
+                         : mount_index_ls(ctx.mount_index, query_ls);
+        cleanup_resources(&ctx);
+        return rc == 0 ? 0 : (rc < 0 ? 2 : 1);
+    }
+
+    /* Dry run: nothing outside the simulation is written, root not needed */
+    if (dry_run) {
+        fs_ops_use(&fs_ops_sim);
+        ctx.tree_cache = NULL;
+        ctx.mount_index = NULL;
+        if (!tmp_dir)
+            tmp_dir = DEFAULT_TEMP_DIR;
+    }
+
     /* Determine temp directory */
     if (!tmp_dir)
         tmp_dir = select_auto_tempdir(auto_tmp);
@@ -322,11 +739,20 @@ int main(int argc, char **argv) {
     }
 
     /* Validate environment */
-    if (root_check() < 0) {
+    if (!dry_run && root_check() < 0) {
         cleanup_resources(&ctx);
         return 1;
     }
 
+    if (trace_path && !strcasecmp(trace_path, "none"))
+        trace_path = NULL;
+    if (trace_path)
+        trace_start();
+
+    /* Wraps whatever table is in use, the sim included */
+    if (op_stats || cfg.op_stats)
+        fs_ops_use(opstat_start(g_fs_ops));
+
     /* Log startup information */
     LOGI("Magic Mount %s Starting", VERSION);
     LOGI("Configuration:");
@@ -334,6 +760,21 @@ int main(int argc, char **argv) {
     LOGI("  Temp directory:    %s", tmp_dir);
     LOGI("  Mount source:      %s", ctx.mount_source);
     LOGI("  Log level:         %s", g_log_level == LOG_DEBUG ? "DEBUG" : "INFO");
+    LOGI("  Scan jobs:         %d", ctx.scan_jobs);
+    LOGI("  Apply jobs:        %d", ctx.apply_jobs);
+    LOGI("  Tree cache:        %s", ctx.tree_cache ? ctx.tree_cache : "disabled");
+    LOGI("  Mount index:       %s", ctx.mount_index ? ctx.mount_index : "disabled");
+    LOGI("  Mount API:         %s", ctx.mount_api == MOUNT_API_NEW ? "new" : "legacy");
+    LOGI("  Backend:           %s", ctx.backend == MOUNT_BACKEND_OVERLAY ? "overlay" : "bind");
+    LOGI("  Scan I/O:          %s", ctx.scan_io == SCAN_IO_URING ? "uring" : "sync");
+    if (ctx.warmup.enabled)
+        LOGI("  Warm-up:           %s up to %lld KiB, %d ms", ctx.warmup.exts,
+             ctx.warmup.max_size >> 10, ctx.warmup.budget_ms);
+    else
+        LOGI("  Warm-up:           disabled");
+    LOGI("  Stats file:        %s", stats_path ? stats_path : "disabled");
+    LOGI("  Trace file:        %s", trace_path ? trace_path : "disabled");
+    LOGI("  Filesystem ops:    %s%s", g_fs_ops->name, g_opstat_on ? ", counted" : "");
     if (ctx.extra_parts_count > 0) {
         LOGI("  Extra partitions:  %d", ctx.extra_parts_count);
         for (int i = 0; i < ctx.extra_parts_count; i++) {
@@ -342,7 +783,10 @@ int main(int argc, char **argv) {
     }
 
     /* Perform magic mount */
+    uint64_t start = monotonic_ns();
     rc = magic_mount(&ctx, tmp_dir);
+    ctx.stats.total_ns = monotonic_ns() - start;
+    TRACE_SPAN("magic_mount", start, NULL, NULL);
 
     /* Print results */
     if (rc == 0) {
@@ -352,6 +796,15 @@ int main(int argc, char **argv) {
     }
 
     print_summary(&ctx);
+
+    if (stats_path)
+        (void)stats_write(&ctx, rc, stats_path);
+    if (trace_path)
+        (void)trace_write(trace_path);
+
+    if (dry_run)
+        fs_sim_report(stdout);
+
     cleanup_resources(&ctx);
 
     return rc == 0 ? 0 : 1;
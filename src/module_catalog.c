@@ -0,0 +1,230 @@
+#include "module_catalog.h"
+#include "magic_mount.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CATALOG_BUF_SIZE (32 * 1024)
+
+static const char *catalog_builtin_parts[] = {"system", "vendor", "system_ext", "product", "odm"};
+
+static bool catalog_is_marker(const char *name) {
+    return !strcmp(name, DISABLE_FILE_NAME) || !strcmp(name, REMOVE_FILE_NAME) ||
+           !strcmp(name, SKIP_MOUNT_FILE_NAME);
+}
+
+/* Symlinks and unknown types are followed, like stat() on the full path */
+static bool catalog_entry_is_dir(int dirfd, const struct linux_dirent64 *de) {
+    if (de->d_type == DT_DIR)
+        return true;
+    if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+        return false;
+
+    struct stat st;
+    return fstatat(dirfd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool catalog_entry_exists(int dirfd, const struct linux_dirent64 *de) {
+    if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+        return true;
+    return faccessat(dirfd, de->d_name, F_OK, 0) == 0;
+}
+
+/* One getdents64 pass over the module dir finds the markers and partition roots */
+static int catalog_probe_module(ModuleCatalog *cat, ModuleInfo *m, char *buf) {
+    for (;;) {
+        ssize_t nread = dir_getdents(m->dirfd, buf, CATALOG_BUF_SIZE);
+        if (nread < 0) {
+            LOGE("getdents %s: %s", m->path, strerror(errno));
+            return -1;
+        }
+        if (nread == 0)
+            break;
+
+        for (ssize_t off = 0; off < nread;) {
+            const struct linux_dirent64 *de = (const struct linux_dirent64 *)(buf + off);
+            off += de->d_reclen;
+
+            if (catalog_is_marker(de->d_name)) {
+                if (catalog_entry_exists(m->dirfd, de))
+                    m->enabled = false;
+                continue;
+            }
+
+            for (size_t i = 0; i < cat->parts_count; ++i) {
+                if (strcmp(de->d_name, cat->parts[i]) == 0) {
+                    m->has_part[i] = catalog_entry_is_dir(m->dirfd, de);
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int catalog_add_module(MagicMount *ctx, const char *mdir, int mdir_fd, const char *name,
+                              size_t *cap, char *buf) {
+    ModuleCatalog *cat = &ctx->catalog;
+
+    int fd = openat(mdir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGD("module_catalog_build: skip non-dir entry %s/%s", mdir, name);
+        return 0;
+    }
+
+    if (cat->count == CATALOG_MAX_MODULES) {
+        LOGE("module_catalog_build: more than %d modules in %s", CATALOG_MAX_MODULES, mdir);
+        close(fd);
+        return -1;
+    }
+
+    if (cat->count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        ModuleInfo *arr = arena_alloc(&ctx->arena, new_cap * sizeof(ModuleInfo));
+        if (!arr) {
+            close(fd);
+            return -1;
+        }
+        if (cat->count)
+            memcpy(arr, cat->modules, cat->count * sizeof(ModuleInfo));
+        cat->modules = arr;
+        *cap = new_cap;
+    }
+
+    char path[PATH_MAX];
+    ModuleInfo *m = &cat->modules[cat->count];
+    m->id = (uint16_t)(cat->count + 1);
+    m->dirfd = fd;
+    m->enabled = true;
+    m->name = arena_strdup(&ctx->arena, name);
+    m->path = path_join(mdir, name, path, sizeof(path)) == 0 ? arena_strdup(&ctx->arena, path)
+                                                             : NULL;
+    m->has_part = arena_alloc(&ctx->arena, cat->parts_count * sizeof(bool));
+    cat->count++;
+
+    if (!m->name || !m->path || !m->has_part)
+        return -1;
+
+    if (catalog_probe_module(cat, m, buf) != 0)
+        return -1;
+
+    if (!m->enabled) {
+        LOGI("module_catalog_build: module %s is disabled", m->path);
+        memset(m->has_part, 0, cat->parts_count * sizeof(bool));
+        close(m->dirfd);
+        m->dirfd = -1;
+    }
+    return 0;
+}
+
+int module_catalog_build(MagicMount *ctx) {
+    ModuleCatalog *cat = &ctx->catalog;
+    const char *mdir = ctx->module_dir ? ctx->module_dir : DEFAULT_MODULE_DIR;
+    size_t nbuiltin = sizeof(catalog_builtin_parts) / sizeof(catalog_builtin_parts[0]);
+
+    memset(cat, 0, sizeof(*cat));
+
+    cat->parts_count = nbuiltin + (size_t)ctx->extra_parts_count;
+    cat->parts = arena_alloc(&ctx->arena, cat->parts_count * sizeof(char *));
+    if (!cat->parts) {
+        LOGE("module_catalog_build: failed to allocate partition list");
+        return -1;
+    }
+    for (size_t i = 0; i < nbuiltin; ++i)
+        cat->parts[i] = catalog_builtin_parts[i];
+    for (int i = 0; i < ctx->extra_parts_count; ++i)
+        cat->parts[nbuiltin + (size_t)i] = ctx->extra_parts[i];
+
+    int mdir_fd = open(mdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mdir_fd < 0) {
+        LOGE("opendir %s: %s", mdir, strerror(errno));
+        return -1;
+    }
+
+    char *mdir_buf = malloc(CATALOG_BUF_SIZE);
+    char *mod_buf = malloc(CATALOG_BUF_SIZE);
+    size_t cap = 0;
+    int ret = 0;
+
+    if (!mdir_buf || !mod_buf) {
+        LOGE("module_catalog_build: failed to allocate dirent buffers");
+        ret = -1;
+    }
+
+    while (ret == 0) {
+        ssize_t nread = dir_getdents(mdir_fd, mdir_buf, CATALOG_BUF_SIZE);
+        if (nread < 0) {
+            LOGE("getdents %s: %s", mdir, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (nread == 0)
+            break;
+
+        for (ssize_t off = 0; off < nread && ret == 0;) {
+            const struct linux_dirent64 *de = (const struct linux_dirent64 *)(mdir_buf + off);
+            off += de->d_reclen;
+
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+
+            if (catalog_add_module(ctx, mdir, mdir_fd, de->d_name, &cap, mod_buf) != 0) {
+                LOGE("module_catalog_build: failed to add module %s", de->d_name);
+                ret = -1;
+            }
+        }
+    }
+
+    free(mdir_buf);
+    free(mod_buf);
+    close(mdir_fd);
+
+    if (ret != 0) {
+        module_catalog_release(cat);
+        return -1;
+    }
+
+    LOGD("module_catalog_build: %zu modules, %zu partition roots", cat->count, cat->parts_count);
+    return 0;
+}
+
+int module_catalog_part_index(const ModuleCatalog *cat, const char *part) {
+    for (size_t i = 0; i < cat->parts_count; ++i) {
+        if (strcmp(cat->parts[i], part) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+const ModuleInfo *module_catalog_get(const ModuleCatalog *cat, uint16_t id) {
+    if (id == 0 || id > cat->count)
+        return NULL;
+    return &cat->modules[id - 1];
+}
+
+ModuleInfo *module_catalog_first_with_part(ModuleCatalog *cat, int part) {
+    if (part < 0)
+        return NULL;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        ModuleInfo *m = &cat->modules[i];
+        if (m->enabled && m->has_part[part])
+            return m;
+    }
+    return NULL;
+}
+
+void module_catalog_release(ModuleCatalog *cat) {
+    for (size_t i = 0; i < cat->count; ++i) {
+        if (cat->modules[i].dirfd >= 0) {
+            close(cat->modules[i].dirfd);
+            cat->modules[i].dirfd = -1;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MODULE_CATALOG_H
+#define MODULE_CATALOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Partition roots a module may provide; index 0 is always "system",
+ * followed by the builtin partitions and then ctx->extra_parts
+ */
+#define CATALOG_PART_SYSTEM 0
+
+/* Module ids are 1-based and fit Node.module_id */
+#define CATALOG_MAX_MODULES 65535
+
+/* Serialized private subtree of one module partition root (tree cache) */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    bool has_any;
+    bool fresh; /* scanned in this run rather than loaded */
+} PartBlob;
+
+/* One entry of ctx->module_dir, in readdir order */
+typedef struct {
+    const char *name;
+    const char *path;
+    uint16_t id;    /* index + 1 */
+    int dirfd;      /* open while the tree is built, -1 otherwise */
+    bool enabled;   /* no disable/remove/skip_mount marker */
+    bool *has_part; /* indexed like ModuleCatalog.parts */
+
+    uint64_t fingerprint;   /* tree cache key */
+    const PartBlob *cached; /* cache entry with a matching fingerprint, indexed like parts */
+    PartBlob *blobs;        /* subtrees of this run, NULL when the cache is off */
+} ModuleInfo;
+
+typedef struct {
+    ModuleInfo *modules;
+    size_t count;
+    const char **parts;
+    size_t parts_count;
+
+    size_t cache_entries; /* modules in the tree cache file */
+    size_t cache_hits;    /* of which still match */
+} ModuleCatalog;
+
+struct MagicMount;
+
+/* Enumerate ctx->module_dir once into ctx->catalog (arena backed) */
+int module_catalog_build(struct MagicMount *ctx);
+
+/* Index into ModuleCatalog.parts, -1 if the partition is unknown */
+int module_catalog_part_index(const ModuleCatalog *cat, const char *part);
+
+/* Module by id, NULL for 0 or an unknown id */
+const ModuleInfo *module_catalog_get(const ModuleCatalog *cat, uint16_t id);
+
+/* First enabled module (readdir order) providing the partition dir */
+ModuleInfo *module_catalog_first_with_part(ModuleCatalog *cat, int part);
+
+/* Close the module dir fds */
+void module_catalog_release(ModuleCatalog *cat);
+
+#endif /* MODULE_CATALOG_H */
@@ -1,11 +1,16 @@
 #include "module_tree.h"
 #include "magic_mount.h"
+#include "opstat.h"
+#include "scan_ring.h"
+#include "trace.h"
+#include "tree_cache.h"
 #include "utils.h"
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -15,30 +20,32 @@
 
 /* --- Node basic mgr --- */
 
-static Node *node_new(const char *name, NodeFileType t) {
-    Node *n = calloc(1, sizeof(Node));
+static uint32_t node_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+_Static_assert(sizeof(void *) != 8 || sizeof(Node) == 48, "Node header grew");
+
+/* Nodes live in an arena and are released together; the name is stored
+ * right behind the header
+ */
+Node *node_new(Arena *a, const char *name, NodeFileType t) {
+    size_t len = strlen(name ? name : "");
+    Node *n = arena_alloc(a, sizeof(Node) + len + 1);
     if (!n)
         return NULL;
 
-    n->name = strdup(name ? name : "");
+    memcpy(n->name, name ? name : "", len + 1);
+    n->name_hash = node_name_hash(n->name);
     n->type = t;
     return n;
 }
 
-void node_free(Node *n) {
-    if (!n)
-        return;
-
-    for (size_t i = 0; i < n->child_count; ++i)
-        node_free(n->children[i]);
-
-    free(n->children);
-    free(n->name);
-    free(n->module_path);
-    free(n->module_name);
-    free(n);
-}
-
 NodeFileType node_type_from_stat(const struct stat *st) {
     if (S_ISCHR(st->st_mode) && st->st_rdev == 0)
         return NFT_WHITEOUT;
@@ -51,102 +58,290 @@ NodeFileType node_type_from_stat(const struct stat *st) {
     return NFT_WHITEOUT;
 }
 
-static bool dir_is_replace(const char *path) {
+#define SCAN_BUF_SIZE (32 * 1024)
+/* Directories a scanner may hold open ahead of time, across all its frames */
+#define SCAN_PREFETCH_FDS 64
+
+/* One directory on the scan stack. The getdents64 buffer belongs to the depth
+ * and is kept for every later module scanned by the same thread.
+ */
+typedef struct {
+    Node *self;
+    int fd;
+    size_t saved; /* path length to restore when the frame is popped */
+    char *buf;
+    ssize_t nread;
+    ssize_t off;
+    bool probe_replace;
+    bool any;
+    /* With a ring: the openat/statx results of buf's entries, keyed by offset */
+    ScanRingReq *pre;
+    size_t pre_count;
+    size_t pre_cap;
+    size_t pre_next;
+} ScanFrame;
+
+/* Scan state of one thread: the directory stack, the path of its top frame
+ * (components are pushed and popped, never reformatted), plus where new nodes
+ * go and how many were created
+ */
+typedef struct {
+    MagicMount *ctx;
+    Arena *arena;
+    size_t nodes;
+    ScanFrame *frames;
+    size_t frames_cap;
+    size_t depth;
+    PathBuf path;
+    ScanRing *ring; /* NULL: synchronous */
+    bool ring_tried;
+    size_t pre_fds; /* prefetched fds not yet taken or closed */
+    /* Directories entered while stamping, in order, for the tree cache */
+    bool stamping;
+    DirStamp *stamps;
+    size_t stamps_count;
+    size_t stamps_cap;
+} TreeScanner;
+
+static bool dir_has_opaque_xattr(int dirfd) {
     char buf[8];
-    ssize_t len = lgetxattr(path, REPLACE_DIR_XATTR, buf, sizeof(buf) - 1);
+    uint64_t t = opstat_begin();
+    ssize_t len = fgetxattr(dirfd, REPLACE_DIR_XATTR, buf, sizeof(buf) - 1);
+    opstat_end(OP_GETXATTR, t);
 
     if (len > 0) {
         buf[len] = '\0';
         if (strcmp(buf, "y") == 0)
             return true;
     }
+    return false;
+}
 
-    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
-    if (dirfd < 0)
-        return false;
+/* The dirent type is trusted when the filesystem reports one; only
+ * DT_UNKNOWN costs an fstatat relative to the parent directory.
+ */
+static Node *node_create_from_dirent(TreeScanner *sc, Node *self, int dirfd, const char *name,
+                                     unsigned char d_type, const char *path,
+                                     const ModuleInfo *mod) {
+    NodeFileType t;
+
+    switch (d_type) {
+    case DT_REG:
+        t = NFT_REGULAR;
+        break;
+    case DT_DIR:
+        t = NFT_DIRECTORY;
+        break;
+    case DT_LNK:
+        t = NFT_SYMLINK;
+        break;
+    case DT_CHR:
+        t = NFT_WHITEOUT;
+        break;
+    case DT_UNKNOWN: {
+        struct stat st;
+        uint64_t ot = opstat_begin();
+        int r = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+        opstat_end(OP_STAT, ot);
+        if (r < 0) {
+            LOGD("node_create_from_dirent: fstatat(%s) failed: %s", path, strerror(errno));
+            return NULL;
+        }
 
-    bool exists = (faccessat(dirfd, REPLACE_DIR_FILE_NAME, F_OK, 0) == 0);
-    close(dirfd);
-    return exists;
-}
+        if (!(S_ISCHR(st.st_mode) || S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) ||
+              S_ISLNK(st.st_mode))) {
+            LOGD("node_create_from_dirent: skip unsupported file type for %s (mode=%o)", path,
+                 st.st_mode);
+            return NULL;
+        }
 
-static Node *node_create_from_fs(MagicMount *ctx, const char *name, const char *path,
-                                 const char *module_name) {
-    struct stat st;
-    if (lstat(path, &st) < 0) {
-        LOGD("node_create_from_fs: lstat(%s) failed: %s", path, strerror(errno));
-        return NULL;
+        t = node_type_from_stat(&st);
+        break;
     }
-
-    if (!(S_ISCHR(st.st_mode) || S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) ||
-          S_ISLNK(st.st_mode))) {
-        LOGD("node_create_from_fs: skip unsupported file type for %s (mode=%o)", path, st.st_mode);
+    default:
+        LOGD("node_create_from_dirent: skip unsupported file type for %s (d_type=%u)", path,
+             d_type);
         return NULL;
     }
 
-    NodeFileType t = node_type_from_stat(&st);
-    Node *n = node_new(name, t);
+    Node *n = node_new(sc->arena, name, t);
     if (!n) {
-        LOGE("node_create_from_fs: failed to allocate node for %s", path);
+        LOGE("node_create_from_dirent: failed to allocate node for %s", path);
         return NULL;
     }
 
-    n->module_path = strdup(path);
-    if (module_name)
-        n->module_name = strdup(module_name);
-    n->replace = (t == NFT_DIRECTORY) && dir_is_replace(path);
+    /* The module path is not stored; node_module_path rebuilds it */
+    n->origin = self;
+    n->module_id = mod->id;
 
-    LOGD("node_create_from_fs: created node '%s' (type=%d, replace=%d, module=%s, path=%s)", name,
-         t, n->replace, module_name ? module_name : "(none)", path);
+    LOGD("node_create_from_dirent: created node '%s' (type=%d, module=%s, path=%s)", name, t,
+         mod->name, path);
 
-    ctx->stats.nodes_total++;
+    sc->nodes++;
     return n;
 }
 
-static int node_child_append(Node *parent, Node *child) {
+static void node_index_insert(Node *parent, Node *child) {
+    size_t mask = ((size_t)1 << parent->index_bits) - 1;
+    size_t i = child->name_hash & mask;
+
+    while (parent->index[i])
+        i = (i + 1) & mask;
+    parent->index[i] = child;
+}
+
+static void node_index_rebuild(Node *parent) {
+    Node *const *kids = node_children(parent);
+
+    memset(parent->index, 0, ((size_t)1 << parent->index_bits) * sizeof(Node *));
+    for (size_t i = 0; i < parent->child_count; ++i)
+        node_index_insert(parent, kids[i]);
+}
+
+/* Keep the load factor at or below 1/2 once the directory is big enough */
+static int node_index_reserve(Arena *a, Node *parent) {
+    if (parent->child_count <= NODE_INDEX_THRESHOLD)
+        return 0;
+    if (parent->index && parent->child_count * 2 <= (size_t)1 << parent->index_bits)
+        return 0;
+
+    unsigned bits = parent->index ? parent->index_bits : 5;
+    while (parent->child_count * 2 > (size_t)1 << bits)
+        bits++;
+
+    Node **idx = arena_alloc(a, ((size_t)1 << bits) * sizeof(Node *));
+    if (!idx)
+        return -1;
+
+    parent->index = idx;
+    parent->index_bits = bits;
+    node_index_rebuild(parent);
+    return 0;
+}
+
+/* Spill the child list to an arena array once the inline slots are full */
+static int node_children_grow(Arena *a, Node *parent) {
+    if (parent->child_count < NODE_INLINE_CHILDREN && !parent->child_cap)
+        return 0;
+    if (parent->child_cap && parent->child_count < parent->child_cap)
+        return 0;
+
+    /* Grow geometrically; the old array stays in the arena until teardown */
+    uint32_t new_cap = parent->child_cap ? parent->child_cap * 2 : NODE_INLINE_CHILDREN * 2;
+    Node **arr = arena_alloc(a, new_cap * sizeof(Node *));
+    if (!arr)
+        return -1;
+
+    memcpy(arr, node_children(parent), parent->child_count * sizeof(Node *));
+    parent->kids.spill = arr;
+    parent->child_cap = new_cap;
+    return 0;
+}
+
+int node_child_append(Arena *a, Node *parent, Node *child) {
     if (!parent || !child) {
         LOGE("node_child_append: parent or child is NULL");
         errno = EINVAL;
         return -1;
     }
 
-    LOGD("node_child_append: parent='%s' add child='%s'", parent->name ? parent->name : "(root)",
-         child->name ? child->name : "(null)");
+    LOGD("node_child_append: parent='%s' add child='%s'", parent->name, child->name);
 
-    Node **arr = realloc(parent->children, (parent->child_count + 1) * sizeof(Node *));
-    if (!arr) {
-        LOGE("node_child_append: realloc failed (parent='%s', child='%s')",
-             parent->name ? parent->name : "(root)", child->name ? child->name : "(null)");
+    if (node_children_grow(a, parent) != 0) {
+        LOGE("node_child_append: alloc failed (parent='%s', child='%s')", parent->name,
+             child->name);
         errno = ENOMEM;
         return -1;
     }
 
-    parent->children = arr;
-    parent->children[parent->child_count++] = child;
+    if (parent->child_cap)
+        parent->kids.spill[parent->child_count++] = child;
+    else
+        parent->kids.items[parent->child_count++] = child;
+
+    if (parent->index && parent->child_count * 2 <= (size_t)1 << parent->index_bits) {
+        node_index_insert(parent, child);
+    } else if (node_index_reserve(a, parent) != 0) {
+        LOGE("node_child_append: index alloc failed (parent='%s')", parent->name);
+        parent->child_count--;
+        errno = ENOMEM;
+        return -1;
+    }
     return 0;
 }
 
 Node *node_child_find(Node *parent, const char *name) {
-    for (size_t i = 0; i < parent->child_count; ++i) {
-        if (strcmp(parent->children[i]->name, name) == 0)
-            return parent->children[i];
+    if (!parent->index) {
+        Node *const *kids = node_children(parent);
+        for (size_t i = 0; i < parent->child_count; ++i) {
+            if (strcmp(kids[i]->name, name) == 0)
+                return kids[i];
+        }
+        return NULL;
+    }
+
+    uint32_t h = node_name_hash(name);
+    size_t mask = ((size_t)1 << parent->index_bits) - 1;
+
+    for (size_t i = h & mask; parent->index[i]; i = (i + 1) & mask) {
+        Node *c = parent->index[i];
+        if (c->name_hash == h && strcmp(c->name, name) == 0)
+            return c;
     }
     return NULL;
 }
 
 static Node *node_child_detach(Node *parent, const char *name) {
+    Node **kids = parent->child_cap ? parent->kids.spill : parent->kids.items;
+
     for (size_t i = 0; i < parent->child_count; ++i) {
-        if (strcmp(parent->children[i]->name, name) == 0) {
-            Node *n = parent->children[i];
-            memmove(&parent->children[i], &parent->children[i + 1],
-                    (parent->child_count - i - 1) * sizeof(Node *));
+        if (strcmp(kids[i]->name, name) == 0) {
+            Node *n = kids[i];
+            memmove(&kids[i], &kids[i + 1], (parent->child_count - i - 1) * sizeof(Node *));
             parent->child_count--;
+
+            /* Detach is rare (partition promotion), just rehash what is left */
+            if (parent->index)
+                node_index_rebuild(parent);
             return n;
         }
     }
     return NULL;
 }
 
+const char *node_module_name(const MagicMount *ctx, const Node *n) {
+    const ModuleInfo *mod = module_catalog_get(&ctx->catalog, n->module_id);
+    return mod ? mod->name : NULL;
+}
+
+int node_module_path(const MagicMount *ctx, const Node *n, char *buf, size_t len) {
+    const ModuleInfo *mod = module_catalog_get(&ctx->catalog, n->module_id);
+    if (!mod || !n->origin) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The origin chain ends at the partition root, e.g. "system" */
+    size_t need = strlen(mod->path);
+    for (const Node *p = n; p; p = p->origin)
+        need += 1 + strlen(p->name);
+
+    if (need >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    buf[need] = '\0';
+    for (const Node *p = n; p; p = p->origin) {
+        size_t l = strlen(p->name);
+        need -= l;
+        memcpy(buf + need, p->name, l);
+        buf[--need] = '/';
+    }
+    memcpy(buf, mod->path, need);
+    return 0;
+}
+
 void module_mark_failed(MagicMount *ctx, const char *module_name) {
     if (!ctx || !module_name)
         return;
@@ -247,89 +442,613 @@ void extra_partition_register(MagicMount *ctx, const char *start, size_t len) {
     free(buf);
 }
 
-static bool module_is_disabled(const char *mod_dir) {
-    char buf[PATH_MAX];
-    const char *disable_files[] = {DISABLE_FILE_NAME, REMOVE_FILE_NAME, SKIP_MOUNT_FILE_NAME};
+/* --- Node collect --- */
 
-    for (size_t i = 0; i < sizeof(disable_files) / sizeof(disable_files[0]); ++i) {
-        if (path_join(mod_dir, disable_files[i], buf, sizeof(buf)) == 0 && path_exists(buf))
-            return true;
+/* Stamp the directory dir, open at fd. A failed fstat leaves a stamp no
+ * directory matches on load; without memory there is none, and packing the
+ * tree fails.
+ */
+static void scanner_stamp(TreeScanner *sc, const Node *dir, int fd) {
+    struct stat st;
+
+    if (sc->stamps_count == sc->stamps_cap) {
+        size_t cap = sc->stamps_cap ? sc->stamps_cap * 2 : 64;
+        DirStamp *arr = realloc(sc->stamps, cap * sizeof(*arr));
+        if (!arr)
+            return;
+        sc->stamps = arr;
+        sc->stamps_cap = cap;
     }
-    return false;
+
+    uint64_t t = opstat_begin();
+    int r = fstat(fd, &st);
+    opstat_end(OP_STAT, t);
+    if (r != 0)
+        memset(&st, 0, sizeof(st));
+    tree_cache_stamp(&sc->stamps[sc->stamps_count++], dir, &st);
 }
 
-/* --- Node collect --- */
+static int scanner_push(TreeScanner *sc, Node *self, int fd, size_t saved, bool probe_replace) {
+    if (sc->depth == sc->frames_cap) {
+        size_t cap = sc->frames_cap ? sc->frames_cap * 2 : 16;
+        ScanFrame *arr = realloc(sc->frames, cap * sizeof(*arr));
+        if (!arr)
+            return -1;
+        memset(arr + sc->frames_cap, 0, (cap - sc->frames_cap) * sizeof(*arr));
+        sc->frames = arr;
+        sc->frames_cap = cap;
+    }
 
-static int node_scan_dir(MagicMount *ctx, Node *self, const char *dir, const char *module_name,
-                         bool *has_any) {
-    LOGD("node_scan_dir: enter dir=%s module=%s node='%s'", dir,
-         module_name ? module_name : "(none)", self && self->name ? self->name : "(null)");
+    ScanFrame *f = &sc->frames[sc->depth];
+    if (!f->buf) {
+        f->buf = malloc(SCAN_BUF_SIZE);
+        if (!f->buf)
+            return -1;
+    }
+
+    f->self = self;
+    f->fd = fd;
+    f->saved = saved;
+    f->nread = 0;
+    f->off = 0;
+    f->probe_replace = probe_replace;
+    f->any = false;
+    sc->depth++;
+
+    /* Before the first getdents: a change during the scan goes stale */
+    if (sc->stamping)
+        scanner_stamp(sc, self, fd);
+    return 0;
+}
+
+static void scanner_close(TreeScanner *sc, int fd) {
+    if (sc->ring)
+        scan_ring_close(sc->ring, fd);
+    else
+        close(fd);
+}
 
-    DIR *d = opendir(dir);
-    if (!d) {
-        LOGE("opendir %s: %s", dir, strerror(errno));
+/* Close what the last batch of f opened and nobody took */
+static void scanner_prefetch_drop(TreeScanner *sc, ScanFrame *f) {
+    for (size_t i = 0; i < f->pre_count; ++i) {
+        if (f->pre[i].op == SCAN_RING_OPEN && f->pre[i].res >= 0) {
+            scanner_close(sc, f->pre[i].res);
+            sc->pre_fds--;
+        }
+    }
+    f->pre_count = 0;
+    f->pre_next = 0;
+}
+
+/* Drop the top frame and return its path to the parent's */
+static void scanner_pop(TreeScanner *sc) {
+    ScanFrame *f = &sc->frames[--sc->depth];
+
+    scanner_prefetch_drop(sc, f);
+    scanner_close(sc, f->fd);
+    path_buf_pop(&sc->path, f->saved);
+}
+
+static void scanner_release(TreeScanner *sc) {
+    for (size_t i = 0; i < sc->frames_cap; ++i) {
+        free(sc->frames[i].buf);
+        free(sc->frames[i].pre);
+    }
+    free(sc->frames);
+    sc->frames = NULL;
+    sc->frames_cap = 0;
+    free(sc->stamps);
+    sc->stamps = NULL;
+    sc->stamps_count = sc->stamps_cap = 0;
+    scan_ring_free(sc->ring);
+    sc->ring = NULL;
+    sc->ring_tried = false;
+}
+
+/* With a ring, resolve the whole getdents64 batch just read into f at once:
+ * open every directory and stat every entry of unknown type. node_scan_entry
+ * picks the results up by offset; anything missing is done synchronously.
+ */
+static void scanner_prefetch(TreeScanner *sc, ScanFrame *f) {
+    size_t n = 0, opens = 0;
+
+    scanner_prefetch_drop(sc, f);
+    if (!sc->ring)
+        return;
+
+    for (ssize_t off = 0; off < f->nread;) {
+        const struct linux_dirent64 *de = (const struct linux_dirent64 *)(f->buf + off);
+        int op = de->d_type == DT_DIR ? SCAN_RING_OPEN : SCAN_RING_STAT;
+        /* Deeper frames get what is left of the fd budget */
+        bool want = de->d_type == DT_UNKNOWN ||
+                    (de->d_type == DT_DIR && sc->pre_fds + opens < SCAN_PREFETCH_FDS);
+
+        if (want && strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            if (n == f->pre_cap) {
+                size_t cap = f->pre_cap ? f->pre_cap * 2 : 64;
+                ScanRingReq *arr = realloc(f->pre, cap * sizeof(*arr));
+                if (!arr)
+                    break;
+                f->pre = arr;
+                f->pre_cap = cap;
+            }
+            f->pre[n++] = (ScanRingReq){.name = de->d_name, .key = (size_t)off, .op = op};
+            opens += op == SCAN_RING_OPEN;
+        }
+        off += de->d_reclen;
+    }
+
+    if (n == 0)
+        return;
+    f->pre_count = n;
+    uint64_t t = opstat_begin();
+    int rc = scan_ring_batch(sc->ring, f->fd, f->pre, n);
+    opstat_end(OP_URING, t);
+    for (size_t i = 0; i < n; ++i)
+        sc->pre_fds += f->pre[i].op == SCAN_RING_OPEN && f->pre[i].res >= 0;
+    if (rc != 0) {
+        LOGW("io_uring scan failed at %s, scanning synchronously", sc->path.buf);
+        scanner_prefetch_drop(sc, f);
+        scan_ring_free(sc->ring);
+        sc->ring = NULL;
+    }
+}
+
+/* d_type for the st_mode of a prefetched statx */
+static unsigned char dt_from_mode(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return DT_REG;
+    case S_IFDIR:
+        return DT_DIR;
+    case S_IFLNK:
+        return DT_LNK;
+    case S_IFCHR:
+        return DT_CHR;
+    default:
+        return DT_SOCK; /* unsupported either way */
+    }
+}
+
+/* Handle one dirent of the top frame; a directory child becomes the new top.
+ * pre is its prefetched result, if any; an opened fd that is used is taken
+ * out of it.
+ */
+static int node_scan_entry(TreeScanner *sc, const struct linux_dirent64 *de,
+                           const ModuleInfo *mod, ScanRingReq *pre) {
+    ScanFrame *f = &sc->frames[sc->depth - 1];
+    Node *self = f->self;
+    const char *name = de->d_name;
+    const char *path = sc->path.buf;
+    unsigned char d_type = de->d_type;
+    size_t saved;
+
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return 0;
+
+    /* A new directory is a replace dir if it carries the marker file */
+    if (f->probe_replace && !self->replace && !strcmp(name, REPLACE_DIR_FILE_NAME)) {
+        LOGD("node_scan_dir: '%s' marked replace by %s", self->name, REPLACE_DIR_FILE_NAME);
+        self->replace = true;
+    }
+
+    if (path_buf_push(&sc->path, name, &saved) != 0) {
+        LOGE("node_scan_dir: path_join failed for dir=%s name=%s", path, name);
+        return -1;
+    }
+
+    LOGD("node_scan_dir: processing '%s' (full=%s)", name, path);
+
+    bool fresh = false;
+    Node *child = node_child_find(self, name);
+    if (!child) {
+        /* A failed statx is redone synchronously for its error */
+        if (pre && pre->op == SCAN_RING_STAT && pre->res == 0)
+            d_type = dt_from_mode(pre->mode);
+        Node *n = node_create_from_dirent(sc, self, f->fd, name, d_type, path, mod);
+        if (n && node_child_append(sc->arena, self, n) == 0) {
+            child = n;
+            fresh = true;
+        } else if (n) {
+            LOGE("node_scan_dir: failed to add child '%s' to '%s'", name, self->name);
+        } else {
+            LOGD("node_scan_dir: node_create_from_dirent returned NULL for %s", path);
+        }
+    }
+
+    if (!child) {
+        LOGD("node_scan_dir: no child node created for %s", path);
+        path_buf_pop(&sc->path, saved);
+        return 0;
+    }
+
+    if (child->type != NFT_DIRECTORY) {
+        LOGD("node_scan_dir: file node '%s' has content (type=%d)", child->name, child->type);
+        f->any = true;
+        path_buf_pop(&sc->path, saved);
+        return 0;
+    }
+
+    int fd;
+    if (pre && pre->op == SCAN_RING_OPEN && pre->res >= 0) {
+        fd = pre->res;
+        pre->res = -EBADF;
+        sc->pre_fds--;
+    } else {
+        uint64_t t = opstat_begin();
+        fd = openat(f->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        opstat_end(OP_OPEN, t);
+    }
+    if (fd < 0) {
+        LOGE("open %s: %s", path, strerror(errno));
+        path_buf_pop(&sc->path, saved);
+        return -1;
+    }
+
+    if (fresh && dir_has_opaque_xattr(fd)) {
+        LOGD("node_scan_dir: '%s' marked replace by %s", child->name, REPLACE_DIR_XATTR);
+        child->replace = true;
+    }
+
+    if (scanner_push(sc, child, fd, saved, fresh) != 0) {
+        LOGE("node_scan_dir: failed to allocate dirent buffer for %s", path);
+        scanner_close(sc, fd);
+        path_buf_pop(&sc->path, saved);
+        return -1;
+    }
+
+    LOGD("node_scan_dir: enter dir=%s module=%s node='%s'", path, mod->name, child->name);
+    return 0;
+}
+
+/* Scan the directory fd (at sc->path) into self without recursion: frames
+ * live on sc->frames and every level shares sc->path. fd is closed.
+ */
+static int node_scan_tree(TreeScanner *sc, Node *self, int fd, const ModuleInfo *mod,
+                          bool *has_any) {
+    size_t base = sc->depth;
+
+    if (sc->ctx->scan_io == SCAN_IO_URING && !sc->ring_tried) {
+        sc->ring_tried = true;
+        sc->ring = scan_ring_new();
+        if (!sc->ring)
+            LOGW("io_uring unavailable (%s), scanning synchronously", strerror(errno));
+    }
+
+    if (scanner_push(sc, self, fd, sc->path.len, false) != 0) {
+        LOGE("node_scan_dir: failed to allocate dirent buffer for %s", sc->path.buf);
+        close(fd);
+        return -1;
+    }
+
+    LOGD("node_scan_dir: enter dir=%s module=%s node='%s'", sc->path.buf, mod->name, self->name);
+
+    while (sc->depth > base) {
+        ScanFrame *f = &sc->frames[sc->depth - 1];
+
+        if (f->off < f->nread) {
+            const struct linux_dirent64 *de = (const struct linux_dirent64 *)(f->buf + f->off);
+            ScanRingReq *pre = NULL;
+
+            if (f->pre_next < f->pre_count && f->pre[f->pre_next].key == (size_t)f->off)
+                pre = &f->pre[f->pre_next++];
+            f->off += de->d_reclen;
+            if (node_scan_entry(sc, de, mod, pre) != 0)
+                break;
+            continue;
+        }
+
+        f->nread = dir_getdents(f->fd, f->buf, SCAN_BUF_SIZE);
+        f->off = 0;
+        if (f->nread < 0) {
+            LOGE("getdents %s: %s", sc->path.buf, strerror(errno));
+            break;
+        }
+        scanner_prefetch(sc, f);
+        if (f->nread > 0)
+            continue;
+
+        /* Directory exhausted: report it to its parent */
+        Node *child = f->self;
+        bool sub = f->any;
+
+        LOGD("node_scan_dir: leave dir=%s has_any=%d", sc->path.buf, sub);
+        scanner_pop(sc);
+
+        if (sc->depth == base) {
+            *has_any = sub;
+            return 0;
+        }
+
+        if (sub || child->replace) {
+            LOGD("node_scan_dir: directory '%s' has content (sub=%d, replace=%d)", child->name,
+                 sub, child->replace);
+            sc->frames[sc->depth - 1].any = true;
+        }
+    }
+
+    /* A failure anywhere aborts the whole scan */
+    while (sc->depth > base) {
+        if (sc->depth - 1 > base)
+            LOGE("node_scan_dir: recurse failed for dir=%s", sc->path.buf);
+        scanner_pop(sc);
+    }
+    return -1;
+}
+
+/* Scan <module>/<rel> into self; dir is the same location as a path for node strings */
+static int node_scan_at(TreeScanner *sc, Node *self, const ModuleInfo *mod, const char *rel,
+                        const char *dir, bool *has_any) {
+    if (path_buf_set(&sc->path, dir) != 0) {
+        LOGE("node_scan_at: path too long: %s", dir);
         return -1;
     }
 
-    struct dirent *de;
-    bool any = false;
-    char path[PATH_MAX];
+    uint64_t t = opstat_begin();
+    int fd = openat(mod->dirfd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    opstat_end(OP_OPEN, t);
+    if (fd < 0) {
+        LOGE("open %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    return node_scan_tree(sc, self, fd, mod, has_any);
+}
+
+/* Private subtree of one module partition root, rooted at a node named after
+ * the partition. Comes from the tree cache when the module is unchanged,
+ * otherwise from a scan that is packed for the next boot before it can be
+ * merged (merging links the nodes into the shared tree).
+ */
+static Node *module_part_collect(TreeScanner *sc, ModuleInfo *mod, int part, size_t *nodes,
+                                 bool *has_any) {
+    const char *part_name = sc->ctx->catalog.parts[part];
+    char dir[PATH_MAX];
+    size_t before = sc->nodes;
+
+    if (path_join(mod->path, part_name, dir, sizeof(dir)) != 0) {
+        LOGE("module_part_collect: path_join failed for %s/%s", mod->path, part_name);
+        return NULL;
+    }
+
+    if (mod->cached && mod->cached[part].data) {
+        Node *n =
+            tree_cache_unpack(sc->arena, &mod->cached[part], mod->dirfd, mod->id, &sc->nodes);
+        if (n) {
+            LOGD("module_part_collect: %s loaded from tree cache", dir);
+            mod->blobs[part] = mod->cached[part];
+            mod->blobs[part].fresh = false;
+            *has_any = mod->cached[part].has_any;
+            *nodes = sc->nodes - before;
+            return n;
+        }
+        if (errno == ESTALE)
+            LOGI("module_part_collect: %s changed, rescanning", dir);
+        else
+            LOGW("module_part_collect: bad tree cache entry for %s, rescanning", dir);
+        sc->nodes = before;
+    }
+
+    Node *n = node_new(sc->arena, part_name, NFT_DIRECTORY);
+    if (!n) {
+        LOGE("module_part_collect: failed to allocate node for %s", dir);
+        return NULL;
+    }
+
+    sc->stamping = mod->blobs != NULL;
+    sc->stamps_count = 0;
+    int rc = node_scan_at(sc, n, mod, part_name, dir, has_any);
+    sc->stamping = false;
+    if (rc != 0)
+        return NULL;
+
+    if (mod->blobs) {
+        if (tree_cache_pack(sc->arena, n, *has_any, sc->stamps, sc->stamps_count,
+                            &mod->blobs[part]) == 0)
+            mod->blobs[part].fresh = true;
+        else
+            LOGW("module_part_collect: failed to pack %s for the tree cache", dir);
+    }
 
-    while ((de = readdir(d))) {
-        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+    *nodes = sc->nodes - before;
+    return n;
+}
+
+/* --- Module scan (sequential or worker pool) --- */
+
+/* One module partition root to collect, in module_dir readdir order */
+typedef struct {
+    ModuleInfo *mod;
+    int part;
+    Node *tree; /* private subtree */
+    size_t nodes;
+    uint64_t ns;
+    bool has_any;
+    int ret;
+} ModuleScan;
+
+typedef struct {
+    TreeScanner sc;
+    Arena arena;
+    ModuleScan *mods;
+    size_t count;
+    atomic_size_t *next;
+    pthread_t tid;
+} ScanWorker;
+
+static void *module_scan_worker(void *arg) {
+    ScanWorker *w = arg;
+
+    trace_thread_name("scan");
+    for (;;) {
+        size_t i = atomic_fetch_add(w->next, 1);
+        if (i >= w->count)
+            break;
+
+        ModuleScan *m = &w->mods[i];
+        uint64_t t = monotonic_ns();
+        m->tree = module_part_collect(&w->sc, m->mod, m->part, &m->nodes, &m->has_any);
+        m->ns = monotonic_ns() - t;
+        m->ret = m->tree ? 0 : -1;
+        TRACE_SPAN("scan module", t, m->mod->name, w->sc.ctx->catalog.parts[m->part]);
+    }
+    return NULL;
+}
+
+static size_t node_count(const Node *n) {
+    size_t c = 1;
+    for (size_t i = 0; i < n->child_count; ++i)
+        c += node_count(node_children(n)[i]);
+    return c;
+}
+
+/* Fold a private module subtree into the shared tree with the same result a
+ * sequential scan would give: the first module to provide a name wins, and
+ * nodes that lose are not counted.
+ */
+static int node_merge(MagicMount *ctx, Node *dst, Node *src, size_t *dropped) {
+    for (size_t i = 0; i < src->child_count; ++i) {
+        Node *c = node_children(src)[i];
+        Node *d = node_child_find(dst, c->name);
+
+        if (!d) {
+            if (node_child_append(&ctx->arena, dst, c) != 0)
+                return -1;
+            continue;
+        }
+
+        if (d->type != NFT_DIRECTORY) {
+            *dropped += node_count(c);
             continue;
+        }
 
-        if (path_join(dir, de->d_name, path, sizeof(path)) != 0) {
-            LOGE("node_scan_dir: path_join failed for dir=%s name=%s", dir, de->d_name);
-            closedir(d);
+        if (c->type != NFT_DIRECTORY) {
+            LOGE("node_merge: '%s' of module %s is not a directory but the one of %s is",
+                 c->name, node_module_name(ctx, c), node_module_name(ctx, d));
             return -1;
         }
 
-        LOGD("node_scan_dir: processing '%s' (full=%s)", de->d_name, path);
+        *dropped += 1;
+        if (node_merge(ctx, d, c, dropped) != 0)
+            return -1;
+    }
+    return 0;
+}
 
-        Node *child = node_child_find(self, de->d_name);
-        if (!child) {
-            Node *n = node_create_from_fs(ctx, de->d_name, path, module_name);
-            if (n && node_child_append(self, n) == 0) {
-                child = n;
-            } else if (n) {
-                LOGE("node_scan_dir: failed to add child '%s' to '%s'", de->d_name,
-                     self && self->name ? self->name : "(null)");
-                node_free(n);
-            } else {
-                LOGD("node_scan_dir: node_create_from_fs returned NULL for %s", path);
-            }
+/* Collect every task, on a worker pool when ctx->scan_jobs > 1, then merge
+ * the subtrees into dst in task order.
+ */
+static int module_scan_all(TreeScanner *sc, Node *dst, ModuleScan *mods, size_t count,
+                           bool *has_any) {
+    MagicMount *ctx = sc->ctx;
+    atomic_size_t next = 0;
+    int jobs = ctx->scan_jobs;
+
+    if (count == 0)
+        return 0;
+    if (jobs < 1)
+        jobs = 1;
+    if ((size_t)jobs > count)
+        jobs = (int)count;
+
+    ScanWorker *workers = calloc((size_t)jobs, sizeof(ScanWorker));
+    if (!workers) {
+        LOGE("module_scan_all: failed to allocate %d workers", jobs);
+        return -1;
+    }
+
+    /* Worker 0 is the calling thread and reuses its scanner and arena */
+    workers[0].sc = *sc;
+    for (int i = 0; i < jobs; ++i) {
+        ScanWorker *w = &workers[i];
+        if (i > 0) {
+            w->sc.ctx = ctx;
+            w->sc.arena = &w->arena;
         }
+        w->mods = mods;
+        w->count = count;
+        w->next = &next;
+    }
 
-        if (child) {
-            if (child->type == NFT_DIRECTORY) {
-                bool sub = false;
-                if (node_scan_dir(ctx, child, path, module_name, &sub) != 0) {
-                    LOGE("node_scan_dir: recurse failed for dir=%s", path);
-                    closedir(d);
-                    return -1;
-                }
-                if (sub || child->replace) {
-                    LOGD("node_scan_dir: directory '%s' has content (sub=%d, replace=%d)",
-                         child->name, sub, child->replace);
-                    any = true;
-                }
-            } else {
-                LOGD("node_scan_dir: file node '%s' has content (type=%d)", child->name,
-                     child->type);
-                any = true;
-            }
-        } else {
-            LOGD("node_scan_dir: no child node created for %s", path);
+    /* A failed spawn only means fewer workers */
+    int spawned = 1;
+    for (; spawned < jobs; ++spawned) {
+        int err =
+            pthread_create(&workers[spawned].tid, NULL, module_scan_worker, &workers[spawned]);
+        if (err != 0) {
+            LOGW("module_scan_all: pthread_create failed: %s", strerror(err));
+            break;
         }
     }
 
-    closedir(d);
-    *has_any = any;
-    LOGD("node_scan_dir: leave dir=%s has_any=%d", dir, any);
+    if (spawned > 1)
+        LOGI("build_mount_tree: scanning %zu module dirs with %d workers", count, spawned);
+
+    module_scan_worker(&workers[0]);
+    for (int i = 1; i < spawned; ++i)
+        pthread_join(workers[i].tid, NULL);
+
+    *sc = workers[0].sc;
+    for (int i = 1; i < jobs; ++i) {
+        scanner_release(&workers[i].sc);
+        arena_adopt(&ctx->arena, &workers[i].arena);
+    }
+    free(workers);
+
+    for (size_t i = 0; i < count; ++i) {
+        ModuleScan *m = &mods[i];
+        size_t dropped = 0;
+
+        if (m->ret != 0) {
+            LOGE("build_mount_tree: node_scan_dir failed for module=%s", m->mod->name);
+            return -1;
+        }
+
+        if (node_merge(ctx, dst, m->tree, &dropped) != 0) {
+            LOGE("build_mount_tree: failed to merge module=%s", m->mod->name);
+            return -1;
+        }
+
+        ctx->stats.nodes_total += (int)(m->nodes - dropped);
+        if (m->has_any)
+            *has_any = true;
+
+        ModuleCost *mc = magic_mount_cost(ctx, m->mod->id);
+        if (mc) {
+            mc->nodes += (int)m->nodes;
+            mc->scan_ns += m->ns;
+        }
+    }
     return 0;
 }
 
+/* Tasks for every enabled module that provides the partition root */
+static ModuleScan *module_scan_tasks(MagicMount *ctx, int part, size_t *count) {
+    ModuleCatalog *cat = &ctx->catalog;
+    ModuleScan *mods = arena_alloc(&ctx->arena, (cat->count ? cat->count : 1) * sizeof(ModuleScan));
+
+    *count = 0;
+    if (!mods)
+        return NULL;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        ModuleInfo *mod = &cat->modules[i];
+
+        if (!mod->enabled)
+            continue;
+
+        if (!mod->has_part[part]) {
+            LOGD("build_mount_tree: module %s has no %s dir, skip", mod->path, cat->parts[part]);
+            continue;
+        }
+
+        mods[*count].mod = mod;
+        mods[*count].part = part;
+        (*count)++;
+    }
+    return mods;
+}
+
 /* --- Symlink compatibility --- */
 
 static bool is_compatible_symlink(const char *link_target, const char *part_name,
@@ -365,135 +1084,98 @@ static bool is_compatible_symlink(const char *link_target, const char *part_name
     return false;
 }
 
-static int find_real_partition_dir(MagicMount *ctx, const char *part_name, char *out_path,
-                                   char *out_module, size_t buf_size) {
-    DIR *mod_dir = opendir(ctx->module_dir);
-    if (!mod_dir) {
-        LOGE("opendir %s: %s", ctx->module_dir, strerror(errno));
-        return -1;
-    }
-
-    struct dirent *mod_de;
-    int result = -1;
-
-    while ((mod_de = readdir(mod_dir))) {
-        if (!strcmp(mod_de->d_name, ".") || !strcmp(mod_de->d_name, ".."))
-            continue;
-
-        char mod_path[PATH_MAX], part_path[PATH_MAX];
-
-        if (path_join(ctx->module_dir, mod_de->d_name, mod_path, sizeof(mod_path)) != 0)
-            continue;
-
-        struct stat mod_st;
-        if (stat(mod_path, &mod_st) < 0 || !S_ISDIR(mod_st.st_mode))
-            continue;
-
-        if (module_is_disabled(mod_path))
-            continue;
-
-        if (path_join(mod_path, part_name, part_path, sizeof(part_path)) != 0)
-            continue;
-
-        if (path_is_dir(part_path)) {
-            strncpy(out_path, part_path, buf_size - 1);
-            out_path[buf_size - 1] = '\0';
-            strncpy(out_module, mod_de->d_name, buf_size - 1);
-            out_module[buf_size - 1] = '\0';
-            result = 0;
-            break;
-        }
-    }
-
-    closedir(mod_dir);
-    return result;
-}
+static int symlink_resolve_partition(TreeScanner *sc, Node *system, const char *part_name) {
+    MagicMount *ctx = sc->ctx;
 
-static int symlink_resolve_partition(MagicMount *ctx, Node *system, const char *part_name) {
     if (!system || !part_name)
         return -1;
 
     Node *sys_child = node_child_find(system, part_name);
-    if (!sys_child || sys_child->type != NFT_SYMLINK || !sys_child->module_path)
+    char link_path[PATH_MAX];
+    if (!sys_child || sys_child->type != NFT_SYMLINK ||
+        node_module_path(ctx, sys_child, link_path, sizeof(link_path)) != 0)
         return 0;
 
     char link_target[PATH_MAX];
-    ssize_t len = readlink(sys_child->module_path, link_target, sizeof(link_target) - 1);
+    uint64_t t = opstat_begin();
+    ssize_t len = readlink(link_path, link_target, sizeof(link_target) - 1);
+    opstat_end(OP_READLINK, t);
     if (len < 0) {
-        LOGW("readlink %s failed: %s", sys_child->module_path, strerror(errno));
+        LOGW("readlink %s failed: %s", link_path, strerror(errno));
         return 0;
     }
     link_target[len] = '\0';
 
-    if (!is_compatible_symlink(link_target, part_name, ctx, sys_child->module_name)) {
+    if (!is_compatible_symlink(link_target, part_name, ctx, node_module_name(ctx, sys_child))) {
         LOGD("symlink %s -> %s (not compatible)", part_name, link_target);
         return 0;
     }
 
     LOGI("found compatible symlink: system/%s -> %s", part_name, link_target);
 
-    char real_part_path[PATH_MAX], module_name_buf[256];
-    if (find_real_partition_dir(ctx, part_name, real_part_path, module_name_buf,
-                                sizeof(module_name_buf)) != 0) {
+    int part = module_catalog_part_index(&ctx->catalog, part_name);
+    ModuleInfo *mod = module_catalog_first_with_part(&ctx->catalog, part);
+    if (!mod) {
         LOGD("no real directory found for %s, keeping symlink", part_name);
         return 0;
     }
 
     LOGI("symlink compatibility: system/%s -> %s, real dir in module '%s'", part_name, link_target,
-         module_name_buf);
+         mod->name);
 
-    Node *new_part = node_new(part_name, NFT_DIRECTORY);
+    bool part_has_any = false;
+    size_t part_nodes = 0;
+    uint64_t start = monotonic_ns();
+    Node *new_part = module_part_collect(sc, mod, part, &part_nodes, &part_has_any);
     if (!new_part) {
-        LOGE("failed to create node for %s", part_name);
+        LOGE("failed to collect %s from module '%s'", part_name, mod->name);
         return -1;
     }
 
-    bool part_has_any = false;
-    if (node_scan_dir(ctx, new_part, real_part_path, module_name_buf, &part_has_any) != 0) {
-        LOGE("failed to collect %s from %s", part_name, real_part_path);
-        node_free(new_part);
-        return -1;
+    ModuleCost *mc = magic_mount_cost(ctx, mod->id);
+    if (mc) {
+        mc->nodes += (int)part_nodes;
+        mc->scan_ns += monotonic_ns() - start;
     }
+    TRACE_SPAN("resolve partition", start, mod->name, part_name);
 
     if (!part_has_any) {
         LOGD("no content in %s, keeping symlink", part_name);
-        node_free(new_part);
         return 0;
     }
 
-    Node *removed = node_child_detach(system, part_name);
-    if (removed) {
-        node_free(removed);
+    if (node_child_detach(system, part_name))
         LOGD("removed symlink node: system/%s", part_name);
-    }
 
-    new_part->module_name = strdup(module_name_buf);
+    new_part->module_id = mod->id;
 
-    if (node_child_append(system, new_part) != 0) {
+    if (node_child_append(&ctx->arena, system, new_part) != 0) {
         LOGE("failed to add directory node for %s", part_name);
-        node_free(new_part);
         return -1;
     }
+    ctx->stats.nodes_total += (int)part_nodes;
 
-    LOGI("replaced symlink with directory node: %s (from module '%s')", part_name, module_name_buf);
+    LOGI("replaced symlink with directory node: %s (from module '%s')", part_name, mod->name);
 
     return 0;
 }
 
-static int symlink_resolve_all_partition_links(MagicMount *ctx, Node *system) {
+static int symlink_resolve_all_partition_links(TreeScanner *sc, Node *system) {
+    MagicMount *ctx = sc->ctx;
+
     if (!system)
         return -1;
 
     const char *builtin_parts[] = {"vendor", "system_ext", "product", "odm"};
 
     for (size_t i = 0; i < sizeof(builtin_parts) / sizeof(builtin_parts[0]); ++i) {
-        if (symlink_resolve_partition(ctx, system, builtin_parts[i]) != 0) {
+        if (symlink_resolve_partition(sc, system, builtin_parts[i]) != 0) {
             LOGE("failed to handle symlink compatibility for %s", builtin_parts[i]);
         }
     }
 
     for (int i = 0; i < ctx->extra_parts_count; ++i) {
-        if (symlink_resolve_partition(ctx, system, ctx->extra_parts[i]) != 0) {
+        if (symlink_resolve_partition(sc, system, ctx->extra_parts[i]) != 0) {
             LOGE("failed to handle symlink compatibility for extra part %s", ctx->extra_parts[i]);
         }
     }
@@ -503,7 +1185,10 @@ static int symlink_resolve_all_partition_links(MagicMount *ctx, Node *system) {
 
 /* --- Extra partition collect --- */
 
-static int partition_scan_from_modules(MagicMount *ctx, const char *part_name, Node *parent_node) {
+static int partition_scan_from_modules(TreeScanner *sc, const char *part_name,
+                                       Node *parent_node) {
+    MagicMount *ctx = sc->ctx;
+
     if (!part_name || !parent_node) {
         LOGE("partition_scan_from_modules: invalid args part=%s node=%p",
              part_name ? part_name : "(null)", (void *)parent_node);
@@ -512,78 +1197,39 @@ static int partition_scan_from_modules(MagicMount *ctx, const char *part_name, N
 
     LOGD("partition_scan_from_modules: part=%s", part_name);
 
-    DIR *mod_dir = opendir(ctx->module_dir);
-    if (!mod_dir) {
-        LOGE("opendir %s: %s", ctx->module_dir, strerror(errno));
+    int part = module_catalog_part_index(&ctx->catalog, part_name);
+    if (part < 0) {
+        LOGE("partition_scan_from_modules: part=%s is not in the module catalog", part_name);
         return -1;
     }
 
-    struct dirent *mod_de;
     bool has_any = false;
+    size_t count = 0;
+    ModuleScan *mods = module_scan_tasks(ctx, part, &count);
+    if (!mods) {
+        LOGE("partition_scan_from_modules: failed to allocate module list");
+        return -1;
+    }
 
-    while ((mod_de = readdir(mod_dir))) {
-        if (!strcmp(mod_de->d_name, ".") || !strcmp(mod_de->d_name, ".."))
-            continue;
-
-        char mod_path[PATH_MAX], part_path[PATH_MAX];
-
-        if (path_join(ctx->module_dir, mod_de->d_name, mod_path, sizeof(mod_path)) != 0) {
-            LOGE("partition_scan_from_modules: path_join failed for module=%s", mod_de->d_name);
-            continue;
-        }
-
-        struct stat mod_st;
-        if (stat(mod_path, &mod_st) < 0 || !S_ISDIR(mod_st.st_mode)) {
-            LOGD("partition_scan_from_modules: skip non-dir module=%s", mod_path);
-            continue;
-        }
-
-        if (module_is_disabled(mod_path)) {
-            LOGD("partition_scan_from_modules: module %s disabled, skip", mod_path);
-            continue;
-        }
-
-        if (path_join(mod_path, part_name, part_path, sizeof(part_path)) != 0) {
-            LOGE("partition_scan_from_modules: path_join failed for part=%s in module=%s",
-                 part_name, mod_path);
-            continue;
-        }
-
-        if (!path_is_dir(part_path)) {
-            LOGD("partition_scan_from_modules: module %s has no dir %s", mod_path, part_path);
-            continue;
-        }
-
-        LOGD("partition_scan_from_modules: collecting part=%s from module=%s", part_name,
-             mod_de->d_name);
-
-        bool sub = false;
-        if (node_scan_dir(ctx, parent_node, part_path, mod_de->d_name, &sub) != 0) {
-            LOGE("partition_scan_from_modules: node_scan_dir failed for module=%s part=%s",
-                 mod_de->d_name, part_name);
-            closedir(mod_dir);
-            return -1;
-        }
+    if (module_scan_all(sc, parent_node, mods, count, &has_any) != 0) {
+        LOGE("partition_scan_from_modules: scan failed for part=%s", part_name);
+        return -1;
+    }
 
-        if (sub) {
-            LOGD("partition_scan_from_modules: module=%s contributed content to part=%s",
-                 mod_de->d_name, part_name);
-            has_any = true;
-        } else {
-            LOGD("partition_scan_from_modules: module=%s had no effective content for part=%s",
-                 mod_de->d_name, part_name);
-        }
+    for (size_t i = 0; i < count; ++i) {
+        LOGD("partition_scan_from_modules: module=%s %s part=%s", mods[i].mod->name,
+             mods[i].has_any ? "contributed content to" : "had no effective content for",
+             part_name);
     }
 
-    closedir(mod_dir);
     LOGD("partition_scan_from_modules: result for part=%s has_any=%d", part_name, has_any);
     return has_any ? 0 : 1;
 }
 
 /* --- Helper for partition promotion --- */
 
-static int partition_promote_to_root(Node *root, Node *system, const char *part_name,
-                                     bool need_symlink) {
+static int partition_promote_to_root(MagicMount *ctx, Node *root, Node *system,
+                                     const char *part_name, bool need_symlink) {
     char rp[PATH_MAX], sp[PATH_MAX];
 
     LOGD("partition_promote_to_root: part=%s need_symlink=%d", part_name, need_symlink);
@@ -610,9 +1256,8 @@ static int partition_promote_to_root(Node *root, Node *system, const char *part_
 
     LOGD("partition_promote_to_root: promoting '%s' from /system to /", part_name);
 
-    if (node_child_append(root, child) != 0) {
+    if (node_child_append(&ctx->arena, root, child) != 0) {
         LOGE("partition_promote_to_root: failed to attach '%s' to root", part_name);
-        node_free(child);
         return -1;
     }
 
@@ -621,108 +1266,97 @@ static int partition_promote_to_root(Node *root, Node *system, const char *part_
 
 /* --- Root collection --- */
 
-Node *build_mount_tree(MagicMount *ctx) {
-    if (!ctx) {
-        LOGE("build_mount_tree: ctx is NULL");
-        return NULL;
+static void module_costs_free(MagicMount *ctx) {
+    for (size_t i = 0; i < ctx->module_costs_count; ++i)
+        free(ctx->module_costs[i].name);
+    free(ctx->module_costs);
+    ctx->module_costs = NULL;
+    ctx->module_costs_count = 0;
+}
+
+/* One zeroed entry per catalog module; names are copied, the catalog goes
+ * with the arena before the summary is written
+ */
+static int module_costs_init(MagicMount *ctx) {
+    const ModuleCatalog *cat = &ctx->catalog;
+
+    module_costs_free(ctx);
+    if (cat->count == 0)
+        return 0;
+
+    ctx->module_costs = calloc(cat->count, sizeof(*ctx->module_costs));
+    if (!ctx->module_costs)
+        return -1;
+    ctx->module_costs_count = cat->count;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        ctx->module_costs[i].name = strdup(cat->modules[i].name);
+        if (!ctx->module_costs[i].name) {
+            module_costs_free(ctx);
+            return -1;
+        }
     }
+    return 0;
+}
 
+static Node *mount_tree_collect(TreeScanner *sc) {
+    MagicMount *ctx = sc->ctx;
     const char *mdir = ctx->module_dir ? ctx->module_dir : DEFAULT_MODULE_DIR;
 
     LOGI("build_mount_tree: module_dir=%s", mdir);
 
-    Node *root = node_new("", NFT_DIRECTORY);
-    Node *system = node_new("system", NFT_DIRECTORY);
+    Node *root = node_new(&ctx->arena, "", NFT_DIRECTORY);
+    Node *system = node_new(&ctx->arena, "system", NFT_DIRECTORY);
 
     if (!root || !system) {
         LOGE("build_mount_tree: failed to allocate root/system nodes");
-        node_free(root);
-        node_free(system);
         return NULL;
     }
 
-    DIR *d = opendir(mdir);
-    if (!d) {
-        LOGE("opendir %s: %s", mdir, strerror(errno));
-        node_free(root);
-        node_free(system);
+    uint64_t t = monotonic_ns();
+    if (module_catalog_build(ctx) != 0)
         return NULL;
-    }
-
-    struct dirent *de;
-    bool has_any = false;
-
-    while ((de = readdir(d))) {
-        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-            continue;
-
-        char mod[PATH_MAX], mod_sys[PATH_MAX];
-
-        if (path_join(mdir, de->d_name, mod, sizeof(mod)) != 0) {
-            LOGE("build_mount_tree: path_join failed for module=%s", de->d_name);
-            closedir(d);
-            node_free(root);
-            node_free(system);
-            return NULL;
-        }
 
-        struct stat st;
-        if (stat(mod, &st) < 0 || !S_ISDIR(st.st_mode)) {
-            LOGD("build_mount_tree: skip non-dir entry %s", mod);
-            continue;
-        }
+    if (module_costs_init(ctx) != 0)
+        LOGW("build_mount_tree: failed to allocate module costs, not accounting them");
 
-        if (module_is_disabled(mod)) {
-            LOGI("build_mount_tree: module %s is disabled", mod);
-            continue;
-        }
+    if (tree_cache_load(ctx) != 0)
+        LOGW("build_mount_tree: tree cache unavailable, scanning every module");
+    t = magic_mount_phase(ctx, PHASE_CATALOG, t);
 
-        if (path_join(mod, "system", mod_sys, sizeof(mod_sys)) != 0) {
-            LOGE("build_mount_tree: path_join failed for module=%s system dir", mod);
-            closedir(d);
-            node_free(root);
-            node_free(system);
-            return NULL;
-        }
-
-        if (!path_is_dir(mod_sys)) {
-            LOGD("build_mount_tree: module %s has no system dir (%s), skip", mod, mod_sys);
-            continue;
-        }
+    bool has_any = false;
+    size_t mods_count = 0;
+    ModuleScan *mods = module_scan_tasks(ctx, CATALOG_PART_SYSTEM, &mods_count);
+    if (!mods) {
+        LOGE("build_mount_tree: failed to allocate module list");
+        return NULL;
+    }
 
-        LOGI("build_mount_tree: collecting module %s", de->d_name);
+    for (size_t i = 0; i < mods_count; ++i) {
+        LOGI("build_mount_tree: collecting module %s", mods[i].mod->name);
         ctx->stats.modules_total++;
-
-        bool sub = false;
-        if (node_scan_dir(ctx, system, mod_sys, de->d_name, &sub) != 0) {
-            LOGE("build_mount_tree: node_scan_dir failed for module=%s", de->d_name);
-            closedir(d);
-            node_free(root);
-            node_free(system);
-            return NULL;
-        }
-        if (sub) {
-            LOGD("build_mount_tree: module %s contributed content", de->d_name);
-            has_any = true;
-        } else {
-            LOGD("build_mount_tree: module %s had no effective content", de->d_name);
-        }
     }
 
-    closedir(d);
+    if (module_scan_all(sc, system, mods, mods_count, &has_any) != 0)
+        return NULL;
+    t = magic_mount_phase(ctx, PHASE_SCAN, t);
+
+    for (size_t i = 0; i < mods_count; ++i) {
+        LOGD("build_mount_tree: module %s %s", mods[i].mod->name,
+             mods[i].has_any ? "contributed content" : "had no effective content");
+    }
 
     if (!has_any) {
         LOGW("build_mount_tree: no module contributed any content, abort");
-        node_free(root);
-        node_free(system);
         return NULL;
     }
 
     ctx->stats.nodes_total += 2;
 
-    if (symlink_resolve_all_partition_links(ctx, system) != 0) {
+    if (symlink_resolve_all_partition_links(sc, system) != 0) {
         LOGW("symlink compatibility handling encountered errors (continuing anyway)");
     }
+    t = magic_mount_phase(ctx, PHASE_SYMLINKS, t);
 
     // Promote builtin partitions to root
     struct {
@@ -740,11 +1374,10 @@ Node *build_mount_tree(MagicMount *ctx) {
 
         LOGD("build_mount_tree: trying to promote builtin partition '%s' to /", part);
 
-        if (partition_promote_to_root(root, system, part, builtin_parts[i].need_symlink) != 0) {
+        if (partition_promote_to_root(ctx, root, system, part, builtin_parts[i].need_symlink) !=
+            0) {
             LOGE("build_mount_tree: partition_promote_to_root failed for builtin partition '%s'",
                  part);
-            node_free(root);
-            node_free(system);
             return NULL;
         } else {
             LOGD("build_mount_tree: partition_promote_to_root finished for builtin partition '%s'",
@@ -772,58 +1405,69 @@ Node *build_mount_tree(MagicMount *ctx) {
 
         LOGD("build_mount_tree: extra partition '%s' has real dir '%s', creating node", name, rp);
 
-        Node *child = node_new(name, NFT_DIRECTORY);
+        Node *child = node_new(&ctx->arena, name, NFT_DIRECTORY);
         if (!child) {
             LOGE("build_mount_tree: failed to allocate node for extra partition '%s'", name);
-            node_free(root);
-            node_free(system);
             return NULL;
         }
 
         LOGD("build_mount_tree: collecting extra partition '%s' from modules", name);
 
-        int ret = partition_scan_from_modules(ctx, name, child);
+        int ret = partition_scan_from_modules(sc, name, child);
         if (ret == 0) {
             LOGI("build_mount_tree: collected extra partition '%s' from module root", name);
-            if (node_child_append(root, child) != 0) {
+            if (node_child_append(&ctx->arena, root, child) != 0) {
                 LOGE("build_mount_tree: failed to attach extra partition '%s' node to root", name);
-                node_free(child);
-                node_free(root);
-                node_free(system);
                 return NULL;
             }
             LOGD("build_mount_tree: extra partition '%s' attached to root", name);
         } else if (ret == 1) {
             LOGD("build_mount_tree: no content found for extra partition '%s', dropping node",
                  name);
-            node_free(child);
         } else {
             LOGE("build_mount_tree: partition_scan_from_modules failed for extra partition '%s' "
                  "(ret=%d)",
                  name, ret);
-            node_free(child);
-            node_free(root);
-            node_free(system);
             return NULL;
         }
     }
 
     LOGD("build_mount_tree: attaching /system node to root");
-    if (node_child_append(root, system) != 0) {
+    if (node_child_append(&ctx->arena, root, system) != 0) {
         LOGE("build_mount_tree: failed to attach /system node to root");
-        node_free(root);
-        node_free(system);
         return NULL;
     }
+    magic_mount_phase(ctx, PHASE_PROMOTE, t);
 
     LOGI("build_mount_tree: root tree successfully built");
     return root;
 }
 
+Node *build_mount_tree(MagicMount *ctx) {
+    if (!ctx) {
+        LOGE("build_mount_tree: ctx is NULL");
+        return NULL;
+    }
+
+    TreeScanner sc = {.ctx = ctx, .arena = &ctx->arena};
+    Node *root = mount_tree_collect(&sc);
+    scanner_release(&sc);
+
+    uint64_t t = monotonic_ns();
+    if (root && tree_cache_save(ctx) != 0)
+        LOGW("build_mount_tree: failed to save tree cache");
+    magic_mount_phase(ctx, PHASE_CACHE_SAVE, t);
+    module_catalog_release(&ctx->catalog);
+    return root;
+}
+
 void module_tree_cleanup(MagicMount *ctx) {
     if (!ctx)
         return;
 
     str_array_free(&ctx->failed_modules, &ctx->failed_modules_count);
+    module_costs_free(ctx);
+    str_array_free(&ctx->try_umounts, &ctx->try_umounts_count);
     str_array_free(&ctx->extra_parts, &ctx->extra_parts_count);
+    arena_destroy(&ctx->arena);
 }
@@ -4,31 +4,73 @@
 #include "magic_mount.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 /* Node Type */
 typedef enum { NFT_REGULAR, NFT_DIRECTORY, NFT_SYMLINK, NFT_WHITEOUT } NodeFileType;
 
-/* Node */
+/* Directories with more children than this get a hash index; see
+ * bench/node_bench.c for the crossover
+ */
+#ifndef NODE_INDEX_THRESHOLD
+#define NODE_INDEX_THRESHOLD 8
+#endif
+
+/* Children kept inside the node before spilling to an arena array */
+#define NODE_INLINE_CHILDREN 2
+
+/* Node: a 48-byte header (LP64) directly followed by the name, so a typical
+ * file node, which is most of the tree, fits in one cache line. Directories
+ * with up to NODE_INLINE_CHILDREN entries need no child array.
+ */
 typedef struct Node {
-    char *name;
-    NodeFileType type;
-    struct Node **children;
-    size_t child_count;
-    char *module_path;
-    char *module_name;
-    bool replace;
-    bool skip;
-    bool done;
+    /* Directory the node was scanned from; unlike the tree parent this is
+     * never changed by merging or promotion. NULL: not a module file.
+     */
+    const struct Node *origin;
+    struct Node **index; /* open addressing, NULL below NODE_INDEX_THRESHOLD */
+    union {
+        struct Node *items[NODE_INLINE_CHILDREN]; /* child_cap == 0 */
+        struct Node **spill;
+    } kids;
+    uint32_t name_hash;
+    uint32_t child_count;
+    uint32_t child_cap; /* size of kids.spill, 0 while inline */
+    uint16_t module_id;      /* ModuleInfo.id, 0 = none */
+    unsigned index_bits : 6; /* index capacity is 1 << index_bits */
+    unsigned type : 2;       /* NodeFileType */
+    unsigned replace : 1;
+    unsigned skip : 1;
+    unsigned done : 1; /* handled: dispatched while listing, or an overlaid partition */
+    unsigned real : 3; /* planner: real entry NodeFileType + 1, 0 if none */
+    /* Mount plan of a directory (mount_plan_build), chosen per context */
+    unsigned own_tmpfs : 1; /* reached outside a tmpfs: build it on its own tmpfs */
+    unsigned bind_real : 1; /* inside a tmpfs: bind the real dir whole, mount onto it */
+    char name[];
 } Node;
 
+static inline Node *const *node_children(const Node *n) {
+    return n->child_cap ? n->kids.spill : n->kids.items;
+}
+
 /* Node utils func */
 NodeFileType node_type_from_stat(const struct stat *st);
+Node *node_new(Arena *a, const char *name, NodeFileType t);
+int node_child_append(Arena *a, Node *parent, Node *child);
 Node *node_child_find(Node *parent, const char *name);
-void node_free(Node *n);
+
+/* Name of the module that provides n, NULL if none */
+const char *node_module_name(const MagicMount *ctx, const Node *n);
+
+/* Rebuild <module>/<partition>/.../<name> from the origin links; -1 when n
+ * is not a module file or the path does not fit
+ */
+int node_module_path(const MagicMount *ctx, const Node *n, char *buf, size_t len);
 
 /* Collect the root node from the module directory：
  * ctx->module_dir...，Status writing ctx->stats
+ * Nodes are allocated from ctx->arena, released by arena_destroy
  */
 Node *build_mount_tree(MagicMount *ctx);
 
@@ -38,7 +80,7 @@ void extra_partition_register(MagicMount *ctx, const char *start, size_t len);
 /* ctx->failed_modules */
 void module_mark_failed(MagicMount *ctx, const char *module_name);
 
-/*（extra_parts/failed_modules） */
+/*（extra_parts/failed_modules/arena） */
 void module_tree_cleanup(MagicMount *ctx);
 
 #endif /* MODULE_TREE_H */
@@ -0,0 +1,148 @@
+#include "mount_api.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+long syscall(long number, ...);
+
+/* Same number on every architecture we build for */
+#ifndef SYS_open_tree
+#define SYS_open_tree 428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount 429
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen 430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig 431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount 432
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr 442
+#endif
+
+/* uapi values, libc only exposes them (if at all) with _GNU_SOURCE */
+#define MM_AT_EMPTY_PATH 0x1000
+#define MM_AT_RECURSIVE 0x8000
+#define MM_OPEN_TREE_CLONE 1
+#define MM_MOVE_MOUNT_F_EMPTY_PATH 0x04
+#define MM_FSOPEN_CLOEXEC 0x01
+#define MM_FSCONFIG_SET_STRING 1
+#define MM_FSCONFIG_CMD_CREATE 6
+#define MM_FSMOUNT_CLOEXEC 0x01
+#define MM_MOUNT_ATTR_RDONLY 0x01
+
+/* struct mount_attr */
+typedef struct {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+} MountAttr;
+
+static int mm_setattr(int fd, const char *path, unsigned int flags, uint64_t attr,
+                      uint64_t propagation) {
+    MountAttr ma = {.attr_set = attr, .propagation = propagation};
+
+    return (int)syscall(SYS_mount_setattr, fd, path, flags, &ma, sizeof(ma));
+}
+
+int mount_api_tmpfs(const char *source) {
+    int fs = (int)syscall(SYS_fsopen, "tmpfs", MM_FSOPEN_CLOEXEC);
+    if (fs < 0)
+        return -1;
+
+    int fd = -1;
+    if ((!source || syscall(SYS_fsconfig, fs, MM_FSCONFIG_SET_STRING, "source", source, 0) == 0) &&
+        syscall(SYS_fsconfig, fs, MM_FSCONFIG_CMD_CREATE, NULL, NULL, 0) == 0)
+        fd = (int)syscall(SYS_fsmount, fs, MM_FSMOUNT_CLOEXEC, 0);
+
+    int err = errno;
+    close(fs);
+    errno = err;
+    return fd;
+}
+
+int mount_api_fd_path(int fd, char *buf, size_t len) {
+    if (snprintf(buf, len, "/proc/self/fd/%d/", fd) >= (int)len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int mount_api_bind(const char *src, const char *dst, unsigned int flags) {
+    unsigned int rec = (flags & MOUNT_API_BIND_REC) ? MM_AT_RECURSIVE : 0;
+
+    int tree = (int)syscall(SYS_open_tree, AT_FDCWD, src, MM_OPEN_TREE_CLONE | O_CLOEXEC | rec);
+    if (tree < 0)
+        return -1;
+
+    int ret = 0;
+    if ((flags & MOUNT_API_BIND_RDONLY) &&
+        mm_setattr(tree, "", MM_AT_EMPTY_PATH | rec, MM_MOUNT_ATTR_RDONLY, 0) != 0)
+        ret = -1;
+    else if (syscall(SYS_move_mount, tree, "", AT_FDCWD, dst, MM_MOVE_MOUNT_F_EMPTY_PATH) != 0)
+        ret = -1;
+
+    int err = errno;
+    close(tree);
+    errno = err;
+    return ret;
+}
+
+int mount_api_seal(int fd) {
+    return mm_setattr(fd, "", MM_AT_EMPTY_PATH | MM_AT_RECURSIVE, MM_MOUNT_ATTR_RDONLY,
+                      MS_PRIVATE);
+}
+
+int mount_api_attach(int fd, const char *path) {
+    return (int)syscall(SYS_move_mount, fd, "", AT_FDCWD, path, MM_MOVE_MOUNT_F_EMPTY_PATH);
+}
+
+/* Build, fill and seal a throwaway tree: every step the mount pass needs */
+static bool mount_api_probe(void) {
+    char dir[64];
+    bool ok = false;
+
+    int fd = mount_api_tmpfs(NULL);
+    if (fd < 0) {
+        LOGD("mount_api: fsmount: %s", strerror(errno));
+        return false;
+    }
+
+    if (mount_api_fd_path(fd, dir, sizeof(dir)) == 0 && strlen(dir) + 1 < sizeof(dir)) {
+        strcat(dir, "p");
+        if (mkdir(dir, 0755) != 0)
+            LOGD("mount_api: mkdir %s: %s", dir, strerror(errno));
+        else if (mount_api_bind("/", dir, 0) != 0)
+            LOGD("mount_api: bind into a detached tree: %s", strerror(errno));
+        else if (mount_api_seal(fd) != 0)
+            LOGD("mount_api: mount_setattr: %s", strerror(errno));
+        else
+            ok = true;
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool mount_api_supported(void) {
+    static int supported = -1;
+
+    if (supported < 0)
+        supported = mount_api_probe();
+    return supported;
+}
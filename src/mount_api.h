@@ -0,0 +1,35 @@
+#ifndef MOUNT_API_H
+#define MOUNT_API_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Linux new mount API (5.2+, mount_setattr 5.12+). A replacement tree is a
+ * detached tmpfs that gets its binds while still outside the namespace
+ * (6.15+), is sealed read-only with one recursive mount_setattr and is
+ * attached with one move_mount. Every call returns -1 with errno set.
+ */
+
+/* Whether this kernel can assemble detached trees (probed once) */
+bool mount_api_supported(void);
+
+/* New detached tmpfs; returns its mount fd */
+int mount_api_tmpfs(const char *source);
+
+/* Path that reaches into the detached tree of fd, with a trailing '/' */
+int mount_api_fd_path(int fd, char *buf, size_t len);
+
+/* mount_api_bind flags */
+#define MOUNT_API_BIND_RDONLY 0x1
+#define MOUNT_API_BIND_REC 0x2 /* with every mount below src */
+
+/* Clone src and attach it at dst, which may lie in a detached tree */
+int mount_api_bind(const char *src, const char *dst, unsigned int flags);
+
+/* Make the whole tree of fd read-only and private */
+int mount_api_seal(int fd);
+
+/* Attach the tree of fd at path */
+int mount_api_attach(int fd, const char *path);
+
+#endif /* MOUNT_API_H */
@@ -0,0 +1,373 @@
+#include "mount_index.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* --- Writer --- */
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    /* Module names repeat on every node; keep one copy of each */
+    const char **mods;
+    uint32_t *mod_offs;
+    size_t mods_count;
+    size_t mods_cap;
+} IndexStrings;
+
+static int strings_add(IndexStrings *s, const char *str, uint32_t *off) {
+    size_t n = strlen(str) + 1;
+
+    if (s->len + n > UINT32_MAX)
+        return -1;
+
+    if (s->len + n > s->cap) {
+        size_t cap = s->cap ? s->cap : 4096;
+        while (cap < s->len + n)
+            cap *= 2;
+        char *buf = realloc(s->buf, cap);
+        if (!buf)
+            return -1;
+        s->buf = buf;
+        s->cap = cap;
+    }
+
+    memcpy(s->buf + s->len, str, n);
+    *off = (uint32_t)s->len;
+    s->len += n;
+    return 0;
+}
+
+static int strings_add_module(IndexStrings *s, const char *name, uint32_t *off) {
+    for (size_t i = 0; i < s->mods_count; ++i) {
+        if (s->mods[i] == name || strcmp(s->mods[i], name) == 0) {
+            *off = s->mod_offs[i];
+            return 0;
+        }
+    }
+
+    if (s->mods_count == s->mods_cap) {
+        size_t cap = s->mods_cap ? s->mods_cap * 2 : 16;
+        const char **mods = realloc(s->mods, cap * sizeof(*mods));
+        if (!mods)
+            return -1;
+        s->mods = mods;
+        uint32_t *offs = realloc(s->mod_offs, cap * sizeof(*offs));
+        if (!offs)
+            return -1;
+        s->mod_offs = offs;
+        s->mods_cap = cap;
+    }
+
+    if (strings_add(s, name, off) != 0)
+        return -1;
+    s->mods[s->mods_count] = name;
+    s->mod_offs[s->mods_count] = *off;
+    s->mods_count++;
+    return 0;
+}
+
+static size_t index_count(const Node *n) {
+    size_t c = 1;
+    for (size_t i = 0; i < n->child_count; ++i)
+        c += index_count(node_children(n)[i]);
+    return c;
+}
+
+static int index_cmp_node(const void *a, const void *b) {
+    const Node *x = *(const Node *const *)a;
+    const Node *y = *(const Node *const *)b;
+    return strcmp(x->name, y->name);
+}
+
+/* Breadth first, so that every child list is one contiguous sorted run */
+static int index_build(const MagicMount *ctx, const Node *root, size_t count, MountIndexNode *out,
+                       IndexStrings *s) {
+    const Node **order = malloc(count * sizeof(*order));
+    if (!order)
+        return -1;
+
+    size_t tail = 1;
+    int ret = 0;
+    order[0] = root;
+
+    for (size_t i = 0; i < count && ret == 0; ++i) {
+        const Node *n = order[i];
+        MountIndexNode *e = &out[i];
+
+        memset(e, 0, sizeof(*e));
+        e->type = (uint8_t)n->type;
+        e->flags = (n->replace ? MOUNT_INDEX_REPLACE : 0) | (n->skip ? MOUNT_INDEX_SKIPPED : 0);
+        e->first_child = (uint32_t)tail;
+        e->child_count = (uint32_t)n->child_count;
+
+        const char *module = node_module_name(ctx, n);
+        char source[PATH_MAX];
+        bool has_source = node_module_path(ctx, n, source, sizeof(source)) == 0;
+
+        if (strings_add(s, n->name, &e->name) != 0 ||
+            (module && strings_add_module(s, module, &e->module) != 0) ||
+            (has_source && strings_add(s, source, &e->source) != 0)) {
+            ret = -1;
+            break;
+        }
+
+        if (n->child_count == 0)
+            continue;
+
+        memcpy(&order[tail], node_children(n), n->child_count * sizeof(*order));
+        qsort(&order[tail], n->child_count, sizeof(*order), index_cmp_node);
+        tail += n->child_count;
+    }
+
+    free(order);
+    return ret;
+}
+
+typedef struct {
+    const MountIndexHeader *hdr;
+    const MountIndexNode *nodes;
+    const IndexStrings *s;
+} IndexFile;
+
+static int index_write_file(FILE *fp, void *arg) {
+    const IndexFile *f = arg;
+    size_t nodes_len = f->hdr->node_count * sizeof(*f->nodes);
+
+    if (fwrite(f->hdr, sizeof(*f->hdr), 1, fp) != 1 ||
+        (nodes_len && fwrite(f->nodes, nodes_len, 1, fp) != 1) ||
+        (f->s->len && fwrite(f->s->buf, f->s->len, 1, fp) != 1))
+        return -1;
+    return 0;
+}
+
+int mount_index_write(const MagicMount *ctx, const Node *root, const char *path) {
+    if (!ctx || !root || !path)
+        return -1;
+
+    size_t count = index_count(root);
+    MountIndexNode *nodes = calloc(count, sizeof(*nodes));
+    IndexStrings s = {0};
+    uint32_t empty;
+    int ret = -1;
+
+    /* Offset 0 is the empty string, meaning "none" */
+    if (!nodes || strings_add(&s, "", &empty) != 0 ||
+        index_build(ctx, root, count, nodes, &s) != 0) {
+        LOGE("mount_index_write: failed to build index for %s", path);
+        goto out;
+    }
+
+    MountIndexHeader hdr = {.version = MOUNT_INDEX_VERSION};
+    memcpy(hdr.magic, MOUNT_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.node_count = (uint32_t)count;
+    hdr.nodes_off = sizeof(hdr);
+    hdr.strings_off = (uint32_t)(sizeof(hdr) + count * sizeof(*nodes));
+    hdr.strings_len = (uint32_t)s.len;
+
+    IndexFile f = {.hdr = &hdr, .nodes = nodes, .s = &s};
+    if (write_file_atomic(path, index_write_file, &f) != 0)
+        goto out;
+
+    LOGI("mount index: %zu nodes, %zu string bytes written to %s", count, s.len, path);
+    ret = 0;
+
+out:
+    free(nodes);
+    free(s.buf);
+    free(s.mods);
+    free(s.mod_offs);
+    return ret;
+}
+
+/* --- Reader --- */
+
+typedef struct {
+    void *map;
+    size_t size;
+    const MountIndexNode *nodes;
+    uint32_t count;
+    const char *strings;
+    uint32_t strings_len;
+} IndexMap;
+
+static int index_open(const char *path, IndexMap *m) {
+    memset(m, 0, sizeof(*m));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: cannot open mount index %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MountIndexHeader)) {
+        fprintf(stderr, "Error: %s is not a mount index\n", path);
+        close(fd);
+        return -1;
+    }
+
+    m->size = (size_t)st.st_size;
+    m->map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->map == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap %s: %s\n", path, strerror(errno));
+        m->map = NULL;
+        return -1;
+    }
+
+    const MountIndexHeader *h = m->map;
+    uint64_t nodes_end = (uint64_t)h->nodes_off + (uint64_t)h->node_count * sizeof(MountIndexNode);
+    uint64_t strings_end = (uint64_t)h->strings_off + h->strings_len;
+
+    if (memcmp(h->magic, MOUNT_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != MOUNT_INDEX_VERSION || h->node_count == 0 ||
+        h->nodes_off % _Alignof(MountIndexNode) != 0 || nodes_end > m->size ||
+        strings_end > m->size || h->strings_len == 0 ||
+        ((const char *)m->map)[strings_end - 1] != '\0') {
+        fprintf(stderr, "Error: %s is not a valid mount index (version %u expected)\n", path,
+                MOUNT_INDEX_VERSION);
+        munmap(m->map, m->size);
+        m->map = NULL;
+        return -1;
+    }
+
+    m->nodes = (const MountIndexNode *)((const char *)m->map + h->nodes_off);
+    m->count = h->node_count;
+    m->strings = (const char *)m->map + h->strings_off;
+    m->strings_len = h->strings_len;
+    return 0;
+}
+
+static void index_close(IndexMap *m) {
+    if (m->map)
+        munmap(m->map, m->size);
+    m->map = NULL;
+}
+
+static const char *index_str(const IndexMap *m, uint32_t off) {
+    return off < m->strings_len ? m->strings + off : "";
+}
+
+static const MountIndexNode *index_child(const IndexMap *m, const MountIndexNode *n,
+                                         const char *name, size_t len) {
+    uint64_t lo = n->first_child, hi = (uint64_t)n->first_child + n->child_count;
+
+    if (hi > m->count)
+        return NULL;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const char *s = index_str(m, m->nodes[mid].name);
+        int c = strncmp(s, name, len);
+        if (c == 0 && s[len] != '\0')
+            c = 1;
+        if (c == 0)
+            return &m->nodes[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static const MountIndexNode *index_lookup(const IndexMap *m, const char *path) {
+    const MountIndexNode *n = &m->nodes[0];
+    const char *p = path;
+
+    while (n && *p) {
+        while (*p == '/')
+            ++p;
+        size_t len = strcspn(p, "/");
+        if (len == 0)
+            break;
+        if (!(len == 1 && p[0] == '.'))
+            n = index_child(m, n, p, len);
+        p += len;
+    }
+    return n;
+}
+
+static const char *index_type_str(uint8_t type) {
+    switch (type) {
+    case NFT_REGULAR:
+        return "file";
+    case NFT_DIRECTORY:
+        return "dir";
+    case NFT_SYMLINK:
+        return "symlink";
+    case NFT_WHITEOUT:
+        return "whiteout";
+    default:
+        return "unknown";
+    }
+}
+
+static void index_print_flags(uint8_t flags) {
+    if (flags & MOUNT_INDEX_REPLACE)
+        printf(" replace");
+    if (flags & MOUNT_INDEX_SKIPPED)
+        printf(" skipped");
+}
+
+int mount_index_which(const char *index_path, const char *path) {
+    IndexMap m;
+    if (index_open(index_path, &m) != 0)
+        return -1;
+
+    int ret = 1;
+    const MountIndexNode *n = index_lookup(&m, path);
+
+    if (!n) {
+        printf("%s: not provided by any module\n", path);
+    } else if (n->module == 0) {
+        printf("%s: %s, stock (no module provides it, children may)\n", path,
+               index_type_str(n->type));
+    } else {
+        printf("%s: %s from module %s", path, index_type_str(n->type), index_str(&m, n->module));
+        index_print_flags(n->flags);
+        printf("\n  source: %s\n", index_str(&m, n->source));
+        ret = 0;
+    }
+
+    index_close(&m);
+    return ret;
+}
+
+int mount_index_ls(const char *index_path, const char *dir) {
+    IndexMap m;
+    if (index_open(index_path, &m) != 0)
+        return -1;
+
+    const MountIndexNode *n = index_lookup(&m, dir);
+    if (!n || n->type != NFT_DIRECTORY) {
+        printf("%s: not a directory in the mount index\n", dir);
+        index_close(&m);
+        return 1;
+    }
+
+    uint64_t end = (uint64_t)n->first_child + n->child_count;
+    for (uint64_t i = n->first_child; i < end && i < m.count; ++i) {
+        const MountIndexNode *c = &m.nodes[i];
+        const char *mod = index_str(&m, c->module);
+
+        printf("%-8s %-32s %s", index_type_str(c->type), index_str(&m, c->name),
+               *mod ? mod : "-");
+        index_print_flags(c->flags);
+        printf("\n");
+    }
+
+    index_close(&m);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef MOUNT_INDEX_H
+#define MOUNT_INDEX_H
+
+#include "module_tree.h"
+#include <stdint.h>
+
+#define MOUNT_INDEX_MAGIC "MMIX"
+#define MOUNT_INDEX_VERSION 1
+
+/* MountIndexNode.flags */
+#define MOUNT_INDEX_REPLACE 0x01 /* opaque directory */
+#define MOUNT_INDEX_SKIPPED 0x02 /* could not be mounted */
+
+/* File layout: header, node array, string table. Node 0 is the root; the
+ * children of a node are contiguous and sorted by name. All fields are
+ * host endian, strings are offsets into the NUL terminated string table.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t nodes_off;
+    uint32_t strings_off;
+    uint32_t strings_len;
+} MountIndexHeader;
+
+typedef struct {
+    uint32_t name;
+    uint32_t module; /* 0 (empty string) when no module provides the node */
+    uint32_t source; /* module_path, 0 if none */
+    uint32_t first_child;
+    uint32_t child_count;
+    uint8_t type; /* NodeFileType */
+    uint8_t flags;
+    uint16_t reserved;
+} MountIndexNode;
+
+/* Write the final mount tree to path (atomically replaced) */
+int mount_index_write(const MagicMount *ctx, const Node *root, const char *path);
+
+/* Query mode, output on stdout: 0 found, 1 not in the index, -1 error */
+int mount_index_which(const char *index_path, const char *path);
+int mount_index_ls(const char *index_path, const char *dir);
+
+#endif /* MOUNT_INDEX_H */
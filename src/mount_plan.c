@@ -0,0 +1,423 @@
+#include "mount_plan.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* What one step of the apply pass costs: the mounts it leaves behind, its
+ * syscalls (legacy, new mount API) and the tmpfs entries it creates. Rough
+ * counts read off magic_mount.c, they only have to rank the strategies.
+ */
+typedef struct {
+    int mounts;
+    int syscalls[2];
+    int inodes;
+} PlanOp;
+
+/* Module file onto its real counterpart, try-umount registration included */
+static const PlanOp OP_FILE_REAL = {1, {3, 5}, 0};
+/* Module file into a tmpfs: parent check, create, bind */
+static const PlanOp OP_FILE_TMPFS = {1, {5, 6}, 1};
+/* Module file onto a file of a real dir bound into a tmpfs */
+static const PlanOp OP_FILE_BOUND = {1, {2, 3}, 0};
+/* Module symlink into a tmpfs: readlink, symlink, label */
+static const PlanOp OP_SYMLINK = {0, {4, 4}, 1};
+/* Real entries mirrored into a tmpfs (submounts of a bound dir not counted) */
+static const PlanOp OP_MIRROR_FILE = {1, {4, 6}, 1};
+static const PlanOp OP_MIRROR_DIR = {1, {3, 5}, 1};
+static const PlanOp OP_MIRROR_LINK = {0, {5, 5}, 1};
+/* Directory rebuilt in a tmpfs: mkdir_p, stat, chmod, chown, label */
+static const PlanOp OP_DIR_REBUILD = {0, {6, 6}, 1};
+/* Opening the real dir again to mirror its entries; the listing is the plan's */
+static const PlanOp OP_DIR_LIST = {0, {2, 2}, 0};
+/* Extra for a tmpfs of its own: seal, move into place, try-umount */
+static const PlanOp OP_DIR_TMPFS = {1, {5, 8}, 0};
+/* Real dir bound whole into a tmpfs: mountpoint and recursive bind */
+static const PlanOp OP_DIR_BIND = {1, {2, 4}, 1};
+
+static void plan_add(MountPlanCost *c, const PlanOp *op, bool new_api) {
+    c->mounts += op->mounts;
+    c->syscalls += op->syscalls[new_api];
+    c->inodes += op->inodes;
+}
+
+static void plan_sum(MountPlanCost *c, const MountPlanCost *d) {
+    c->mounts += d->mounts;
+    c->syscalls += d->syscalls;
+    c->inodes += d->inodes;
+    c->tmpfs_roots += d->tmpfs_roots;
+    c->bound_dirs += d->bound_dirs;
+}
+
+/* Mounts first: each one is copied into every namespace zygote unshares
+ * for an app and walked by every mountinfo reader
+ */
+static bool plan_cheaper(const MountPlanCost *a, const MountPlanCost *b) {
+    if (a->mounts != b->mounts)
+        return a->mounts < b->mounts;
+    if (a->syscalls != b->syscalls)
+        return a->syscalls < b->syscalls;
+    return a->inodes < b->inodes;
+}
+
+/* One frame per directory node, costs are those of its children */
+typedef struct {
+    Node *node;
+    size_t saved;          /* path length to restore on pop */
+    size_t next;           /* next child to plan */
+    bool need;             /* some child cannot be mounted onto the real dir */
+    bool bindable;         /* real dir whose whole subtree mounts onto it */
+    MountPlanCost direct;  /* mounted onto the real dir */
+    MountPlanCost bound;   /* the same, inside a real dir bound into a tmpfs */
+    MountPlanCost rebuild; /* rebuilt in a tmpfs, real entries mirrored */
+} PlanFrame;
+
+/* A directory as plan_push met it, in walk order; depth tells its parent */
+typedef struct {
+    PlanListing l;
+    size_t depth;
+} PlanSeen;
+
+typedef struct {
+    bool new_api;
+    PathBuf path;
+    PlanFrame *frames;
+    size_t depth;
+    size_t cap;
+    PlanSeen *seen;
+    size_t seen_count;
+    size_t seen_cap;
+} Planner;
+
+/* Type of a real entry, -1 if it cannot be told */
+static int plan_real_type(const DirSnap *s, const struct linux_dirent64 *de) {
+    switch (de->d_type) {
+    case DT_REG:
+        return NFT_REGULAR;
+    case DT_DIR:
+        return NFT_DIRECTORY;
+    case DT_LNK:
+        return NFT_SYMLINK;
+    case DT_UNKNOWN: {
+        struct stat st;
+        if (fstatat(s->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            return -1;
+        return node_type_from_stat(&st);
+    }
+    default:
+        /* node_type_from_stat maps every other type to a whiteout */
+        return NFT_WHITEOUT;
+    }
+}
+
+/* Uses the real types recorded by plan_dir_scan; path holds the directory of
+ * node and only grows to resolve what a symlink whiteout would hide
+ */
+static bool plan_need_tmpfs(Node *node, PathBuf *path) {
+    Node *const *kids = node_children(node);
+
+    for (size_t i = 0; i < node->child_count; ++i) {
+        Node *c = kids[i];
+        int rt = (int)c->real - 1; /* -1: no real entry */
+        bool need = false;
+
+        LOGD("checking child: parent=%s, child=%s, real_type=%d", path->buf, c->name, rt);
+
+        if (c->type == NFT_SYMLINK) {
+            need = true;
+            LOGD("child %s is SYMLINK", c->name);
+        } else if (c->type == NFT_WHITEOUT) {
+            need = rt >= 0;
+            if (rt == NFT_SYMLINK) {
+                size_t saved;
+                if (path_buf_push(path, c->name, &saved) == 0) {
+                    need = path_exists(path->buf);
+                    path_buf_pop(path, saved);
+                }
+            }
+            LOGD("child %s is WHITEOUT, path_exists=%d, need=%d", c->name, need, need);
+        } else if (rt < 0) {
+            LOGD("no real entry for child %s of %s", c->name, path->buf);
+            need = true;
+        } else {
+            LOGD("type mismatch check: %s in %s - expected=%d, actual=%d, is_symlink=%d", c->name,
+                 path->buf, c->type, rt, rt == NFT_SYMLINK ? 1 : 0);
+            if (rt != c->type || rt == NFT_SYMLINK)
+                need = true;
+        }
+
+        LOGD("child check: parent=%s, child=%s, type=%d, need=%d, has_module_path=%d", path->buf,
+             c->name, c->type, need, node->origin ? 1 : 0);
+
+        if (need) {
+            if (!node->origin) {
+                LOGE("cannot create tmpfs on %s (%s) - child type: %d, target exists: %d",
+                     path->buf, c->name, c->type, rt >= 0 ? 1 : 0);
+                c->skip = true;
+                continue;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/* List the real directory of f once: record the real types on its children,
+ * cost the mirroring of the entries no child covers and find out whether f
+ * can be mounted onto the real dir at all. The entries go to l.
+ */
+static void plan_dir_scan(Planner *p, PlanFrame *f, PlanListing *l) {
+    Node *node = f->node;
+    const struct linux_dirent64 *de;
+    DirSnap s;
+
+    /* A replace dir that can have a tmpfs gets one, nothing real shows */
+    if (node->replace && node->origin) {
+        f->need = true;
+        return;
+    }
+
+    /* A failure is reported by the apply pass, which tries again */
+    if (dir_snap_read(&s, p->path.buf) != 0) {
+        l->absent = errno == ENOENT;
+    } else {
+        while ((de = dir_snap_next(&s))) {
+            int rt = plan_real_type(&s, de);
+            Node *c = node_child_find(node, de->d_name);
+
+            if (c) {
+                if (rt >= 0)
+                    c->real = (unsigned)rt + 1;
+            } else if (rt == NFT_REGULAR) {
+                plan_add(&f->rebuild, &OP_MIRROR_FILE, p->new_api);
+            } else if (rt == NFT_DIRECTORY) {
+                plan_add(&f->rebuild, &OP_MIRROR_DIR, p->new_api);
+            } else if (rt == NFT_SYMLINK) {
+                plan_add(&f->rebuild, &OP_MIRROR_LINK, p->new_api);
+            }
+        }
+        /* The fd is not kept, there is one per directory */
+        l->buf = s.buf;
+        l->len = s.len;
+        s.buf = NULL;
+        dir_snap_release(&s);
+        plan_add(&f->rebuild, &OP_DIR_LIST, p->new_api);
+    }
+
+    f->need = plan_need_tmpfs(node, &p->path);
+    f->bindable = !f->need && !node->replace && node->real == NFT_DIRECTORY + 1;
+}
+
+static int plan_push(Planner *p, Node *node, size_t saved) {
+    if (p->depth == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 16;
+        PlanFrame *arr = realloc(p->frames, cap * sizeof(*arr));
+        if (!arr) {
+            LOGE("plan: failed to grow stack for %s", p->path.buf);
+            return -1;
+        }
+        p->frames = arr;
+        p->cap = cap;
+    }
+
+    if (p->seen_count == p->seen_cap) {
+        size_t cap = p->seen_cap ? p->seen_cap * 2 : 64;
+        PlanSeen *arr = realloc(p->seen, cap * sizeof(*arr));
+        if (!arr) {
+            LOGE("plan: failed to grow listings for %s", p->path.buf);
+            return -1;
+        }
+        p->seen = arr;
+        p->seen_cap = cap;
+    }
+
+    PlanSeen *seen = &p->seen[p->seen_count++];
+    *seen = (PlanSeen){.l.node = node, .depth = p->depth};
+
+    PlanFrame *f = &p->frames[p->depth++];
+    *f = (PlanFrame){.node = node, .saved = saved};
+    plan_dir_scan(p, f, &seen->l);
+    return 0;
+}
+
+/* Pick both plans of the finished directory d (at p->path) and add the
+ * chosen costs to its parent pf
+ */
+static void plan_decide(Planner *p, const PlanFrame *d, PlanFrame *pf) {
+    Node *node = d->node;
+    MountPlanCost tmpfs = d->rebuild, rebuild = d->rebuild, bind = d->bound;
+
+    /* Outside a tmpfs: onto the real dir, or rebuilt on a tmpfs of its own */
+    plan_add(&tmpfs, &OP_DIR_REBUILD, p->new_api);
+    plan_add(&tmpfs, &OP_DIR_TMPFS, p->new_api);
+    tmpfs.tmpfs_roots++;
+    node->own_tmpfs = node->origin && (d->need || plan_cheaper(&tmpfs, &d->direct));
+
+    /* Inside one: rebuilt there, or the real dir bound whole */
+    plan_add(&rebuild, &OP_DIR_REBUILD, p->new_api);
+    plan_add(&bind, &OP_DIR_BIND, p->new_api);
+    bind.bound_dirs++;
+    node->bind_real = d->bindable && plan_cheaper(&bind, &rebuild);
+
+    LOGD("plan %s: direct %ld%s, tmpfs %ld -> %s; in a tmpfs: rebuild %ld, bind %ld%s -> %s",
+         p->path.buf, d->direct.mounts, d->need ? " (no)" : "", tmpfs.mounts,
+         node->own_tmpfs ? "tmpfs" : "direct", rebuild.mounts, bind.mounts,
+         d->bindable ? "" : " (no)", node->bind_real ? "bind" : "rebuild");
+
+    plan_sum(&pf->direct, node->own_tmpfs ? &tmpfs : &d->direct);
+    plan_sum(&pf->rebuild, node->bind_real ? &bind : &rebuild);
+    plan_sum(&pf->bound, &d->bound);
+    if (!d->bindable)
+        pf->bindable = false;
+}
+
+/* Add the cost of the non-directory child c of f */
+static void plan_entry(Planner *p, PlanFrame *f, const Node *c) {
+    switch (c->type) {
+    case NFT_REGULAR:
+        plan_add(&f->direct, &OP_FILE_REAL, p->new_api);
+        plan_add(&f->bound, &OP_FILE_BOUND, p->new_api);
+        plan_add(&f->rebuild, &OP_FILE_TMPFS, p->new_api);
+        break;
+    case NFT_SYMLINK:
+        plan_add(&f->rebuild, &OP_SYMLINK, p->new_api);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Where the apply pass puts a directory, as mm_dir_open decides it */
+enum { PLAN_AT_REAL, PLAN_AT_TMPFS, PLAN_AT_BOUND };
+
+static int plan_listing_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const PlanListing *)a)->node;
+    uintptr_t y = (uintptr_t)((const PlanListing *)b)->node;
+    return (x > y) - (x < y);
+}
+
+/* Keep the listings of the directories the apply pass rebuilds in a tmpfs,
+ * the only ones it lists, and drop the rest. p->seen is in walk order, so a
+ * stack by depth follows where each parent went. Out of memory nothing is
+ * kept and the apply pass lists for itself.
+ */
+static void plan_keep_listings(Planner *p, PlanListings *out) {
+    unsigned char *at = malloc(p->cap);
+    PlanListing *items = malloc(p->seen_count * sizeof(*items));
+    size_t n = 0;
+
+    for (size_t i = 0; i < p->seen_count; ++i) {
+        PlanSeen *s = &p->seen[i];
+        const Node *node = s->l.node;
+
+        if (!at || !items) {
+            free(s->l.buf);
+            s->l.buf = NULL;
+            continue;
+        }
+
+        int up = s->depth ? at[s->depth - 1] : PLAN_AT_REAL;
+        int here;
+
+        if (up == PLAN_AT_REAL)
+            here = node->own_tmpfs ? PLAN_AT_TMPFS : PLAN_AT_REAL;
+        else if (up == PLAN_AT_TMPFS)
+            here = node->bind_real ? PLAN_AT_BOUND : PLAN_AT_TMPFS;
+        else
+            here = PLAN_AT_BOUND;
+        at[s->depth] = (unsigned char)here;
+
+        if (here == PLAN_AT_TMPFS && (s->l.buf || s->l.absent))
+            items[n++] = s->l;
+        else
+            free(s->l.buf);
+        s->l.buf = NULL;
+    }
+
+    free(at);
+    if (n == 0) {
+        free(items);
+        return;
+    }
+    qsort(items, n, sizeof(*items), plan_listing_cmp);
+    out->items = items;
+    out->count = n;
+}
+
+PlanListing *mount_plan_listing(const PlanListings *listings, const Node *node) {
+    PlanListing key = {.node = node};
+
+    if (!listings->count)
+        return NULL;
+    return bsearch(&key, listings->items, listings->count, sizeof(key), plan_listing_cmp);
+}
+
+void mount_plan_listings_free(PlanListings *listings) {
+    for (size_t i = 0; i < listings->count; ++i)
+        free(listings->items[i].buf);
+    free(listings->items);
+    listings->items = NULL;
+    listings->count = 0;
+}
+
+int mount_plan_build(Node *root, bool new_api, MountPlanCost *total, PlanListings *listings) {
+    Planner p = {.new_api = new_api};
+    size_t saved;
+    int rc = -1;
+
+    memset(total, 0, sizeof(*total));
+    *listings = (PlanListings){0};
+
+    /* Same paths as the apply pass */
+    if (path_buf_set(&p.path, "/") != 0 || path_buf_push(&p.path, root->name, &saved) != 0 ||
+        plan_push(&p, root, saved) != 0)
+        goto out;
+
+    while (p.depth > 0) {
+        PlanFrame *f = &p.frames[p.depth - 1];
+        Node *node = f->node;
+
+        if (f->next < node->child_count) {
+            Node *c = node_children(node)[f->next++];
+
+            /* done: already mounted by the overlay backend */
+            if (c->skip || c->done)
+                continue;
+            if (c->type != NFT_DIRECTORY) {
+                plan_entry(&p, f, c);
+                continue;
+            }
+            if (path_buf_push(&p.path, c->name, &saved) != 0) {
+                LOGE("plan: path too long below %s", p.path.buf);
+                goto out;
+            }
+            if (plan_push(&p, c, saved) != 0)
+                goto out;
+            continue;
+        }
+
+        /* The root stays on the real tree */
+        if (p.depth == 1) {
+            *total = f->direct;
+            plan_keep_listings(&p, listings);
+            rc = 0;
+            break;
+        }
+
+        PlanFrame d = *f;
+        p.depth--;
+        plan_decide(&p, &d, &p.frames[p.depth - 1]);
+        path_buf_pop(&p.path, d.saved);
+    }
+
+out:
+    for (size_t i = 0; i < p.seen_count; ++i)
+        free(p.seen[i].l.buf);
+    free(p.seen);
+    free(p.frames);
+    return rc;
+}
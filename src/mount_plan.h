@@ -0,0 +1,43 @@
+#ifndef MOUNT_PLAN_H
+#define MOUNT_PLAN_H
+
+#include "module_tree.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The real listing of a directory the apply pass rebuilds in a tmpfs, read
+ * by the planner and handed over so the directory is listed only once
+ */
+typedef struct {
+    const Node *node;
+    char *buf; /* linux_dirent64 records, NULL once taken */
+    size_t len;
+    bool absent; /* no real dir */
+} PlanListing;
+
+/* Sorted by node */
+typedef struct {
+    PlanListing *items;
+    size_t count;
+} PlanListings;
+
+/* Choose how every directory of the tree is mounted. Each one is costed
+ * for both places the apply pass can reach it from:
+ *  - outside a tmpfs: module entries bound onto the real dir one by one, or
+ *    the dir rebuilt on a tmpfs of its own (Node.own_tmpfs)
+ *  - inside a tmpfs: rebuilt with its real entries mirrored, or the real dir
+ *    bound whole and the module entries bound onto it (Node.bind_real)
+ * and the cheapest legal choice wins: fewest mounts, then syscalls, then
+ * tmpfs inodes. Lists every real directory of the tree once, records
+ * Node.real and skips children that cannot be mounted. The predicted
+ * totals go to *total, the listings of the directories that end up in a
+ * tmpfs to *listings.
+ */
+int mount_plan_build(Node *root, bool new_api, MountPlanCost *total, PlanListings *listings);
+
+/* Listing kept for node, NULL if none */
+PlanListing *mount_plan_listing(const PlanListings *listings, const Node *node);
+
+void mount_plan_listings_free(PlanListings *listings);
+
+#endif /* MOUNT_PLAN_H */
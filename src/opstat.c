@@ -0,0 +1,199 @@
+#include "opstat.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+
+bool g_opstat_on;
+
+static struct {
+    atomic_ullong count;
+    atomic_ullong ns;
+    atomic_ullong buckets[OPSTAT_BUCKETS];
+} g_ops[OP_KIND_COUNT];
+
+static const char *const op_names[OP_KIND_COUNT] = {
+    [OP_MOUNT] = "mount",
+    [OP_UMOUNT] = "umount",
+    [OP_MOUNT_API] = "mount_api",
+    [OP_MKDIR] = "mkdir",
+    [OP_RMDIR] = "rmdir",
+    [OP_CREATE] = "create",
+    [OP_SYMLINK] = "symlink",
+    [OP_CHMOD] = "chmod",
+    [OP_CHOWN] = "chown",
+    [OP_SETXATTR] = "lsetxattr",
+    [OP_GETXATTR] = "lgetxattr",
+    [OP_STAT] = "stat",
+    [OP_OPEN] = "open",
+    [OP_GETDENTS] = "getdents",
+    [OP_READLINK] = "readlink",
+    [OP_URING] = "io_uring",
+    [OP_TRY_UMOUNT] = "try_umount",
+};
+
+void opstat_record(OpKind kind, uint64_t start) {
+    int saved = errno;
+    uint64_t ns = monotonic_ns() - start;
+    int b = 0;
+
+    for (uint64_t v = ns >> 1; v && b < OPSTAT_BUCKETS - 1; v >>= 1)
+        ++b;
+
+    atomic_fetch_add_explicit(&g_ops[kind].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_ops[kind].ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_ops[kind].buckets[b], 1, memory_order_relaxed);
+    errno = saved;
+}
+
+const char *opstat_name(OpKind kind) {
+    return kind >= 0 && kind < OP_KIND_COUNT ? op_names[kind] : "?";
+}
+
+void opstat_get(OpKind kind, OpStat *out) {
+    out->count = atomic_load(&g_ops[kind].count);
+    out->ns = atomic_load(&g_ops[kind].ns);
+    for (int i = 0; i < OPSTAT_BUCKETS; ++i)
+        out->buckets[i] = atomic_load(&g_ops[kind].buckets[i]);
+}
+
+uint64_t opstat_quantile(const OpStat *s, double q) {
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < OPSTAT_BUCKETS; ++i)
+        total += s->buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * (double)total);
+    if (rank >= total)
+        rank = total - 1;
+    for (int i = 0; i < OPSTAT_BUCKETS; ++i) {
+        seen += s->buckets[i];
+        if (seen > rank)
+            return (uint64_t)1 << (i + 1);
+    }
+    return (uint64_t)1 << OPSTAT_BUCKETS;
+}
+
+/* --- Counting FsOps --- */
+
+static const FsOps *g_inner;
+
+/* Count the call begun at t that returned r */
+static int op_done(OpKind kind, uint64_t t, int r) {
+    opstat_record(kind, t);
+    return r;
+}
+
+static int op_mount(const char *src, const char *dst, const char *type, unsigned long flags,
+                    const void *data) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MOUNT, t, g_inner->mount(src, dst, type, flags, data));
+}
+
+static int op_umount2(const char *path, int flags) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_UMOUNT, t, g_inner->umount2(path, flags));
+}
+
+static int op_mkdir(const char *path, mode_t mode) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MKDIR, t, g_inner->mkdir(path, mode));
+}
+
+static int op_rmdir(const char *path) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_RMDIR, t, g_inner->rmdir(path));
+}
+
+static int op_create(const char *path, mode_t mode) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_CREATE, t, g_inner->create(path, mode));
+}
+
+static int op_symlink(const char *target, const char *path) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_SYMLINK, t, g_inner->symlink(target, path));
+}
+
+static int op_chmod(const char *path, mode_t mode) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_CHMOD, t, g_inner->chmod(path, mode));
+}
+
+static int op_chown(const char *path, uid_t uid, gid_t gid) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_CHOWN, t, g_inner->chown(path, uid, gid));
+}
+
+static int op_lsetxattr(const char *path, const char *name, const void *value, size_t size,
+                        int flags) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_SETXATTR, t, g_inner->lsetxattr(path, name, value, size, flags));
+}
+
+static int op_stat(const char *path, struct stat *st) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_STAT, t, g_inner->stat(path, st));
+}
+
+static bool op_tree_supported(void) {
+    return g_inner->tree_supported();
+}
+
+static int op_tree_tmpfs(const char *source) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MOUNT_API, t, g_inner->tree_tmpfs(source));
+}
+
+static int op_tree_bind(const char *src, const char *dst, unsigned int flags) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MOUNT_API, t, g_inner->tree_bind(src, dst, flags));
+}
+
+static int op_tree_seal(int fd) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MOUNT_API, t, g_inner->tree_seal(fd));
+}
+
+static int op_tree_attach(int fd, const char *path) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_MOUNT_API, t, g_inner->tree_attach(fd, path));
+}
+
+static void op_tree_close(int fd) {
+    g_inner->tree_close(fd);
+}
+
+static int op_try_umount(const char *path) {
+    uint64_t t = monotonic_ns();
+    return op_done(OP_TRY_UMOUNT, t, g_inner->try_umount(path));
+}
+
+/* Named after the table it forwards to */
+static FsOps g_counting = {
+    .mount = op_mount,
+    .umount2 = op_umount2,
+    .mkdir = op_mkdir,
+    .rmdir = op_rmdir,
+    .create = op_create,
+    .symlink = op_symlink,
+    .chmod = op_chmod,
+    .chown = op_chown,
+    .lsetxattr = op_lsetxattr,
+    .stat = op_stat,
+    .tree_supported = op_tree_supported,
+    .tree_tmpfs = op_tree_tmpfs,
+    .tree_bind = op_tree_bind,
+    .tree_seal = op_tree_seal,
+    .tree_attach = op_tree_attach,
+    .tree_close = op_tree_close,
+    .try_umount = op_try_umount,
+};
+
+const FsOps *opstat_start(const FsOps *inner) {
+    g_inner = inner;
+    g_counting.name = inner->name;
+    g_opstat_on = true;
+    return &g_counting;
+}
@@ -0,0 +1,75 @@
+#ifndef OPSTAT_H
+#define OPSTAT_H
+
+#include "fs_ops.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Call counts and latency histograms per kind of filesystem call
+ * (--op-stats). Calls through g_fs_ops are counted by a forwarding table,
+ * the reads of the scan, apply and label helpers by probes around the call.
+ * Off, a probe is one branch on g_opstat_on; on, two clock reads and a few
+ * relaxed atomic adds.
+ */
+typedef enum {
+    OP_MOUNT, /* mount(2): binds, remounts, MS_MOVE */
+    OP_UMOUNT,
+    OP_MOUNT_API, /* open_tree, fsmount, move_mount, ... */
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_CREATE,
+    OP_SYMLINK,
+    OP_CHMOD,
+    OP_CHOWN,
+    OP_SETXATTR,
+    OP_GETXATTR,
+    OP_STAT, /* stat, lstat, fstat, fstatat */
+    OP_OPEN,
+    OP_GETDENTS,
+    OP_READLINK,
+    OP_URING, /* one io_uring batch of the scan */
+    OP_TRY_UMOUNT,
+    OP_KIND_COUNT,
+} OpKind;
+
+/* Bucket i counts calls that took [2^i, 2^(i + 1)) ns, the last one all
+ * that took longer
+ */
+#define OPSTAT_BUCKETS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t ns;
+    uint64_t buckets[OPSTAT_BUCKETS];
+} OpStat;
+
+extern bool g_opstat_on;
+
+/* Turn counting on and return the table to install that counts calls to
+ * inner; call before any other thread runs
+ */
+const FsOps *opstat_start(const FsOps *inner);
+
+void opstat_record(OpKind kind, uint64_t start);
+
+/* Start of a probed call, 0 when counting is off */
+static inline uint64_t opstat_begin(void) {
+    return g_opstat_on ? monotonic_ns() : 0;
+}
+
+/* Count the call begun at start; keeps errno */
+static inline void opstat_end(OpKind kind, uint64_t start) {
+    if (start)
+        opstat_record(kind, start);
+}
+
+const char *opstat_name(OpKind kind);
+
+/* Snapshot of the counters of kind */
+void opstat_get(OpKind kind, OpStat *out);
+
+/* Upper bound of the bucket holding quantile q (0..1) of the calls, 0 if none */
+uint64_t opstat_quantile(const OpStat *s, double q);
+
+#endif /* OPSTAT_H */
@@ -0,0 +1,308 @@
+#include "overlay.h"
+#include "fs_ops.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* mount(2) passes the options in one page */
+#define OVL_OPTS_MAX 4096
+
+/* A node with its depth below the partition root; for a layer, the first
+ * node of that module met in the walk, which leads back to its directory
+ */
+typedef struct {
+    const Node *node;
+    unsigned depth;
+} OvlRef;
+
+typedef struct {
+    const Node *node;
+    size_t next;
+    size_t saved;
+} OvlFrame;
+
+/* Overlay takes a merged directory's owner, mode and label from its top
+ * layer, binds keep those of the real one (if any): they have to agree
+ */
+static bool ovl_same_meta(const char *layer, const struct stat *st, const char *path) {
+    struct stat rst;
+
+    if (stat(path, &rst) != 0)
+        return true;
+    if ((st->st_mode & 07777) != (rst.st_mode & 07777) || st->st_uid != rst.st_uid ||
+        st->st_gid != rst.st_gid)
+        return false;
+
+    /* Cached: the bind fallback copies the real labels again */
+    const char *la = selcon_lookup(layer, st);
+    const char *lb = selcon_lookup(path, &rst);
+    if (!la || !lb)
+        return !la && !lb;
+    return la == lb;
+}
+
+/* Whether c, at path (its real location), shows the same through the overlay
+ * as through binds
+ */
+static bool ovl_node_ok(MagicMount *ctx, const Node *c, const char *path, int *files,
+                        int *whiteouts) {
+    char src[PATH_MAX];
+    struct stat st;
+
+    if (c->skip || c->replace) {
+        /* Opaque dirs only as trusted.* xattrs, which a userxattr overlay ignores */
+        LOGD("overlay: %s is %s", path, c->skip ? "skipped" : "a replace dir");
+        return false;
+    }
+
+    if (node_module_path(ctx, c, src, sizeof(src)) != 0 || lstat(src, &st) != 0) {
+        LOGD("overlay: no module entry for %s", path);
+        return false;
+    }
+
+    switch (c->type) {
+    case NFT_WHITEOUT:
+        if (!S_ISCHR(st.st_mode) || st.st_rdev != makedev(0, 0)) {
+            LOGD("overlay: %s is not an overlay whiteout", src);
+            return false;
+        }
+        (*whiteouts)++;
+        break;
+    case NFT_DIRECTORY:
+        if (!ovl_same_meta(src, &st, path)) {
+            LOGD("overlay: %s differs from %s in owner, mode or label", src, path);
+            return false;
+        }
+        break;
+    default:
+        (*files)++;
+        break;
+    }
+    return true;
+}
+
+/* Walk the tree below part (at path) and record each module's layer. False
+ * if the overlay would show something else than the tree.
+ */
+static bool ovl_tree_ok(MagicMount *ctx, const Node *part, PathBuf *path, OvlRef *layers,
+                        int *files, int *whiteouts) {
+    size_t base = path->len;
+    OvlFrame *frames = malloc(16 * sizeof(*frames));
+    size_t depth = 0, cap = 16;
+    bool ok = true;
+
+    if (!frames)
+        return false;
+    frames[depth++] = (OvlFrame){.node = part, .saved = base};
+
+    while (ok && depth > 0) {
+        OvlFrame *f = &frames[depth - 1];
+
+        if (f->next == f->node->child_count) {
+            path_buf_pop(path, f->saved);
+            depth--;
+            continue;
+        }
+
+        const Node *c = node_children(f->node)[f->next++];
+        size_t saved;
+
+        if (path_buf_push(path, c->name, &saved) != 0) {
+            ok = false;
+            break;
+        }
+
+        ok = ovl_node_ok(ctx, c, path->buf, files, whiteouts);
+        if (ok && !layers[c->module_id].node)
+            layers[c->module_id] = (OvlRef){c, (unsigned)depth};
+
+        if (!ok || c->type != NFT_DIRECTORY) {
+            path_buf_pop(path, saved);
+            continue;
+        }
+
+        if (depth == cap) {
+            OvlFrame *arr = realloc(frames, cap * 2 * sizeof(*arr));
+            if (!arr) {
+                ok = false;
+                break;
+            }
+            frames = arr;
+            cap *= 2;
+        }
+        frames[depth++] = (OvlFrame){.node = c, .saved = saved};
+    }
+
+    path_buf_pop(path, base);
+    free(frames);
+    return ok;
+}
+
+/* Layer directory of a module: the module path of l.node less l.depth names */
+static int ovl_layer_dir(MagicMount *ctx, OvlRef l, char *buf, size_t len) {
+    if (node_module_path(ctx, l.node, buf, len) != 0)
+        return -1;
+
+    for (unsigned i = 0; i < l.depth; ++i) {
+        char *s = strrchr(buf, '/');
+        if (!s || s == buf)
+            return -1;
+        *s = '\0';
+    }
+    return 0;
+}
+
+/* Whether anything is mounted below path: the overlay would cover it */
+static bool ovl_has_submounts(const char *path) {
+    FILE *fp = fopen("/proc/self/mountinfo", "re");
+    char line[PATH_MAX + 256];
+    size_t len = strlen(path);
+    bool found = false;
+
+    if (!fp) {
+        LOGW("overlay: cannot read mountinfo: %s", strerror(errno));
+        return true;
+    }
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        /* Mount point is the 5th field */
+        char *p = line;
+        for (int i = 0; i < 4 && p; ++i) {
+            p = strchr(p, ' ');
+            if (p)
+                p++;
+        }
+        if (p && !strncmp(p, path, len) && p[len] == '/')
+            found = true;
+    }
+
+    fclose(fp);
+    return found;
+}
+
+/* Build the lowerdir option for part: one layer per module, in priority
+ * order, over the real dir. Other partitions of root must not show up in a
+ * layer (a /system layer may hold the vendor dir promoted to /vendor).
+ */
+static int ovl_options(MagicMount *ctx, const Node *root, const Node *part, const char *path,
+                       const OvlRef *layers, char *opts, size_t len) {
+    Node *const *parts = node_children(root);
+    size_t used = (size_t)snprintf(opts, len, "userxattr,lowerdir=");
+    bool top = true;
+    char dir[PATH_MAX];
+    struct stat st;
+
+    for (size_t id = 1; id <= ctx->catalog.count && used < len; ++id) {
+        if (!layers[id].node)
+            continue;
+
+        if (ovl_layer_dir(ctx, layers[id], dir, sizeof(dir)) != 0)
+            return -1;
+
+        if (strpbrk(dir, ":,\\")) {
+            LOGD("overlay: layer %s needs escaping", dir);
+            return -1;
+        }
+
+        /* The partition root itself is a merged dir too */
+        if (top && (lstat(dir, &st) != 0 || !ovl_same_meta(dir, &st, path))) {
+            LOGD("overlay: %s differs from %s in owner, mode or label", dir, path);
+            return -1;
+        }
+        top = false;
+
+        for (size_t i = 0; i < root->child_count; ++i) {
+            char other[PATH_MAX];
+            if (parts[i] != part && path_join(dir, parts[i]->name, other, sizeof(other)) == 0 &&
+                access(other, F_OK) == 0) {
+                LOGD("overlay: layer %s also holds partition %s", dir, parts[i]->name);
+                return -1;
+            }
+        }
+
+        used += (size_t)snprintf(opts + used, len - used, "%s:", dir);
+    }
+
+    if (top)
+        return -1;
+    if (used < len)
+        used += (size_t)snprintf(opts + used, len - used, "%s", path);
+    if (used >= len) {
+        LOGD("overlay: options for %s exceed %zu bytes", path, len);
+        return -1;
+    }
+    return 0;
+}
+
+static int ovl_mount_partition(MagicMount *ctx, const Node *root, Node *part) {
+    PathBuf path;
+    size_t saved;
+    int files = 0, whiteouts = 0, ret = -1;
+
+    if (path_buf_set(&path, "/") != 0 || path_buf_push(&path, part->name, &saved) != 0)
+        return -1;
+
+    OvlRef *layers = calloc(ctx->catalog.count + 1, sizeof(*layers));
+    char *opts = malloc(OVL_OPTS_MAX);
+    if (!layers || !opts) {
+        LOGE("overlay: out of memory for %s", path.buf);
+        goto out;
+    }
+
+    if (ovl_has_submounts(path.buf)) {
+        LOGI("overlay: %s has mounts below it, using binds", path.buf);
+        goto out;
+    }
+
+    if (!ovl_tree_ok(ctx, part, &path, layers, &files, &whiteouts) ||
+        ovl_options(ctx, root, part, path.buf, layers, opts, OVL_OPTS_MAX) != 0) {
+        LOGI("overlay: layout of %s needs binds", path.buf);
+        goto out;
+    }
+
+    LOGD("overlay %s: %s", path.buf, opts);
+
+    if (g_fs_ops->mount(ctx->mount_source, path.buf, "overlay", MS_RDONLY, opts) < 0) {
+        LOGW("overlay %s: %s, using binds", path.buf, strerror(errno));
+        goto out;
+    }
+
+    (void)g_fs_ops->mount(NULL, path.buf, NULL, MS_REC | MS_PRIVATE, NULL);
+    LOGI("overlay mounted: %s (%d files, %d whiteouts)", path.buf, files, whiteouts);
+
+    magic_mount_queue_umount(ctx, path.buf);
+
+    ctx->stats.nodes_mounted += files;
+    ctx->stats.nodes_whiteout += whiteouts;
+    ret = 0;
+
+out:
+    free(layers);
+    free(opts);
+    return ret;
+}
+
+int overlay_mount_partitions(MagicMount *ctx, Node *root) {
+    Node *const *parts = node_children(root);
+    int mounted = 0;
+
+    for (size_t i = 0; i < root->child_count; ++i) {
+        Node *part = parts[i];
+
+        if (part->type != NFT_DIRECTORY || part->skip)
+            continue;
+
+        if (ovl_mount_partition(ctx, root, part) == 0) {
+            part->done = true;
+            mounted++;
+        }
+    }
+    return mounted;
+}
@@ -0,0 +1,14 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "module_tree.h"
+
+/* Overlay backend: each partition root of the tree (a child of root) gets one
+ * read-only overlay, lowerdir=<module layers in priority order>:<real dir>,
+ * when that shows exactly what the bind mounts would. Mounted partitions are
+ * marked done and left out of the bind pass; the rest fall back to binds.
+ * Returns how many partitions were mounted.
+ */
+int overlay_mount_partitions(MagicMount *ctx, Node *root);
+
+#endif /* OVERLAY_H */
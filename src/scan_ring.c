@@ -0,0 +1,335 @@
+#include "scan_ring.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+long syscall(long number, ...);
+
+/* Same number on every architecture we build for */
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter 426
+#endif
+#ifndef SYS_io_uring_register
+#define SYS_io_uring_register 427
+#endif
+
+/* Plenty for one getdents64 buffer of subdirectories; larger batches are
+ * submitted in chunks
+ */
+#define SCAN_RING_ENTRIES 64
+
+/* user_data of a queued close */
+#define SCAN_RING_CLOSE_TAG UINT64_MAX
+/* Set in the user_data of an openat, so a drain knows which fds to close */
+#define SCAN_RING_OPEN_TAG (UINT64_C(1) << 62)
+
+struct ScanRing {
+    int fd;
+    unsigned entries;
+    unsigned queued;   /* SQEs written since the last submit */
+    unsigned inflight; /* submitted SQEs not reaped yet */
+    bool broken;
+
+    /* fds of the queued closes, which sit ahead of any other SQE */
+    int closes[SCAN_RING_ENTRIES];
+    unsigned close_count;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_len;
+    void *cq_map; /* sq_map with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_len;
+    size_t sqes_len;
+
+    /* One per SQE of a chunk */
+    struct statx stx[SCAN_RING_ENTRIES];
+};
+
+static bool scan_ring_probe(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = calloc(1, len);
+    bool ok = false;
+
+    if (!p)
+        return false;
+
+    if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256) == 0) {
+        static const unsigned ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE};
+        ok = true;
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+            if (ops[i] > p->last_op || !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                ok = false;
+        }
+    }
+
+    free(p);
+    return ok;
+}
+
+static void scan_ring_unmap(ScanRing *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_len);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_len);
+}
+
+ScanRing *scan_ring_new(void) {
+    struct io_uring_params p;
+    ScanRing *r = calloc(1, sizeof(*r));
+    int err;
+
+    if (!r)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(SYS_io_uring_setup, SCAN_RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    if (!scan_ring_probe(r->fd)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_map =
+        mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map =
+            mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (r->entries > SCAN_RING_ENTRIES)
+        r->entries = SCAN_RING_ENTRIES;
+    return r;
+
+fail:
+    err = errno;
+    scan_ring_unmap(r);
+    close(r->fd);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+/* Next free SQE, zeroed; the caller keeps r->queued below r->entries */
+static struct io_uring_sqe *scan_ring_sqe(ScanRing *r, uint64_t tag) {
+    unsigned idx = (*r->sq_tail + r->queued) & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = tag;
+    r->sq_array[idx] = idx;
+    r->queued++;
+    return sqe;
+}
+
+/* Reap the completions at hand. Those of reqs (tags from base on) get
+ * their results; without reqs, fds opened for a batch that was given up on
+ * are closed.
+ */
+static void scan_ring_reap(ScanRing *r, ScanRingReq *reqs, size_t base) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head, --r->inflight) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        uint64_t tag = cqe->user_data;
+        if (tag == SCAN_RING_CLOSE_TAG)
+            continue;
+
+        if (!reqs) {
+            if ((tag & SCAN_RING_OPEN_TAG) && cqe->res >= 0)
+                close(cqe->res);
+            continue;
+        }
+
+        size_t i = (size_t)(tag & ~SCAN_RING_OPEN_TAG);
+        ScanRingReq *q = &reqs[i];
+        q->res = cqe->res < 0 ? cqe->res : (q->op == SCAN_RING_OPEN ? cqe->res : 0);
+        if (q->op == SCAN_RING_STAT && cqe->res == 0)
+            q->mode = r->stx[i - base].stx_mode;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* io_uring_enter failed: take back the SQEs the kernel has not consumed
+ * (start is the tail before they were published) and close the fds of the
+ * closes among them here. What it did consume is reaped by scan_ring_free.
+ */
+static void scan_ring_break(ScanRing *r, unsigned start) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    r->inflight -= *r->sq_tail - head;
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    for (unsigned i = head - start; i < r->close_count; ++i)
+        close(r->closes[i]);
+    r->close_count = 0;
+    r->broken = true;
+}
+
+/* Submit everything queued and reap all of it. Completions of reqs (tags
+ * from base on) get their results, queued closes are dropped.
+ */
+static int scan_ring_run(ScanRing *r, ScanRingReq *reqs, size_t base) {
+    unsigned n = r->queued, submit = n, start = *r->sq_tail;
+
+    if (n == 0)
+        return 0;
+
+    __atomic_store_n(r->sq_tail, start + n, __ATOMIC_RELEASE);
+    r->queued = 0;
+    r->inflight += n;
+
+    while (r->inflight > 0) {
+        int ret = (int)syscall(SYS_io_uring_enter, r->fd, submit, r->inflight,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGW("io_uring_enter: %s, scanning synchronously", strerror(errno));
+            scan_ring_break(r, start);
+            return -1;
+        }
+        submit -= (unsigned)ret < submit ? (unsigned)ret : submit;
+        scan_ring_reap(r, reqs, base);
+    }
+    r->close_count = 0;
+    return 0;
+}
+
+int scan_ring_batch(ScanRing *r, int dirfd, ScanRingReq *reqs, size_t n) {
+    size_t i = 0;
+
+    for (size_t j = 0; j < n; ++j)
+        reqs[j].res = -ECANCELED;
+    if (r->broken)
+        return -1;
+
+    while (i < n) {
+        /* A queue full of closes goes first */
+        if (r->queued == r->entries && scan_ring_run(r, NULL, 0) != 0)
+            return -1;
+
+        size_t base = i;
+        while (i < n && r->queued < r->entries) {
+            ScanRingReq *q = &reqs[i];
+            struct io_uring_sqe *sqe =
+                scan_ring_sqe(r, q->op == SCAN_RING_OPEN ? i | SCAN_RING_OPEN_TAG : i);
+
+            sqe->fd = dirfd;
+            sqe->addr = (uintptr_t)q->name;
+            if (q->op == SCAN_RING_OPEN) {
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            } else {
+                sqe->opcode = IORING_OP_STATX;
+                sqe->len = STATX_TYPE;
+                sqe->off = (uintptr_t)&r->stx[i - base];
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            }
+            i++;
+        }
+
+        if (scan_ring_run(r, reqs, base) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void scan_ring_close(ScanRing *r, int fd) {
+    if (r->broken || (r->queued == r->entries && scan_ring_run(r, NULL, 0) != 0)) {
+        close(fd);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = scan_ring_sqe(r, SCAN_RING_CLOSE_TAG);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    r->closes[r->close_count++] = fd;
+}
+
+void scan_ring_flush(ScanRing *r) { (void)scan_ring_run(r, NULL, 0); }
+
+void scan_ring_free(ScanRing *r) {
+    if (!r)
+        return;
+
+    scan_ring_flush(r);
+
+    /* After a failed enter the kernel may still hold requests; wait for
+     * them so no fd they open outlives the ring
+     */
+    scan_ring_reap(r, NULL, 0);
+    while (r->inflight > 0 &&
+           (syscall(SYS_io_uring_enter, r->fd, 0, r->inflight, IORING_ENTER_GETEVENTS, NULL,
+                    0) >= 0 ||
+            errno == EINTR))
+        scan_ring_reap(r, NULL, 0);
+
+    scan_ring_unmap(r);
+    close(r->fd);
+    free(r);
+}
@@ -0,0 +1,46 @@
+#ifndef SCAN_RING_H
+#define SCAN_RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* io_uring (5.6+) for the module scan: the openat and statx a directory's
+ * entries need go to the kernel in one submission and run concurrently
+ * instead of one blocking syscall after another; closes are queued and ride
+ * along with the next batch. No liburing, the rings are mapped directly.
+ */
+typedef struct ScanRing ScanRing;
+
+enum {
+    SCAN_RING_OPEN, /* openat(dirfd, name, O_RDONLY | O_DIRECTORY) */
+    SCAN_RING_STAT, /* statx(dirfd, name, AT_SYMLINK_NOFOLLOW) for the file type */
+};
+
+typedef struct {
+    const char *name;
+    size_t key; /* the caller's, not used by the ring */
+    int op;
+    int res;     /* fd or 0 on success, -errno */
+    mode_t mode; /* SCAN_RING_STAT: st_mode */
+} ScanRingReq;
+
+/* NULL (errno set) when this kernel has no io_uring or lacks an opcode */
+ScanRing *scan_ring_new(void);
+
+/* Flushes the queued closes first; after a failure, waits out what the
+ * kernel still holds and closes the fds it opened
+ */
+void scan_ring_free(ScanRing *r);
+
+/* Run every request against dirfd and wait for all of them. Returns -1 if
+ * the ring broke; requests it did not finish have res = -ECANCELED.
+ */
+int scan_ring_batch(ScanRing *r, int dirfd, ScanRingReq *reqs, size_t n);
+
+/* Close fd with the next batch (or right away if the queue is full) */
+void scan_ring_close(ScanRing *r, int fd);
+
+/* Submit the queued closes and wait for them */
+void scan_ring_flush(ScanRing *r);
+
+#endif /* SCAN_RING_H */
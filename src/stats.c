@@ -0,0 +1,190 @@
+#include "stats.h"
+#include "opstat.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const phase_names[PHASE_COUNT] = {
+    [PHASE_CATALOG] = "catalog",
+    [PHASE_SCAN] = "scan",
+    [PHASE_SYMLINKS] = "symlinks",
+    [PHASE_PROMOTE] = "promote",
+    [PHASE_CACHE_SAVE] = "cache_save",
+    [PHASE_PLAN] = "plan",
+    [PHASE_WORKDIR] = "workdir",
+    [PHASE_APPLY] = "apply",
+    [PHASE_UMOUNT] = "umount",
+    [PHASE_WARMUP] = "warmup",
+    [PHASE_FINISH] = "finish",
+};
+
+const char *mount_phase_name(MountPhase phase) {
+    return phase >= 0 && phase < PHASE_COUNT ? phase_names[phase] : "?";
+}
+
+static long long to_us(uint64_t ns) {
+    return (long long)(ns / 1000u);
+}
+
+static uint64_t module_cost_ns(const ModuleCost *mc) {
+    return mc->scan_ns + mc->apply_ns;
+}
+
+static int module_cost_cmp(const void *a, const void *b) {
+    const ModuleCost *x = *(const ModuleCost *const *)a;
+    const ModuleCost *y = *(const ModuleCost *const *)b;
+    uint64_t nx = module_cost_ns(x), ny = module_cost_ns(y);
+
+    if (nx != ny)
+        return nx > ny ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+const ModuleCost **stats_module_ranking(const MagicMount *ctx, size_t *count) {
+    const ModuleCost **arr = NULL;
+
+    *count = 0;
+    if (ctx->module_costs_count > 0)
+        arr = malloc(ctx->module_costs_count * sizeof(*arr));
+    if (!arr)
+        return NULL;
+
+    for (size_t i = 0; i < ctx->module_costs_count; ++i) {
+        if (module_cost_ns(&ctx->module_costs[i]) > 0)
+            arr[(*count)++] = &ctx->module_costs[i];
+    }
+    qsort(arr, *count, sizeof(*arr), module_cost_cmp);
+    return arr;
+}
+
+/* Per kind of call: count, total and the non-empty histogram buckets as
+ * [upper bound in ns, calls]
+ */
+static void stats_emit_ops(FILE *fp) {
+    bool first = true;
+
+    if (!g_opstat_on) {
+        fputs("  \"ops\": null,\n", fp);
+        return;
+    }
+
+    fputs("  \"ops\": {", fp);
+    for (int i = 0; i < OP_KIND_COUNT; ++i) {
+        OpStat os;
+        opstat_get((OpKind)i, &os);
+        if (!os.count)
+            continue;
+
+        fprintf(fp, "%s\n    \"%s\": {\"count\": %llu, \"us\": %lld, \"hist\": [",
+                first ? "" : ",", opstat_name((OpKind)i), (unsigned long long)os.count,
+                to_us(os.ns));
+        first = false;
+
+        bool first_bucket = true;
+        for (int b = 0; b < OPSTAT_BUCKETS; ++b) {
+            if (!os.buckets[b])
+                continue;
+            fprintf(fp, "%s[%llu, %llu]", first_bucket ? "" : ", ",
+                    (unsigned long long)1 << (b + 1), (unsigned long long)os.buckets[b]);
+            first_bucket = false;
+        }
+        fputs("]}", fp);
+    }
+    fputs(first ? "},\n" : "\n  },\n", fp);
+}
+
+static int stats_emit(const MagicMount *ctx, int rc, FILE *fp) {
+    const MountStats *st = &ctx->stats;
+    const MountPlanCost *plan = &st->plan;
+
+    fprintf(fp, "{\n  \"format\": %d,\n  \"version\": ", STATS_FORMAT);
+    json_write_str(fp, VERSION);
+    fprintf(fp, ",\n  \"rc\": %d,\n  \"total_us\": %lld,\n", rc, to_us(st->total_ns));
+
+    fputs("  \"phases_us\": {", fp);
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        fprintf(fp, "%s\n    \"%s\": %lld", i ? "," : "", phase_names[i], to_us(st->phase_ns[i]));
+    fprintf(fp, "\n  },\n  \"tmpfs_setup_us\": %lld,\n", to_us(st->tmpfs_ns));
+
+    fprintf(fp,
+            "  \"counters\": {\n"
+            "    \"modules\": %d,\n"
+            "    \"nodes_total\": %d,\n"
+            "    \"nodes_mounted\": %d,\n"
+            "    \"nodes_skipped\": %d,\n"
+            "    \"nodes_whiteout\": %d,\n"
+            "    \"nodes_fail\": %d,\n"
+            "    \"umounts_sent\": %d,\n"
+            "    \"umounts_covered\": %d\n"
+            "  },\n",
+            st->modules_total, st->nodes_total, st->nodes_mounted, st->nodes_skipped,
+            st->nodes_whiteout, st->nodes_fail, st->umounts_sent, st->umounts_covered);
+
+    fprintf(fp,
+            "  \"plan\": {\n"
+            "    \"mounts\": %ld,\n"
+            "    \"syscalls\": %ld,\n"
+            "    \"inodes\": %ld,\n"
+            "    \"tmpfs_roots\": %d,\n"
+            "    \"bound_dirs\": %d,\n"
+            "    \"overlays\": %d\n"
+            "  },\n",
+            plan->mounts, plan->syscalls, plan->inodes, plan->tmpfs_roots, plan->bound_dirs,
+            plan->overlays);
+
+    if (ctx->warmup.enabled)
+        fprintf(fp, "  \"warmup\": {\"files\": %d, \"left\": %d, \"bytes\": %lld},\n",
+                st->warm_files, st->warm_left, st->warm_bytes);
+    else
+        fputs("  \"warmup\": null,\n", fp);
+
+    stats_emit_ops(fp);
+
+    size_t ranked = 0;
+    const ModuleCost **rank = stats_module_ranking(ctx, &ranked);
+
+    fputs("  \"modules\": [", fp);
+    for (size_t i = 0; i < ranked; ++i) {
+        const ModuleCost *mc = rank[i];
+
+        fputs(i ? ",\n    {\"name\": " : "\n    {\"name\": ", fp);
+        json_write_str(fp, mc->name);
+        fprintf(fp,
+                ", \"us\": %lld, \"scan_us\": %lld, \"apply_us\": %lld, \"nodes\": %d, "
+                "\"binds\": %d, \"tmpfs\": %d, \"mirrors\": %d}",
+                to_us(module_cost_ns(mc)), to_us(mc->scan_ns), to_us(mc->apply_ns), mc->nodes,
+                mc->binds, mc->tmpfs, mc->mirrors);
+    }
+    fputs(ranked ? "\n  ],\n" : "],\n", fp);
+    free(rank);
+
+    fputs("  \"failed_modules\": [", fp);
+    for (int i = 0; i < ctx->failed_modules_count; ++i) {
+        fputs(i ? ", " : "", fp);
+        json_write_str(fp, ctx->failed_modules[i]);
+    }
+    fputs("]\n}\n", fp);
+
+    return ferror(fp) ? -1 : 0;
+}
+
+typedef struct {
+    const MagicMount *ctx;
+    int rc;
+} StatsArg;
+
+static int stats_emit_file(FILE *fp, void *arg) {
+    const StatsArg *sa = arg;
+    return stats_emit(sa->ctx, sa->rc, fp);
+}
+
+int stats_write(const MagicMount *ctx, int rc, const char *path) {
+    StatsArg sa = {.ctx = ctx, .rc = rc};
+    if (write_file_atomic(path, stats_emit_file, &sa) != 0)
+        return -1;
+
+    LOGD("stats: written to %s", path);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "magic_mount.h"
+
+/* Bump when a field of the stats file changes meaning or goes away */
+#define STATS_FORMAT 1
+
+/* Name of a phase in the summary and the stats file */
+const char *mount_phase_name(MountPhase phase);
+
+/* Modules that took any time, most expensive (scan + apply) first. The
+ * array is malloc'd, NULL with *count 0 when there is none or no memory.
+ */
+const ModuleCost **stats_module_ranking(const MagicMount *ctx, size_t *count);
+
+/* Write the timings and counters of a finished run (rc of magic_mount) to
+ * path as one JSON object, atomically replaced. Times are microseconds.
+ */
+int stats_write(const MagicMount *ctx, int rc, const char *path);
+
+#endif /* STATS_H */
@@ -0,0 +1,199 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+long syscall(long number, ...);
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME 7
+#endif
+
+bool g_trace_on;
+
+typedef struct {
+    const char *name;
+    char *module;
+    char *path;
+    uint64_t start;
+    uint64_t ns;
+    int tid;
+} TraceSpan;
+
+typedef struct {
+    const char *name;
+    int tid;
+} TraceThread;
+
+static struct {
+    pthread_mutex_t lock;
+    TraceSpan *spans;
+    size_t count;
+    size_t cap;
+    TraceThread *threads;
+    size_t thread_count;
+} g_trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int trace_tid(void) {
+    return (int)syscall(SYS_gettid);
+}
+
+void trace_start(void) {
+    g_trace_on = true;
+    trace_thread_name("main");
+}
+
+void trace_thread_name(const char *name) {
+    if (!g_trace_on)
+        return;
+
+    int tid = trace_tid();
+    bool named = false;
+
+    pthread_mutex_lock(&g_trace.lock);
+    for (size_t i = 0; i < g_trace.thread_count && !named; ++i)
+        named = g_trace.threads[i].tid == tid;
+
+    if (!named) {
+        size_t n = g_trace.thread_count + 1;
+        TraceThread *arr = realloc(g_trace.threads, n * sizeof(*arr));
+        if (arr) {
+            arr[n - 1] = (TraceThread){.name = name, .tid = tid};
+            g_trace.threads = arr;
+            g_trace.thread_count = n;
+        }
+    }
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+void trace_record(const char *name, uint64_t start, uint64_t end, const char *module,
+                  const char *path) {
+    int saved = errno;
+    TraceSpan sp = {
+        .name = name,
+        .module = module ? strdup(module) : NULL,
+        .path = path ? strdup(path) : NULL,
+        .start = start,
+        .ns = end - start,
+        .tid = trace_tid(),
+    };
+
+    pthread_mutex_lock(&g_trace.lock);
+    if (g_trace.count == g_trace.cap) {
+        size_t cap = g_trace.cap ? g_trace.cap * 2 : 256;
+        TraceSpan *arr = realloc(g_trace.spans, cap * sizeof(*arr));
+        if (arr) {
+            g_trace.spans = arr;
+            g_trace.cap = cap;
+        }
+    }
+    if (g_trace.count < g_trace.cap) {
+        g_trace.spans[g_trace.count++] = sp;
+        sp.module = sp.path = NULL;
+    }
+    pthread_mutex_unlock(&g_trace.lock);
+
+    /* Dropped when out of memory */
+    free(sp.module);
+    free(sp.path);
+    errno = saved;
+}
+
+/* CLOCK_BOOTTIME - CLOCK_MONOTONIC: the time spent suspended */
+static int64_t trace_boot_offset(void) {
+    struct timespec ts;
+    uint64_t mono = monotonic_ns();
+
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) != 0)
+        return 0;
+    return (int64_t)((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec - mono);
+}
+
+static int trace_emit(FILE *fp) {
+    int pid = (int)getpid();
+    int64_t off = trace_boot_offset();
+
+    fprintf(fp,
+            "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+            "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"tid\": %d, "
+            "\"args\": {\"name\": \"mmd\"}}",
+            pid, pid);
+
+    for (size_t i = 0; i < g_trace.thread_count; ++i) {
+        const TraceThread *th = &g_trace.threads[i];
+        fprintf(fp,
+                ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": ",
+                pid, th->tid);
+        json_write_str(fp, th->name);
+        fputs("}}", fp);
+    }
+
+    /* Microseconds with ns precision */
+    for (size_t i = 0; i < g_trace.count; ++i) {
+        const TraceSpan *sp = &g_trace.spans[i];
+        int64_t ts = (int64_t)sp->start + off;
+
+        fputs(",\n{\"ph\": \"X\", \"cat\": \"mmd\", \"name\": ", fp);
+        json_write_str(fp, sp->name);
+        fprintf(fp, ", \"pid\": %d, \"tid\": %d, \"ts\": %lld.%03d, \"dur\": %llu.%03d", pid,
+                sp->tid, (long long)(ts / 1000), (int)(ts % 1000),
+                (unsigned long long)(sp->ns / 1000), (int)(sp->ns % 1000));
+        if (sp->module || sp->path) {
+            fputs(", \"args\": {", fp);
+            if (sp->module) {
+                fputs("\"module\": ", fp);
+                json_write_str(fp, sp->module);
+            }
+            if (sp->path) {
+                fputs(sp->module ? ", \"path\": " : "\"path\": ", fp);
+                json_write_str(fp, sp->path);
+            }
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+    }
+    fputs("\n]}\n", fp);
+
+    return ferror(fp) ? -1 : 0;
+}
+
+static int trace_emit_file(FILE *fp, void *arg) {
+    size_t *count = arg;
+
+    pthread_mutex_lock(&g_trace.lock);
+    int ret = trace_emit(fp);
+    *count = g_trace.count;
+    pthread_mutex_unlock(&g_trace.lock);
+    return ret;
+}
+
+int trace_write(const char *path) {
+    size_t count = 0;
+    if (write_file_atomic(path, trace_emit_file, &count) != 0)
+        return -1;
+
+    LOGI("trace: %zu spans written to %s", count, path);
+    return 0;
+}
+
+void trace_free(void) {
+    pthread_mutex_lock(&g_trace.lock);
+    for (size_t i = 0; i < g_trace.count; ++i) {
+        free(g_trace.spans[i].module);
+        free(g_trace.spans[i].path);
+    }
+    free(g_trace.spans);
+    free(g_trace.threads);
+    g_trace.spans = NULL;
+    g_trace.threads = NULL;
+    g_trace.count = g_trace.cap = g_trace.thread_count = 0;
+    g_trace_on = false;
+    pthread_mutex_unlock(&g_trace.lock);
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Spans of a run as Chrome trace-event JSON (--trace), for Perfetto or
+ * chrome://tracing. Spans are timed on CLOCK_MONOTONIC like the stats and
+ * written on CLOCK_BOOTTIME, the clock of an Android boot trace, with the
+ * real pid and thread ids so both line up in one view. Off, a span is one
+ * branch on g_trace_on.
+ */
+extern bool g_trace_on;
+
+/* Turn recording on, naming the calling thread "main"; call before any
+ * other thread runs
+ */
+void trace_start(void);
+
+/* Name the calling thread in the trace; the first name given sticks */
+void trace_thread_name(const char *name);
+
+/* Record the span name (a literal) on the calling thread from start to
+ * end (monotonic_ns). module and path (may be NULL) are copied.
+ */
+void trace_record(const char *name, uint64_t start, uint64_t end, const char *module,
+                  const char *path);
+
+/* Span from start to now; the arguments are only evaluated while tracing */
+#define TRACE_SPAN(name, start, module, path)                                                      \
+    do {                                                                                           \
+        if (g_trace_on)                                                                            \
+            trace_record((name), (start), monotonic_ns(), (module), (path));                       \
+    } while (0)
+
+/* Start of a span, 0 when tracing is off */
+static inline uint64_t trace_begin(void) {
+    return g_trace_on ? monotonic_ns() : 0;
+}
+
+/* Write the recorded spans to path, atomically replaced */
+int trace_write(const char *path);
+
+void trace_free(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,605 @@
+#include "tree_cache.h"
+#include "opstat.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define TREE_CACHE_MAGIC "MMTC"
+#define TREE_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+/* Subtree record, preorder: u8 type, u8 replace, u16 name_len, u32 child_count, name,
+ * and for a directory its stamp: u64 inode, i64 mtime and i64 ctime in ns
+ */
+#define NODE_REC_SIZE 8
+#define DIR_STAMP_SIZE 24
+
+/* Byte cursor over a buffer; every read is bounds checked */
+typedef struct {
+    const unsigned char *p;
+    size_t left;
+} CacheReader;
+
+static bool cache_read(CacheReader *r, void *out, size_t n) {
+    if (r->left < n)
+        return false;
+    memcpy(out, r->p, n);
+    r->p += n;
+    r->left -= n;
+    return true;
+}
+
+static const unsigned char *cache_take(CacheReader *r, size_t n) {
+    if (r->left < n)
+        return NULL;
+    const unsigned char *p = r->p;
+    r->p += n;
+    r->left -= n;
+    return p;
+}
+
+/* --- Fingerprints --- */
+
+static uint64_t fp_mix(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t fp_stat(uint64_t h, const struct stat *st) {
+    int64_t v[6] = {(int64_t)st->st_dev,         (int64_t)st->st_ino,
+                    (int64_t)st->st_mtim.tv_sec, (int64_t)st->st_mtim.tv_nsec,
+                    (int64_t)st->st_ctim.tv_sec, (int64_t)st->st_ctim.tv_nsec};
+    return fp_mix(h, v, sizeof(v));
+}
+
+/* Everything outside the modules that shapes their subtrees */
+static uint64_t cache_config_fingerprint(const MagicMount *ctx) {
+    const char *mdir = ctx->module_dir ? ctx->module_dir : DEFAULT_MODULE_DIR;
+    uint64_t h = 14695981039346656037ULL;
+
+    h = fp_mix(h, VERSION, sizeof(VERSION));
+    h = fp_mix(h, mdir, strlen(mdir) + 1);
+    for (size_t i = 0; i < ctx->catalog.parts_count; ++i)
+        h = fp_mix(h, ctx->catalog.parts[i], strlen(ctx->catalog.parts[i]) + 1);
+    return h;
+}
+
+/* Module root plus each partition root: inode, mtime and ctime. A new or
+ * removed partition changes it; changes inside a partition are caught by the
+ * stamp of each directory when its subtree is unpacked.
+ */
+static int cache_module_fingerprint(const ModuleCatalog *cat, const ModuleInfo *mod,
+                                    uint64_t *out) {
+    struct stat st;
+    uint64_t h = 14695981039346656037ULL;
+
+    if (fstat(mod->dirfd, &st) != 0)
+        return -1;
+    h = fp_stat(h, &st);
+
+    for (size_t i = 0; i < cat->parts_count; ++i) {
+        if (!mod->has_part[i])
+            continue;
+        if (fstatat(mod->dirfd, cat->parts[i], &st, 0) != 0)
+            return -1;
+        uint32_t idx = (uint32_t)i;
+        h = fp_mix(h, &idx, sizeof(idx));
+        h = fp_stat(h, &st);
+    }
+
+    *out = h;
+    return 0;
+}
+
+/* --- Subtree records --- */
+
+/* Preorder walk of a subtree on a heap stack, like warmup_collect: a cache
+ * file can nest as deep as it likes, and the scan threads have small stacks
+ */
+typedef struct {
+    const Node **stack; /* directories with children left to visit */
+    uint32_t *next;
+    size_t depth;
+    size_t cap;
+    bool oom;
+} PackWalk;
+
+/* Preorder successor of n, the node just visited; NULL at the end or when
+ * out of memory (w->oom)
+ */
+static const Node *pack_walk_next(PackWalk *w, const Node *n) {
+    if (n->child_count > 0) {
+        if (w->depth == w->cap) {
+            size_t cap = w->cap ? w->cap * 2 : 16;
+            const Node **stack = realloc(w->stack, cap * sizeof(*stack));
+            if (stack)
+                w->stack = stack;
+            uint32_t *next = stack ? realloc(w->next, cap * sizeof(*next)) : NULL;
+            if (!next) {
+                w->oom = true;
+                return NULL;
+            }
+            w->next = next;
+            w->cap = cap;
+        }
+        w->stack[w->depth] = n;
+        w->next[w->depth++] = 0;
+    }
+
+    while (w->depth > 0) {
+        const Node *top = w->stack[w->depth - 1];
+        uint32_t i = w->next[w->depth - 1];
+        if (i < top->child_count) {
+            w->next[w->depth - 1] = i + 1;
+            return node_children(top)[i];
+        }
+        w->depth--;
+    }
+    return NULL;
+}
+
+static void pack_walk_free(PackWalk *w) {
+    free(w->stack);
+    free(w->next);
+}
+
+void tree_cache_stamp(DirStamp *ds, const Node *dir, const struct stat *st) {
+    ds->dir = dir;
+    ds->ino = (uint64_t)st->st_ino;
+    ds->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    ds->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static size_t pack_rec_size(const Node *n) {
+    return NODE_REC_SIZE + strlen(n->name) + (n->type == NFT_DIRECTORY ? DIR_STAMP_SIZE : 0);
+}
+
+static unsigned char *pack_node(unsigned char *p, const Node *n, const DirStamp *ds) {
+    uint8_t type = (uint8_t)n->type;
+    uint8_t replace = n->replace;
+    uint16_t name_len = (uint16_t)strlen(n->name);
+    uint32_t child_count = (uint32_t)n->child_count;
+
+    memcpy(p, &type, 1);
+    memcpy(p + 1, &replace, 1);
+    memcpy(p + 2, &name_len, 2);
+    memcpy(p + 4, &child_count, 4);
+    memcpy(p + NODE_REC_SIZE, n->name, name_len);
+    p += NODE_REC_SIZE + name_len;
+
+    if (ds) {
+        memcpy(p, &ds->ino, 8);
+        memcpy(p + 8, &ds->mtime_ns, 8);
+        memcpy(p + 16, &ds->ctime_ns, 8);
+        p += DIR_STAMP_SIZE;
+    }
+    return p;
+}
+
+int tree_cache_pack(Arena *a, const Node *root, bool has_any, const DirStamp *stamps,
+                    size_t stamp_count, PartBlob *out) {
+    PackWalk w = {0};
+    unsigned char *data = NULL;
+    size_t len = 0, k = 0;
+
+    for (const Node *n = root; n; n = pack_walk_next(&w, n))
+        len += pack_rec_size(n);
+    if (!w.oom)
+        data = arena_alloc(a, len);
+
+    /* The second walk reuses the stack the first one grew. A scan visits
+     * directories in the same preorder; a stamp for another node means one
+     * went missing.
+     */
+    unsigned char *p = data;
+    for (const Node *n = data ? root : NULL; n; n = pack_walk_next(&w, n)) {
+        const DirStamp *ds = NULL;
+        if (n->type == NFT_DIRECTORY) {
+            if (k == stamp_count || stamps[k].dir != n)
+                break;
+            ds = &stamps[k++];
+        }
+        p = pack_node(p, n, ds);
+    }
+    pack_walk_free(&w);
+    if (!data || w.oom || p != data + len)
+        return -1;
+
+    out->data = data;
+    out->len = len;
+    out->has_any = has_any;
+    return 0;
+}
+
+/* One record as a new node; *child_count receives its child count and
+ * *ds the stamp of a directory
+ */
+static Node *unpack_node(Arena *a, CacheReader *r, uint32_t *child_count, DirStamp *ds) {
+    uint8_t type, replace;
+    uint16_t name_len;
+
+    if (!cache_read(r, &type, 1) || !cache_read(r, &replace, 1) ||
+        !cache_read(r, &name_len, 2) || !cache_read(r, child_count, 4))
+        return NULL;
+
+    const unsigned char *raw = cache_take(r, name_len);
+    if (!raw || name_len == 0 || type > NFT_WHITEOUT || memchr(raw, '/', name_len) ||
+        memchr(raw, '\0', name_len))
+        return NULL;
+
+    /* Every child record takes at least NODE_REC_SIZE + 1 bytes */
+    if (*child_count > r->left / (NODE_REC_SIZE + 1) ||
+        (*child_count && type != NFT_DIRECTORY))
+        return NULL;
+
+    if (type == NFT_DIRECTORY && (!cache_read(r, &ds->ino, 8) || !cache_read(r, &ds->mtime_ns, 8) ||
+                                  !cache_read(r, &ds->ctime_ns, 8)))
+        return NULL;
+
+    char name[256 + 1];
+    if (name_len >= sizeof(name))
+        return NULL;
+    memcpy(name, raw, name_len);
+    name[name_len] = '\0';
+
+    Node *n = node_new(a, name, (NodeFileType)type);
+    if (n)
+        n->replace = replace != 0;
+    return n;
+}
+
+/* Whether the directory at path (relative to dirfd) is still the one stamped */
+static bool unpack_stamp_ok(int dirfd, const char *path, const DirStamp *want) {
+    struct stat st;
+    DirStamp now;
+
+    uint64_t t = opstat_begin();
+    int r = fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW);
+    opstat_end(OP_STAT, t);
+    if (r != 0 || !S_ISDIR(st.st_mode))
+        return false;
+
+    tree_cache_stamp(&now, NULL, &st);
+    return now.ino == want->ino && now.mtime_ns == want->mtime_ns &&
+           now.ctime_ns == want->ctime_ns;
+}
+
+Node *tree_cache_unpack(Arena *a, const PartBlob *blob, int dirfd, uint16_t module_id,
+                        size_t *nodes) {
+    typedef struct {
+        Node *node;
+        uint32_t left; /* child records still to read */
+        size_t saved;  /* path length to restore once they are */
+    } Frame;
+    CacheReader r = {.p = blob->data, .left = blob->len};
+    Frame *stack = NULL;
+    size_t depth = 0, cap = 0, count = 0;
+    uint32_t child_count;
+    DirStamp want;
+    Node *ret = NULL;
+    int err = EINVAL;
+
+    /* Relative to the module dir, one component per open directory */
+    PathBuf *path = malloc(sizeof(*path));
+    if (!path || path_buf_set(path, ".") != 0) {
+        free(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* The partition root has neither origin nor module, like a scan */
+    Node *root = unpack_node(a, &r, &child_count, &want);
+    if (!root || root->type != NFT_DIRECTORY)
+        goto out;
+
+    for (Node *n = root;;) {
+        if (n->type == NFT_DIRECTORY) {
+            size_t saved;
+            if (path_buf_push(path, n->name, &saved) != 0)
+                goto out;
+            if (!unpack_stamp_ok(dirfd, path->buf, &want)) {
+                LOGD("tree cache: %s changed", path->buf);
+                err = ESTALE;
+                goto out;
+            }
+
+            if (child_count == 0) {
+                path_buf_pop(path, saved);
+            } else {
+                if (depth == cap) {
+                    size_t c = cap ? cap * 2 : 16;
+                    Frame *arr = realloc(stack, c * sizeof(*arr));
+                    if (!arr) {
+                        err = ENOMEM;
+                        goto out;
+                    }
+                    stack = arr;
+                    cap = c;
+                }
+                stack[depth++] = (Frame){.node = n, .left = child_count, .saved = saved};
+            }
+        }
+
+        while (depth > 0 && stack[depth - 1].left == 0)
+            path_buf_pop(path, stack[--depth].saved);
+        if (depth == 0)
+            break;
+
+        Frame *f = &stack[depth - 1];
+        f->left--;
+        n = unpack_node(a, &r, &child_count, &want);
+        if (!n || node_child_find(f->node, n->name) || node_child_append(a, f->node, n) != 0)
+            goto out;
+        n->origin = f->node;
+        n->module_id = module_id;
+        count++;
+    }
+
+    if (r.left == 0) {
+        *nodes += count;
+        ret = root;
+    }
+
+out:
+    free(stack);
+    free(path);
+    if (!ret)
+        errno = err;
+    return ret;
+}
+
+/* --- Cache file --- */
+
+/* File: magic, u32 version, u64 config fingerprint, u32 module count, then per
+ * module: u16 name_len, name, u64 fingerprint, u32 blob count, and per blob:
+ * u32 partition index, u8 has_any, u32 len, subtree records
+ */
+static int cache_read_file(Arena *a, const char *path, unsigned char **out, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            LOGW("tree cache %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        st.st_size > TREE_CACHE_MAX_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *buf = arena_alloc(a, size);
+    size_t got = 0;
+
+    while (buf && got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += (size_t)n;
+    }
+    close(fd);
+
+    if (!buf || got != size)
+        return -1;
+
+    *out = buf;
+    *len = size;
+    return 0;
+}
+
+static ModuleInfo *cache_find_module(ModuleCatalog *cat, const unsigned char *name,
+                                     size_t name_len) {
+    for (size_t i = 0; i < cat->count; ++i) {
+        ModuleInfo *m = &cat->modules[i];
+        if (m->blobs && strlen(m->name) == name_len && !memcmp(m->name, name, name_len))
+            return m;
+    }
+    return NULL;
+}
+
+static int cache_parse(MagicMount *ctx, const unsigned char *buf, size_t len) {
+    ModuleCatalog *cat = &ctx->catalog;
+    CacheReader r = {.p = buf, .left = len};
+    uint32_t version, count;
+    uint64_t config;
+
+    const unsigned char *magic = cache_take(&r, 4);
+    if (!magic || memcmp(magic, TREE_CACHE_MAGIC, 4) != 0 || !cache_read(&r, &version, 4) ||
+        version != TREE_CACHE_VERSION || !cache_read(&r, &config, 8) ||
+        !cache_read(&r, &count, 4))
+        return -1;
+
+    if (config != cache_config_fingerprint(ctx)) {
+        LOGI("tree cache: configuration changed, rescanning all modules");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint16_t name_len;
+        uint64_t fingerprint;
+        uint32_t blobs;
+
+        const unsigned char *name;
+        if (!cache_read(&r, &name_len, 2) || !(name = cache_take(&r, name_len)) ||
+            !cache_read(&r, &fingerprint, 8) || !cache_read(&r, &blobs, 4))
+            return -1;
+
+        ModuleInfo *mod = cache_find_module(cat, name, name_len);
+        PartBlob *cached = NULL;
+
+        if (mod && mod->fingerprint == fingerprint && !mod->cached) {
+            cached = arena_alloc(&ctx->arena, cat->parts_count * sizeof(PartBlob));
+            if (!cached)
+                return -1;
+        }
+
+        for (uint32_t j = 0; j < blobs; ++j) {
+            uint32_t part, blob_len;
+            uint8_t has_any;
+            const unsigned char *data;
+
+            if (!cache_read(&r, &part, 4) || !cache_read(&r, &has_any, 1) ||
+                !cache_read(&r, &blob_len, 4) || !(data = cache_take(&r, blob_len)))
+                return -1;
+
+            if (cached && part < cat->parts_count && blob_len > 0) {
+                cached[part].data = data;
+                cached[part].len = blob_len;
+                cached[part].has_any = has_any != 0;
+            }
+        }
+
+        if (cached) {
+            mod->cached = cached;
+            cat->cache_hits++;
+        } else if (mod) {
+            LOGD("tree cache: module %s changed", mod->name);
+        }
+        cat->cache_entries++;
+    }
+
+    return r.left == 0 ? 0 : -1;
+}
+
+int tree_cache_load(MagicMount *ctx) {
+    ModuleCatalog *cat = &ctx->catalog;
+    size_t enabled = 0;
+
+    cat->cache_entries = 0;
+    cat->cache_hits = 0;
+
+    if (!ctx->tree_cache)
+        return 0;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        ModuleInfo *mod = &cat->modules[i];
+
+        if (!mod->enabled)
+            continue;
+
+        if (cache_module_fingerprint(cat, mod, &mod->fingerprint) != 0) {
+            LOGW("tree cache: cannot fingerprint %s: %s", mod->path, strerror(errno));
+            continue;
+        }
+
+        mod->blobs = arena_alloc(&ctx->arena, cat->parts_count * sizeof(PartBlob));
+        if (!mod->blobs)
+            return -1;
+        enabled++;
+    }
+
+    unsigned char *buf;
+    size_t len;
+    if (cache_read_file(&ctx->arena, ctx->tree_cache, &buf, &len) != 0)
+        return 0;
+
+    if (cache_parse(ctx, buf, len) != 0) {
+        LOGW("tree cache: %s is stale or corrupt, ignoring it", ctx->tree_cache);
+        for (size_t i = 0; i < cat->count; ++i)
+            cat->modules[i].cached = NULL;
+        cat->cache_entries = 0;
+        cat->cache_hits = 0;
+        return 0;
+    }
+
+    LOGI("tree cache: %zu/%zu modules unchanged", cat->cache_hits, enabled);
+    return 0;
+}
+
+static bool cache_write(FILE *fp, const void *p, size_t n) {
+    return n == 0 || fwrite(p, n, 1, fp) == 1;
+}
+
+static int cache_write_file(FILE *fp, void *arg) {
+    const MagicMount *ctx = arg;
+    const ModuleCatalog *cat = &ctx->catalog;
+    uint32_t version = TREE_CACHE_VERSION;
+    uint64_t config = cache_config_fingerprint(ctx);
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < cat->count; ++i)
+        count += cat->modules[i].blobs != NULL;
+
+    if (!cache_write(fp, TREE_CACHE_MAGIC, 4) || !cache_write(fp, &version, 4) ||
+        !cache_write(fp, &config, 8) || !cache_write(fp, &count, 4))
+        return -1;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        const ModuleInfo *mod = &cat->modules[i];
+        uint32_t blobs = 0;
+
+        if (!mod->blobs)
+            continue;
+
+        for (size_t j = 0; j < cat->parts_count; ++j)
+            blobs += mod->blobs[j].data != NULL;
+
+        uint16_t name_len = (uint16_t)strlen(mod->name);
+        if (!cache_write(fp, &name_len, 2) || !cache_write(fp, mod->name, name_len) ||
+            !cache_write(fp, &mod->fingerprint, 8) || !cache_write(fp, &blobs, 4))
+            return -1;
+
+        for (size_t j = 0; j < cat->parts_count; ++j) {
+            const PartBlob *b = &mod->blobs[j];
+            uint32_t part = (uint32_t)j;
+            uint8_t has_any = b->has_any;
+            uint32_t len = (uint32_t)b->len;
+
+            if (!b->data)
+                continue;
+
+            if (!cache_write(fp, &part, 4) || !cache_write(fp, &has_any, 1) ||
+                !cache_write(fp, &len, 4) || !cache_write(fp, b->data, b->len))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int tree_cache_save(MagicMount *ctx) {
+    const ModuleCatalog *cat = &ctx->catalog;
+    size_t modules = 0;
+    bool dirty = false;
+
+    if (!ctx->tree_cache)
+        return 0;
+
+    for (size_t i = 0; i < cat->count; ++i) {
+        const ModuleInfo *mod = &cat->modules[i];
+
+        if (!mod->blobs)
+            continue;
+        modules++;
+
+        for (size_t j = 0; j < cat->parts_count; ++j) {
+            if (mod->blobs[j].fresh)
+                dirty = true;
+        }
+    }
+
+    if (!dirty && modules == cat->cache_entries && modules == cat->cache_hits) {
+        LOGD("tree cache: %s is up to date", ctx->tree_cache);
+        return 0;
+    }
+
+    if (write_file_atomic(ctx->tree_cache, cache_write_file, ctx) != 0)
+        return -1;
+
+    LOGI("tree cache: saved %zu modules to %s", modules, ctx->tree_cache);
+    return 0;
+}
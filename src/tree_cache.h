@@ -0,0 +1,49 @@
+#ifndef TREE_CACHE_H
+#define TREE_CACHE_H
+
+#include "magic_mount.h"
+#include "module_tree.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Bump when the file or subtree layout changes */
+#define TREE_CACHE_VERSION 2
+
+/* A scanned directory as the cache checks it on load. Adding, removing or
+ * renaming an entry changes its mtime; a new opaque xattr its ctime.
+ */
+typedef struct {
+    const Node *dir;
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+} DirStamp;
+
+/* Fingerprint the enabled modules of ctx->catalog and attach the cached
+ * subtrees of those that did not change. A missing or stale file is not an
+ * error; -1 only when the per-module state cannot be allocated.
+ */
+int tree_cache_load(MagicMount *ctx);
+
+/* Rewrite ctx->tree_cache when a module was rescanned, added or removed */
+int tree_cache_save(MagicMount *ctx);
+
+/* Stamp of the directory node dir, st being the directory's stat */
+void tree_cache_stamp(DirStamp *ds, const Node *dir, const struct stat *st);
+
+/* Serialize a private module subtree (root = partition node) into out->data.
+ * stamps has one entry per directory of the subtree, in scan (pre)order.
+ */
+int tree_cache_pack(Arena *a, const Node *root, bool has_any, const DirStamp *stamps,
+                    size_t stamp_count, PartBlob *out);
+
+/* Rebuild a subtree owned by module_id, its partition dir being relative to
+ * the module dirfd. The partition node itself is not counted in *nodes, like
+ * a scan. NULL with errno ESTALE if a directory changed since it was packed.
+ */
+Node *tree_cache_unpack(Arena *a, const PartBlob *blob, int dirfd, uint16_t module_id,
+                        size_t *nodes);
+
+#endif /* TREE_CACHE_H */
@@ -1,18 +1,26 @@
 #include "utils.h"
+#include "fs_ops.h"
+#include "opstat.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
+long syscall(long number, ...);
+
 /* --- log func --- */
 
 FILE *g_log_file = NULL;
@@ -20,6 +28,9 @@ log_level_t g_log_level = LOG_INFO;
 
 bool g_log_initialized = false;
 
+/* Serializes log output once the module scan runs on worker threads */
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct log_entry {
     char *line;
 };
@@ -121,8 +132,11 @@ void log_write(log_level_t lv, const char *file, int line, const char *fmt, ...)
 
     buf[sizeof(buf) - 1] = '\0';
 
+    pthread_mutex_lock(&g_log_lock);
+
     if (!g_log_initialized) {
         log_buffer_append(buf);
+        pthread_mutex_unlock(&g_log_lock);
         return;
     }
 
@@ -131,6 +145,8 @@ void log_write(log_level_t lv, const char *file, int line, const char *fmt, ...)
     fputs(buf, out);
     fputc('\n', out);
     fflush(out);
+
+    pthread_mutex_unlock(&g_log_lock);
 }
 
 /* --- path helpers --- */
@@ -173,19 +189,62 @@ int path_join(const char *base, const char *name, char *buf, size_t n) {
     return 0;
 }
 
+int path_buf_set(PathBuf *pb, const char *path) {
+    size_t len = strlen(path);
+
+    if (len >= sizeof(pb->buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(pb->buf, path, len + 1);
+    pb->len = len;
+    return 0;
+}
+
+int path_buf_push(PathBuf *pb, const char *name, size_t *saved) {
+    size_t nlen = strlen(name);
+    bool slash = nlen > 0 && !(pb->len > 0 && pb->buf[pb->len - 1] == '/');
+
+    *saved = pb->len;
+
+    if (pb->len + slash + nlen >= sizeof(pb->buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (slash)
+        pb->buf[pb->len++] = '/';
+    memcpy(pb->buf + pb->len, name, nlen + 1);
+    pb->len += nlen;
+    return 0;
+}
+
+void path_buf_pop(PathBuf *pb, size_t saved) {
+    pb->len = saved;
+    pb->buf[saved] = '\0';
+}
+
+/* stat, or lstat without follow, counted as OP_STAT */
+static int path_stat(const char *p, struct stat *st, bool follow) {
+    uint64_t t = opstat_begin();
+    int r = follow ? stat(p, st) : lstat(p, st);
+    opstat_end(OP_STAT, t);
+    return r;
+}
+
 bool path_exists(const char *p) {
     struct stat st;
-    return (stat(p, &st) == 0);
+    return (path_stat(p, &st, true) == 0);
 }
 
 bool path_is_dir(const char *p) {
     struct stat st;
-    return (stat(p, &st) == 0) && S_ISDIR(st.st_mode);
+    return (path_stat(p, &st, true) == 0) && S_ISDIR(st.st_mode);
 }
 
 bool path_is_symlink(const char *p) {
     struct stat st;
-    return (lstat(p, &st) == 0) && S_ISLNK(st.st_mode);
+    return (path_stat(p, &st, false) == 0) && S_ISLNK(st.st_mode);
 }
 
 int mkdir_p(const char *dir) {
@@ -195,7 +254,7 @@ int mkdir_p(const char *dir) {
     }
 
     struct stat st;
-    if (stat(dir, &st) == 0) {
+    if (g_fs_ops->stat(dir, &st) == 0) {
         if (S_ISDIR(st.st_mode))
             return 0;
         errno = ENOTDIR;
@@ -217,12 +276,178 @@ int mkdir_p(const char *dir) {
             return -1;
     }
 
+    if (g_fs_ops->mkdir(dir, 0755) == 0 || errno == EEXIST)
+        return 0;
+
+    return -1;
+}
+
+/* mkdir_p on the host filesystem, bypassing g_fs_ops: output files are
+ * real even under --dry-run, and their directories are not part of the run
+ */
+static int host_mkdir_p(const char *dir) {
+    struct stat st;
+    if (stat(dir, &st) == 0) {
+        if (S_ISDIR(st.st_mode))
+            return 0;
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    if (strlen(dir) >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(tmp, dir);
+    char *s = strrchr(tmp, '/');
+
+    if (s && s != tmp) {
+        *s = '\0';
+        if (host_mkdir_p(tmp) < 0)
+            return -1;
+    }
+
     if (mkdir(dir, 0755) == 0 || errno == EEXIST)
         return 0;
 
     return -1;
 }
 
+int write_file_atomic(const char *path, int (*emit)(FILE *fp, void *arg), void *arg) {
+    char dir[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        LOGW("write %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (host_mkdir_p(dir) != 0) {
+            LOGW("mkdir %s: %s", dir, strerror(errno));
+            return -1;
+        }
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!fp) {
+        LOGW("open %s: %s", tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+
+    int ret = emit(fp, arg);
+    if (ferror(fp))
+        ret = -1;
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -1;
+
+    if (ret != 0) {
+        LOGW("write %s: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t dir_getdents(int fd, void *buf, size_t len) {
+    uint64_t t = opstat_begin();
+    ssize_t n = (ssize_t)syscall(SYS_getdents64, fd, buf, len);
+    opstat_end(OP_GETDENTS, t);
+    return n;
+}
+
+#define SNAP_BUF_SIZE (16 * 1024)
+
+int dir_snap_read(DirSnap *s, const char *path) {
+    size_t cap = 0;
+
+    s->buf = NULL;
+    s->len = 0;
+    s->pos = 0;
+
+    uint64_t t = opstat_begin();
+    s->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    opstat_end(OP_OPEN, t);
+    if (s->fd < 0)
+        return -1;
+
+    for (;;) {
+        /* getdents64 needs room for at least one full record */
+        if (cap - s->len < sizeof(struct linux_dirent64) + NAME_MAX + 1) {
+            cap = cap ? cap * 2 : SNAP_BUF_SIZE;
+            char *buf = realloc(s->buf, cap);
+            if (!buf)
+                break;
+            s->buf = buf;
+        }
+
+        ssize_t n = dir_getdents(s->fd, s->buf + s->len, cap - s->len);
+        if (n == 0)
+            return 0;
+        if (n < 0)
+            break;
+        s->len += (size_t)n;
+    }
+
+    int err = errno;
+    free(s->buf);
+    close(s->fd);
+    s->buf = NULL;
+    s->len = 0;
+    s->fd = -1;
+    errno = err;
+    return -1;
+}
+
+int dir_snap_open(DirSnap *s, const char *path, char *buf, size_t len) {
+    s->buf = buf;
+    s->len = len;
+    s->pos = 0;
+
+    uint64_t t = opstat_begin();
+    s->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    opstat_end(OP_OPEN, t);
+    if (s->fd >= 0)
+        return 0;
+
+    int err = errno;
+    dir_snap_release(s);
+    errno = err;
+    return -1;
+}
+
+const struct linux_dirent64 *dir_snap_next(DirSnap *s) {
+    while (s->pos < s->len) {
+        const struct linux_dirent64 *de = (const struct linux_dirent64 *)(s->buf + s->pos);
+        s->pos += de->d_reclen;
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+            return de;
+    }
+    return NULL;
+}
+
+void dir_snap_release(DirSnap *s) {
+    free(s->buf);
+    s->buf = NULL;
+    s->len = 0;
+    s->pos = 0;
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+}
+
 /* --- tmpfs check and tempdir set --- */
 
 static bool is_rw_tmpfs(const char *path) {
@@ -273,6 +498,14 @@ const char *select_auto_tempdir(char buf[PATH_MAX]) {
     return DEFAULT_TEMP_DIR;
 }
 
+/* --- time --- */
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
 /* --- str utils --- */
 
 char *str_trim(char *str) {
@@ -348,6 +581,20 @@ void str_array_free(char ***arr, int *count) {
     *count = 0;
 }
 
+void json_write_str(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
 /* --- SELinux xattr --- */
 
 int set_selcon(const char *path, const char *con) {
@@ -358,7 +605,7 @@ int set_selcon(const char *path, const char *con) {
 
     LOGD("set_selcon(%s, \"%s\")", path, con);
 
-    if (lsetxattr(path, SELINUX_XATTR, con, strlen(con), 0) < 0) {
+    if (g_fs_ops->lsetxattr(path, SELINUX_XATTR, con, strlen(con), 0) < 0) {
         LOGW("setcon %s: %s", path, strerror(errno));
         return -1;
     }
@@ -366,7 +613,18 @@ int set_selcon(const char *path, const char *con) {
     return 0;
 }
 
+/* lgetxattr of the label, counted as OP_GETXATTR */
+static ssize_t selcon_read(const char *path, char *buf, size_t size) {
+    uint64_t t = opstat_begin();
+    ssize_t sz = lgetxattr(path, SELINUX_XATTR, buf, size);
+    opstat_end(OP_GETXATTR, t);
+    return sz;
+}
+
 int get_selcon(const char *path, char **out) {
+    char buf[SELCON_BUF];
+    ssize_t sz;
+
     *out = NULL;
 
     if (!path) {
@@ -375,33 +633,121 @@ int get_selcon(const char *path, char **out) {
         return -1;
     }
 
-    ssize_t sz = lgetxattr(path, SELINUX_XATTR, NULL, 0);
-    if (sz < 0) {
+    /* Contexts fit the stack buffer; only a longer one costs a size query */
+    sz = selcon_read(path, buf, sizeof(buf) - 1);
+    if (sz >= 0) {
+        buf[sz] = '\0';
+        *out = strdup(buf);
+        if (!*out) {
+            errno = ENOMEM;
+            return -1;
+        }
+    } else if (errno == ERANGE) {
+        sz = selcon_read(path, NULL, 0);
+        char *big = sz < 0 ? NULL : malloc(sz + 1);
+        if (sz >= 0 && !big)
+            errno = ENOMEM;
+        if (big && (sz = selcon_read(path, big, sz)) >= 0) {
+            big[sz] = '\0';
+            *out = big;
+        } else {
+            free(big);
+        }
+    }
+
+    if (!*out) {
         LOGW("getcon %s: %s", path, strerror(errno));
         return -1;
     }
 
-    char *buf = malloc(sz + 1);
-    if (!buf) {
-        errno = ENOMEM;
-        return -1;
+    LOGD("get_selcon(%s) -> \"%s\"", path, *out);
+    return 0;
+}
+
+/* Only a few dozen distinct labels exist below a partition. Each is stored
+ * once, so equal labels are the same pointer, and remembered per (dev, ino)
+ * for inodes read again (overlay checks, then the bind fallback). Never
+ * freed; shared by the apply workers.
+ */
+#define SELCON_SLOTS 512
+#define SELCON_INODES 1024
+
+static struct {
+    pthread_mutex_t lock;
+    char *labels[SELCON_SLOTS]; /* open addressing */
+    struct {
+        dev_t dev;
+        ino_t ino;
+        const char *con;
+    } inodes[SELCON_INODES]; /* direct mapped */
+} g_selcon = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t selcon_inode_slot(const struct stat *st) {
+    uint64_t h = ((uint64_t)st->st_dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)st->st_ino;
+    return (size_t)(h * 0x9e3779b97f4a7c15ULL >> 32) % SELCON_INODES;
+}
+
+/* The stored copy of con, NULL if the table is full or out of memory */
+static const char *selcon_intern_locked(const char *con) {
+    uint32_t h = 2166136261u;
+
+    for (const char *c = con; *c; ++c)
+        h = (h ^ (unsigned char)*c) * 16777619u;
+
+    for (size_t i = 0; i < SELCON_SLOTS; ++i) {
+        char **slot = &g_selcon.labels[(h + i) % SELCON_SLOTS];
+        if (!*slot) {
+            *slot = strdup(con);
+            return *slot;
+        }
+        if (!strcmp(*slot, con))
+            return *slot;
     }
+    return NULL;
+}
 
-    sz = lgetxattr(path, SELINUX_XATTR, buf, sz);
-    if (sz < 0) {
-        LOGW("getcon %s: %s", path, strerror(errno));
-        free(buf);
-        return -1;
+const char *selcon_lookup(const char *path, const struct stat *st) {
+    char buf[SELCON_BUF];
+    const char *con = NULL;
+
+    if (st) {
+        size_t i = selcon_inode_slot(st);
+        pthread_mutex_lock(&g_selcon.lock);
+        if (g_selcon.inodes[i].con && g_selcon.inodes[i].dev == st->st_dev &&
+            g_selcon.inodes[i].ino == st->st_ino)
+            con = g_selcon.inodes[i].con;
+        pthread_mutex_unlock(&g_selcon.lock);
+        if (con)
+            return con;
     }
 
+    ssize_t sz = selcon_read(path, buf, sizeof(buf) - 1);
+    if (sz < 0)
+        return NULL;
     buf[sz] = '\0';
-    *out = buf;
 
-    LOGD("get_selcon(%s) -> \"%s\"", path, buf);
-    return 0;
+    pthread_mutex_lock(&g_selcon.lock);
+    con = selcon_intern_locked(buf);
+    if (con && st) {
+        size_t i = selcon_inode_slot(st);
+        g_selcon.inodes[i].dev = st->st_dev;
+        g_selcon.inodes[i].ino = st->st_ino;
+        g_selcon.inodes[i].con = con;
+    }
+    pthread_mutex_unlock(&g_selcon.lock);
+
+    if (!con)
+        errno = ENOSPC;
+    return con;
 }
 
-int copy_selcon(const char *src, const char *dst) {
+int copy_selcon_st(const char *src, const struct stat *st, const char *dst, const char *parent,
+                   const char **out) {
+    char *own = NULL;
+
+    if (out)
+        *out = NULL;
+
     if (!src || !dst) {
         LOGD("copy_selcon: skip null args");
         errno = EINVAL;
@@ -410,16 +756,44 @@ int copy_selcon(const char *src, const char *dst) {
 
     LOGD("copy_selcon(%s -> %s)", src, dst);
 
-    char *con = NULL;
-    if (get_selcon(src, &con) < 0)
-        return -1;
+    const char *con = selcon_lookup(src, st);
+    if (!con) {
+        if (errno != ERANGE && errno != ENOSPC) {
+            LOGW("getcon %s: %s", src, strerror(errno));
+            return -1;
+        }
+        if (get_selcon(src, &own) < 0)
+            return -1;
+        con = own;
+    }
+
+    /* A new entry takes the type of its parent. Only if that is the one to
+     * copy can dst have it already; read it back then, skipping the set.
+     */
+    char cur[SELCON_BUF];
+    ssize_t sz = -1;
+    if (!parent || parent == con) {
+        sz = selcon_read(dst, cur, sizeof(cur) - 1);
+        if (sz >= 0)
+            cur[sz] = '\0';
+    }
 
-    int ret = set_selcon(dst, con);
-    free(con);
+    int ret = 0;
+    if (sz >= 0 && !strcmp(cur, con))
+        LOGD("copy_selcon: %s already \"%s\"", dst, con);
+    else
+        ret = set_selcon(dst, con);
 
+    if (ret == 0 && out && !own)
+        *out = con;
+    free(own);
     return ret;
 }
 
+int copy_selcon(const char *src, const char *dst) {
+    return copy_selcon_st(src, NULL, dst, NULL, NULL);
+}
+
 /* --- Permission check --- */
 
 int root_check(void) {
@@ -4,7 +4,10 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 typedef enum {
     LOG_ERROR = 0,
@@ -53,21 +56,104 @@ bool path_is_dir(const char *p);
 bool path_is_symlink(const char *p);
 int mkdir_p(const char *dir);
 
+/* Create path's directory, write path.tmp through emit and rename it over
+ * path, so readers see the old file or the whole new one. emit returns 0,
+ * or -1 with errno set; a stream error fails the write too. Failures are
+ * logged and path.tmp removed.
+ */
+int write_file_atomic(const char *path, int (*emit)(FILE *fp, void *arg), void *arg);
+
+/* Path built in place: components are pushed and popped instead of
+ * formatting every full path with path_join (same joining rules)
+ */
+typedef struct {
+    char buf[PATH_MAX];
+    size_t len;
+} PathBuf;
+
+int path_buf_set(PathBuf *pb, const char *path);
+/* Append name; *saved receives the length to restore with path_buf_pop */
+int path_buf_push(PathBuf *pb, const char *name, size_t *saved);
+void path_buf_pop(PathBuf *pb, size_t saved);
+
+/* raw directory reading (getdents64), d_type values hidden by _POSIX_C_SOURCE */
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_FIFO 1
+#define DT_CHR 2
+#define DT_DIR 4
+#define DT_BLK 6
+#define DT_REG 8
+#define DT_LNK 10
+#define DT_SOCK 12
+#endif
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Fill buf with linux_dirent64 records; 0 at end of directory, -1 on error */
+ssize_t dir_getdents(int fd, void *buf, size_t len);
+
+/* All entries of a directory read in one go; fd stays open to anchor
+ * relative lookups (fstatat) while the entries are used
+ */
+typedef struct {
+    int fd; /* -1: not read */
+    char *buf;
+    size_t len;
+    size_t pos;
+} DirSnap;
+
+int dir_snap_read(DirSnap *s, const char *path);
+/* Snapshot of entries read earlier (buf, len, taken over), with path
+ * opened again as the anchor
+ */
+int dir_snap_open(DirSnap *s, const char *path, char *buf, size_t len);
+/* Next entry other than "." and "..", NULL at the end */
+const struct linux_dirent64 *dir_snap_next(DirSnap *s);
+void dir_snap_release(DirSnap *s);
+
 /* temp directory auto-selection */
 const char *select_auto_tempdir(char buf[PATH_MAX]);
 
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t monotonic_ns(void);
+
 /* str utils */
 
 char *str_trim(char *str);
 bool str_is_true(const char *str);
 bool str_array_append(char ***arr, int *count, const char *str);
 void str_array_free(char ***arr, int *count);
+/* s as a quoted JSON string */
+void json_write_str(FILE *fp, const char *s);
 
 /* SELinux xattr helpers */
+#define SELCON_BUF 256 /* fits any label seen in practice */
+
 int set_selcon(const char *path, const char *con);
 int get_selcon(const char *path, char **out);
 int copy_selcon(const char *src, const char *dst);
 
+/* Label of path from the shared context cache: equal labels are the same
+ * pointer. st (may be NULL) is path's, to look up or remember it by inode.
+ * NULL with errno set if it cannot be read (ENOSPC: the cache is full).
+ */
+const char *selcon_lookup(const char *path, const struct stat *st);
+
+/* copy_selcon through the cache, leaving dst alone if it has the label.
+ * parent: the cached label of dst's directory, NULL if unknown; dst is only
+ * read back when it could have inherited the label from there. *out (may
+ * be NULL) gets dst's label from the cache, NULL if not known.
+ */
+int copy_selcon_st(const char *src, const struct stat *st, const char *dst, const char *parent,
+                   const char **out);
+
 /* Permission check */
 int root_check(void);
 
@@ -0,0 +1,174 @@
+#include "warmup.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* POSIX_FADV_WILLNEED only queues the reads; the threads overlap the opens
+ * and block map lookups that do wait on cold storage
+ */
+#define WARMUP_JOBS 4
+
+typedef struct {
+    MagicMount *ctx;
+    const Node **files;
+    size_t count;
+    atomic_size_t next;
+    uint64_t deadline;
+    atomic_int advised;
+    atomic_llong bytes;
+} Warmup;
+
+/* Whether name ends in one of the comma separated suffixes of exts */
+static bool warmup_wanted(const char *exts, const char *name) {
+    size_t len = strlen(name);
+
+    for (const char *p = exts; *p;) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+
+        if (n > 0 && n <= len && !memcmp(name + len - n, p, n))
+            return true;
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return false;
+}
+
+/* Regular module files of the tree whose name is wanted, in tree order */
+static int warmup_collect(Warmup *wu, Node *root) {
+    typedef struct {
+        const Node *node;
+        uint32_t next;
+    } Frame;
+    Frame *stack = NULL;
+    size_t depth = 0, cap = 0, fcap = 0;
+    int rc = -1;
+
+    for (const Node *n = root;;) {
+        if (n) {
+            if (depth == cap) {
+                size_t c = cap ? cap * 2 : 16;
+                Frame *arr = realloc(stack, c * sizeof(*arr));
+                if (!arr)
+                    goto out;
+                stack = arr;
+                cap = c;
+            }
+            stack[depth++] = (Frame){.node = n};
+        }
+        if (depth == 0)
+            break;
+
+        Frame *f = &stack[depth - 1];
+        if (f->next == f->node->child_count) {
+            depth--;
+            n = NULL;
+            continue;
+        }
+
+        const Node *c = node_children(f->node)[f->next++];
+        n = NULL;
+        if (c->skip)
+            continue;
+        if (c->type == NFT_DIRECTORY) {
+            n = c;
+            continue;
+        }
+        if (c->type != NFT_REGULAR || !c->origin ||
+            !warmup_wanted(wu->ctx->warmup.exts, c->name))
+            continue;
+
+        if (wu->count == fcap) {
+            size_t c2 = fcap ? fcap * 2 : 64;
+            const Node **arr = realloc(wu->files, c2 * sizeof(*arr));
+            if (!arr)
+                goto out;
+            wu->files = arr;
+            fcap = c2;
+        }
+        wu->files[wu->count++] = c;
+    }
+    rc = 0;
+
+out:
+    free(stack);
+    return rc;
+}
+
+static void *warmup_worker(void *arg) {
+    Warmup *wu = arg;
+    char path[PATH_MAX];
+
+    while (monotonic_ns() < wu->deadline) {
+        size_t i = atomic_fetch_add(&wu->next, 1);
+        if (i >= wu->count)
+            break;
+
+        if (node_module_path(wu->ctx, wu->files[i], path, sizeof(path)) != 0)
+            continue;
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOGD("warmup: open %s: %s", path, strerror(errno));
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            st.st_size <= wu->ctx->warmup.max_size) {
+            int err = posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+            if (err == 0) {
+                atomic_fetch_add(&wu->advised, 1);
+                atomic_fetch_add(&wu->bytes, (long long)st.st_size);
+            } else {
+                LOGD("warmup: fadvise %s: %s", path, strerror(err));
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+void warmup_run(MagicMount *ctx, Node *root) {
+    Warmup wu = {.ctx = ctx};
+    pthread_t tids[WARMUP_JOBS];
+    uint64_t start = monotonic_ns();
+    int spawned = 0;
+
+    if (warmup_collect(&wu, root) != 0) {
+        LOGW("warmup: out of memory, skipped");
+        free(wu.files);
+        return;
+    }
+
+    wu.deadline = start + (uint64_t)ctx->warmup.budget_ms * 1000000u;
+    if (wu.count > 1) {
+        int jobs = wu.count < WARMUP_JOBS ? (int)wu.count : WARMUP_JOBS;
+        for (; spawned < jobs - 1; ++spawned) {
+            if (pthread_create(&tids[spawned], NULL, warmup_worker, &wu) != 0)
+                break;
+        }
+    }
+    warmup_worker(&wu);
+    for (int i = 0; i < spawned; ++i)
+        pthread_join(tids[i], NULL);
+
+    size_t taken = atomic_load(&wu.next);
+    ctx->stats.warm_files = atomic_load(&wu.advised);
+    ctx->stats.warm_bytes = atomic_load(&wu.bytes);
+    ctx->stats.warm_left = taken < wu.count ? (int)(wu.count - taken) : 0;
+    ctx->stats.warm_ms = (long)((monotonic_ns() - start) / 1000000u);
+
+    LOGI("warmup: %d of %zu files, %lld KiB advised in %ld ms (%d left over budget)",
+         ctx->stats.warm_files, wu.count, ctx->stats.warm_bytes >> 10, ctx->stats.warm_ms,
+         ctx->stats.warm_left);
+    free(wu.files);
+}
@@ -0,0 +1,14 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "module_tree.h"
+
+/* Optional stage after the apply: have the kernel read ahead the module
+ * files just mounted that boot opens first (libraries, apks, dex, framework
+ * jars) while zygote is not up yet. Files are picked by ctx->warmup (name
+ * suffix, size), advised with POSIX_FADV_WILLNEED on WARMUP_JOBS threads
+ * until its time budget is spent, and counted in ctx->stats.
+ */
+void warmup_run(MagicMount *ctx, Node *root);
+
+#endif /* WARMUP_H */
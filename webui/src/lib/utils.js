@@ -9,6 +9,20 @@ export const DEFAULT_CONFIG = {
   verbose: false,
   umount: true,
   partitions: [],
+  jobs: 0,
+  applyjobs: 0,
+  treecache: "",
+  mountindex: "",
+  statsfile: "",
+  opstats: false,
+  tracefile: "",
+  mountapi: "legacy",
+  backend: "bind",
+  scanio: "sync",
+  warmup: false,
+  warmupexts: "",
+  warmupmaxsize: "",
+  warmupbudget: 0,
 };
 
 const CONFIG_PATH = "/data/adb/magic_mount/mm.conf";
@@ -64,6 +78,48 @@ export async function loadConfig() {
           .map((s) => s.trim())
           .filter(Boolean);
         break;
+      case "jobs":
+        result.jobs = parseInt(value, 10) || 0;
+        break;
+      case "apply_jobs":
+        result.applyjobs = parseInt(value, 10) || 0;
+        break;
+      case "tree_cache":
+        result.treecache = value;
+        break;
+      case "stats_file":
+        result.statsfile = value;
+        break;
+      case "trace_file":
+        result.tracefile = value;
+        break;
+      case "op_stats":
+        result.opstats = isTrueValue(value);
+        break;
+      case "mount_index":
+        result.mountindex = value;
+        break;
+      case "mount_api":
+        result.mountapi = value.toLowerCase() === "new" ? "new" : "legacy";
+        break;
+      case "backend":
+        result.backend = value.toLowerCase() === "overlay" ? "overlay" : "bind";
+        break;
+      case "scan_io":
+        result.scanio = value.toLowerCase() === "uring" ? "uring" : "sync";
+        break;
+      case "warmup":
+        result.warmup = isTrueValue(value);
+        break;
+      case "warmup_exts":
+        result.warmupexts = value;
+        break;
+      case "warmup_max_size":
+        result.warmupmaxsize = value;
+        break;
+      case "warmup_budget_ms":
+        result.warmupbudget = parseInt(value, 10) || 0;
+        break;
     }
   }
   return result;
@@ -87,6 +143,20 @@ export async function saveConfig(cfg) {
   lines.push(`umount=${cfg.umount ? "true" : "false"}`);
   if (cfg.partitions.length > 0)
     lines.push(`partitions=${cfg.partitions.join(",")}`);
+  if (cfg.jobs > 0) lines.push(`jobs=${cfg.jobs}`);
+  if (cfg.applyjobs > 0) lines.push(`apply_jobs=${cfg.applyjobs}`);
+  if (cfg.treecache) lines.push(`tree_cache=${cfg.treecache}`);
+  if (cfg.mountindex) lines.push(`mount_index=${cfg.mountindex}`);
+  if (cfg.statsfile) lines.push(`stats_file=${cfg.statsfile}`);
+  if (cfg.opstats) lines.push("op_stats=true");
+  if (cfg.tracefile) lines.push(`trace_file=${cfg.tracefile}`);
+  if (cfg.mountapi === "new") lines.push("mount_api=new");
+  if (cfg.backend === "overlay") lines.push("backend=overlay");
+  if (cfg.scanio === "uring") lines.push("scan_io=uring");
+  if (cfg.warmup) lines.push("warmup=true");
+  if (cfg.warmupexts) lines.push(`warmup_exts=${cfg.warmupexts}`);
+  if (cfg.warmupmaxsize) lines.push(`warmup_max_size=${cfg.warmupmaxsize}`);
+  if (cfg.warmupbudget > 0) lines.push(`warmup_budget_ms=${cfg.warmupbudget}`);
 
   const content = lines.join("\n").replace(/'/g, "'\\''");
   const shell = `mkdir -p "$(dirname "${CONFIG_PATH}")" && printf '%s\n' '${content}' > "${CONFIG_PATH}"`;